@@ -0,0 +1,292 @@
+"""Python bindings for the simulator, through bin/libatsim.so (`make lib`).
+
+Registers, IO, SRAM, EEPROM and flash are memoryviews straight into the
+machine, so state is read without copying. Only r can be written through its
+view. The rest are read-only, as writes through them would reach neither the
+peripherals nor the dirty pages restore copies back, so they are written with
+write instead. The timer counts in io are only brought up to date when the
+program reads them, or by read. SREG is only in io with PACKED_SREG, use the
+sreg property. The
+views are only valid until the machine is closed, and eeprom until it is
+loaded or map_eeprom is called.
+
+Runs release the GIL, as does every call through ctypes, so machines can run
+in parallel on their own threads. Runs are by run_for_cycles, so never use the
+JIT, whose code buffer is shared between machines.
+
+    with Machine("attiny85") as m:
+        m.load("test/fib/fib.bin")
+        m.run(100000)
+        print(m.cycles, m.r[24])
+"""
+
+from ctypes import (CDLL, CFUNCTYPE, POINTER, Structure, c_bool, c_char_p, c_size_t, c_uint8,
+                    c_uint32, c_uint64, c_void_p, byref)
+from os import environ, path
+from typing import Callable, List, Optional, Sequence
+
+DEFAULT_LIBRARY = path.join(path.abspath(path.dirname(__file__)), "bin", "libatsim.so")
+
+# The cores built into the library by default, see MCUS in the Makefile.
+CORES = ("ATTiny85", "ATTiny45", "ATTiny25")
+
+# Regions of binding_memory, see src/binding.c.
+REGION_R = 0
+REGION_IO = 1
+REGION_SRAM = 2
+REGION_EEPROM = 3
+REGION_FLASH = 4
+
+
+
+class PinChange(Structure):
+    """A change the program made to how it drives port B, see PinChange in
+    src/machine.h."""
+    _fields_ = [("cycle", c_uint64), ("ddr", c_uint8), ("port", c_uint8)]
+
+
+_PIN_CALLBACK = CFUNCTYPE(None, c_void_p, POINTER(PinChange), c_size_t)
+
+_LIBRARY: Optional[CDLL] = None
+
+
+def _library() -> CDLL:
+    """Load the library once, from ATSIM_LIBRARY if set."""
+    global _LIBRARY
+    if _LIBRARY is None:
+        _LIBRARY = CDLL(environ.get("ATSIM_LIBRARY", DEFAULT_LIBRARY))
+    return _LIBRARY
+
+
+class _Core:
+    """The functions of one MCU's core, which are prefixed with its name."""
+
+    def __init__(self, library: CDLL, name: str):
+        def function(symbol, restype, *argtypes):
+            f = getattr(library, "{}_{}".format(name, symbol))
+            f.restype = restype
+            f.argtypes = argtypes
+            return f
+
+        self.new = function("binding_new", c_void_p)
+        self.free = function("binding_free", None, c_void_p)
+        self.memory = function("binding_memory", c_void_p, c_void_p, c_uint8, POINTER(c_size_t))
+        self.read = function("binding_read", c_bool, c_void_p, c_uint8, c_uint32, c_void_p, c_size_t)
+        self.write = function("binding_write", c_bool, c_void_p, c_uint8, c_uint32, c_char_p, c_size_t)
+        self.pc = function("binding_pc", c_uint32, c_void_p)
+        self.set_pc = function("binding_set_pc", None, c_void_p, c_uint32)
+        self.sreg = function("binding_sreg", c_uint8, c_void_p)
+        self.set_sreg = function("binding_set_sreg", None, c_void_p, c_uint8)
+        self.cycles = function("binding_cycles", c_uint64, c_void_p)
+        self.state_new = function("binding_state_new", c_void_p)
+        self.state_free = function("binding_state_free", None, c_void_p)
+        self.load_memory = function("load_memory", None, c_void_p, c_char_p, c_size_t)
+        self.load_memory_from_file = function("load_memory_from_file", c_bool, c_void_p, c_char_p)
+        self.eeprom_map = function("eeprom_map", c_bool, c_void_p, c_char_p)
+        self.run_for_cycles = function("run_for_cycles", c_bool, c_void_p, c_uint64)
+        self.machine_snapshot = function("machine_snapshot", None, c_void_p, c_void_p)
+        self.machine_restore = function("machine_restore", None, c_void_p, c_void_p)
+        self.run_batch = function("binding_run_batch", c_bool, c_void_p, POINTER(c_void_p), c_size_t,
+                                  c_uint64, c_size_t, POINTER(c_bool))
+        # Only in builds with GPIO.
+        try:
+            self.gpio_callback = function("gpio_callback", None, c_void_p, _PIN_CALLBACK, c_void_p, c_uint64)
+            self.gpio_drive = function("gpio_drive", c_bool, c_void_p, c_uint64, c_uint8, c_uint8)
+            self.gpio_flush = function("gpio_flush", None, c_void_p)
+        except AttributeError:
+            self.gpio_callback = self.gpio_drive = self.gpio_flush = None
+
+
+def _core(mcu: str) -> _Core:
+    for name in CORES:
+        if name.lower() == mcu.lower():
+            return _Core(_library(), name)
+    raise ValueError("Unknown MCU {}, expected one of: {}".format(mcu, " ".join(CORES)))
+
+
+class Snapshot:
+    """A saved machine state, see machine_snapshot in src/machine.c. With
+    DIRTY_PAGES the machine remembers its last snapshot, so keep a snapshot
+    for as long as the machine it was taken of."""
+
+    def __init__(self, core: _Core):
+        self._state = None
+        self._core = core
+        self._state = core.state_new()
+        if not self._state:
+            raise MemoryError("Unable to allocate a snapshot")
+
+    def close(self) -> None:
+        """Free the state."""
+        if self._state:
+            self._core.state_free(self._state)
+            self._state = None
+
+    def __del__(self):
+        self.close()
+
+
+class Machine:
+    """A simulated MCU with nothing loaded."""
+
+    def __init__(self, mcu: str = CORES[0]):
+        self._machine = None
+        self._pin_callback = None
+        self._core = _core(mcu)
+        self._machine = self._core.new()
+        if not self._machine:
+            raise MemoryError("Unable to allocate a machine")
+        self._map_views()
+
+    def _view(self, region: int) -> memoryview:
+        size = c_size_t()
+        pointer = self._core.memory(self._machine, region, byref(size))
+        view = memoryview((c_uint8 * size.value).from_address(pointer)).cast("B")
+        return view if region == REGION_R else view.toreadonly()
+
+    def _map_views(self) -> None:
+        self.r = self._view(REGION_R)
+        self.io = self._view(REGION_IO)
+        self.sram = self._view(REGION_SRAM)
+        self.eeprom = self._view(REGION_EEPROM)
+        self.flash = self._view(REGION_FLASH)
+
+    def close(self) -> None:
+        """Free the machine, after which its views must not be used."""
+        if self._machine:
+            self._core.free(self._machine)
+            self._machine = None
+
+    def __enter__(self) -> "Machine":
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    def load(self, file_name: str) -> None:
+        """Load an ELF, Intel HEX or raw binary file, which clears flash,
+        EEPROM, registers, SRAM and CYCLES and ends any EEPROM mapping."""
+        if not self._core.load_memory_from_file(self._machine, file_name.encode()):
+            raise OSError("Unable to load {}".format(file_name))
+        self.eeprom = self._view(REGION_EEPROM)
+
+    def load_bytes(self, program: bytes) -> None:
+        """Load a raw program image, which clears flash, EEPROM, registers,
+        SRAM and CYCLES and ends any EEPROM mapping."""
+        self._core.load_memory(self._machine, program, len(program))
+        self.eeprom = self._view(REGION_EEPROM)
+
+    def map_eeprom(self, file_name: str) -> None:
+        """Keep EEPROM in a file, see eeprom_map in src/eeprom.c."""
+        if not self._core.eeprom_map(self._machine, file_name.encode()):
+            raise OSError("Unable to map EEPROM from {}".format(file_name))
+        self.eeprom = self._view(REGION_EEPROM)
+
+    def read(self, region: int, address: int, size: int) -> bytes:
+        """Read size bytes of one of the REGION_ constants from address, with
+        the timers up to date, see binding_read in src/binding.c."""
+        data = (c_uint8 * size)()
+        if not self._core.read(self._machine, region, address, data, size):
+            raise IndexError("Read of {} bytes at {} is out of range".format(size, address))
+        return bytes(data)
+
+    def write(self, region: int, address: int, data: bytes) -> None:
+        """Write data to one of the REGION_ constants from address, as the
+        program would, see binding_write in src/binding.c."""
+        if not self._core.write(self._machine, region, address, bytes(data), len(data)):
+            raise IndexError("Write of {} bytes at {} is out of range".format(len(data), address))
+
+    def run(self, cycles: int) -> bool:
+        """Run for at least cycles, returns True if the machine halted first."""
+        return self._core.run_for_cycles(self._machine, cycles)
+
+    def snapshot(self, into: Optional[Snapshot] = None) -> Snapshot:
+        """Save the machine's state, reusing into if given."""
+        snapshot = Snapshot(self._core) if into is None else into
+        self._core.machine_snapshot(self._machine, snapshot._state)
+        return snapshot
+
+    def restore(self, snapshot: Snapshot) -> None:
+        """Return to a snapshot of this machine."""
+        self._core.machine_restore(self._machine, snapshot._state)
+
+    def run_batch(self, snapshots: Sequence[Snapshot], cycles: int, threads: int = 0) -> List[bool]:
+        """Run each snapshot for at least cycles, across threads workers or one
+        per core if 0, leaving each where its run stopped for restore. The
+        program and anything else not in a snapshot are this machine's, apart
+        from on_pins and drive, which only apply to this machine's own runs, see
+        run_batch in src/batch.c. Returns whether each halted."""
+        states = (c_void_p * len(snapshots))(*(snapshot._state for snapshot in snapshots))
+        halted = (c_bool * len(snapshots))()
+        if not self._core.run_batch(self._machine, states, len(snapshots), cycles, threads, halted):
+            raise MemoryError("Unable to run a batch of {}".format(len(snapshots)))
+        return list(halted)
+
+    def _gpio(self) -> None:
+        if self._core.gpio_callback is None:
+            raise NotImplementedError("The library was built without GPIO")
+
+    def on_pins(self, callback: Optional[Callable[[List[PinChange]], None]], interval: int = 0) -> None:
+        """Pass the changes the program makes to port B to callback, in batches
+        once the first has waited interval cycles, or stop if None. Changes
+        still waiting when a run ends are passed by flush_pins, or once their
+        interval is up in a later run."""
+        self._gpio()
+        if callback is None:
+            self._core.gpio_callback(self._machine, _PIN_CALLBACK(), None, 0)
+            self._pin_callback = None
+            return
+
+        def changed(_, changes, n):
+            callback([PinChange(changes[i].cycle, changes[i].ddr, changes[i].port) for i in range(n)])
+
+        # Kept so that ctypes doesn't free it while the machine can call it.
+        self._pin_callback = _PIN_CALLBACK(changed)
+        self._core.gpio_callback(self._machine, self._pin_callback, None, interval)
+
+    def drive(self, cycle: int, driven: int, levels: int) -> None:
+        """Drive the pins set in driven to their bits in levels from cycle on,
+        or from now if cycle has passed, and release the rest."""
+        self._gpio()
+        if not self._core.gpio_drive(self._machine, cycle, driven, levels):
+            raise ValueError("Unable to drive the pins at cycle {}".format(cycle))
+
+    def flush_pins(self) -> None:
+        """Pass the changes still waiting to the callback of on_pins."""
+        self._gpio()
+        self._core.gpio_flush(self._machine)
+
+    @property
+    def pc(self) -> int:
+        """The program counter, in words."""
+        return self._core.pc(self._machine)
+
+    @pc.setter
+    def pc(self, pc: int) -> None:
+        self._core.set_pc(self._machine, pc)
+
+    @property
+    def sreg(self) -> int:
+        """The status register."""
+        return self._core.sreg(self._machine)
+
+    @sreg.setter
+    def sreg(self, sreg: int) -> None:
+        self._core.set_sreg(self._machine, sreg)
+
+    @property
+    def sp(self) -> int:
+        """The stack pointer."""
+        return self.io[0x3D] | (self.io[0x3E] << 8)
+
+    @sp.setter
+    def sp(self, sp: int) -> None:
+        self.write(REGION_IO, 0x3D, bytes((sp & 0xff, (sp >> 8) & 0xff)))
+
+    @property
+    def cycles(self) -> int:
+        """Cycles run since loading."""
+        return self._core.cycles(self._machine)
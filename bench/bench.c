@@ -0,0 +1,81 @@
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "machine.h"
+
+/* Times a workload with the fastest core enabled in this build, printing one
+   CSV row of results. */
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Run once counting instructions, which also warms the predecode cache and
+   the JIT before anything is timed. */
+static uint64_t count_instructions(Machine *m)
+{
+    uint64_t instructions = 0;
+    Reg16 last_pc = 0xffff;
+    while (last_pc != m->PC)
+    {
+        last_pc = m->PC;
+        machine_cycle(m);
+        instructions++;
+    }
+    return instructions;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        fputs("Usage: bench MODE WORKLOAD FILE [REPEATS]\n", stderr);
+        return 2;
+    }
+    const char *mode = argv[1];
+    const char *workload = argv[2];
+    const unsigned long repeats = argc > 4 ? strtoul(argv[4], NULL, 10) : 5;
+
+    /* Zeroed, as the rest of the machine isn't set by loading. */
+    Machine *m = calloc(1, MACHINE_SIZE);
+    if (m == NULL || !load_memory_from_file(m, argv[3]))
+    {
+        return 1;
+    }
+    MachineState initial;
+    save_machine_state(m, &initial);
+
+    const uint64_t instructions = count_instructions(m);
+    const uint64_t cycles = m->CYCLES;
+
+    /* The fastest of the repeats is reported, as it is the least disturbed by
+       anything else running. */
+    double best = 0;
+    for (unsigned long repeat = 0; repeat < repeats; repeat++)
+    {
+        restore_machine_state(m, &initial);
+        const double start = now();
+        run_until_halt(m);
+        const double seconds = now() - start;
+        if (m->CYCLES != cycles)
+        {
+            fprintf(stderr, "%s: %s took %" PRIu64 " cycles, expected %" PRIu64 "\n", workload, mode,
+                    m->CYCLES, cycles);
+            return 1;
+        }
+        if (repeat == 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+
+    printf("%s,%s,%" PRIu64 ",%" PRIu64 ",%.6f,%.0f,%.0f,%.3f\n", workload, mode, instructions, cycles,
+           best, instructions / best, cycles / best, best * 1e9 / instructions);
+    free(m);
+    return 0;
+}
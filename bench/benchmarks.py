@@ -0,0 +1,141 @@
+"""Benchmark each dispatch mode of the simulator against a set of AVR workloads.
+
+Results are printed as CSV with one row per workload and mode, so they can be
+compared between runs to catch performance regressions.
+"""
+
+from argparse import ArgumentParser, Namespace
+from os import listdir, path
+from shlex import split
+from shutil import copytree
+from subprocess import CalledProcessError, check_call, check_output
+from sys import stderr
+from tempfile import TemporaryDirectory
+from typing import List
+
+BENCH_ROOT = path.abspath(path.dirname(__file__))
+REPO_ROOT = path.join(BENCH_ROOT, "..")
+
+# Workloads as (name, directory), each directory builds <name>.bin with make
+WORKLOADS = (
+    ("fib", path.join(REPO_ROOT, "test", "fib")),
+    ("memcpy_crc", path.join(BENCH_ROOT, "memcpy_crc")),
+    ("softmul", path.join(BENCH_ROOT, "softmul")),
+    ("branchy", path.join(BENCH_ROOT, "branchy")),
+)
+
+# Dispatch modes as (name, options defined in config.h)
+MODES = (
+    ("linear", ("DECODE_LINEAR", )),
+    ("table", ()),
+    ("predecode", ("PREDECODE", )),
+    ("threaded", ("PREDECODE", "THREADED")),
+    ("jit", ("PREDECODE", "JIT")),
+)
+
+CSV_HEADER = ("workload,mode,instructions,cycles,seconds,instructions_per_second,"
+              "cycles_per_second,ns_per_instruction")
+
+BENCH_CONFIG = """\
+#ifndef __ATSIM_CONFIG
+#define __ATSIM_CONFIG
+
+#define MCU_ATTiny85
+
+{options}
+
+#endif
+"""
+
+
+def build_workloads() -> int:
+    """Build the AVR binaries for every workload."""
+    for name, workload_dir in WORKLOADS:
+        try:
+            check_call(["make", "-C", workload_dir, "{}.bin".format(name)], stdout=stderr)
+        except CalledProcessError as error:
+            print("BUILD FAILURE: workload '{}'".format(name), file=stderr)
+            return error.returncode
+    return 0
+
+
+def build_mode(build_dir: str, options: List[str], parsed_arguments: Namespace) -> str:
+    """Build the benchmark harness with the given config options, returning its path."""
+    src_dir = path.join(build_dir, "src")
+    copytree(path.join(REPO_ROOT, "src"), src_dir)
+
+    with open(path.join(src_dir, "config.h"), "w") as config_file:
+        config_file.write(
+            BENCH_CONFIG.format(options="\n".join("#define {}".format(option)
+                                                  for option in options)))
+
+    check_call([
+        parsed_arguments.python,
+        path.join(REPO_ROOT, "instructions.py"), "-o",
+        path.join(src_dir, "instructions.c")
+    ])
+
+    sources = [
+        path.join(src_dir, file_name) for file_name in sorted(listdir(src_dir))
+        if path.splitext(file_name)[-1] == ".c" and file_name not in ("atsim.c", "main.c")
+    ]
+    bench_path = path.join(build_dir, "bench")
+    check_call([parsed_arguments.cc, *split(parsed_arguments.cflags), "-I", src_dir,
+                path.join(BENCH_ROOT, "bench.c"), *sources, "-o", bench_path, "-lpthread"])
+    return bench_path
+
+
+def run_benchmarks(parsed_arguments: Namespace) -> int:
+    """Build and run every mode against every workload."""
+    print(CSV_HEADER, flush=True)
+    for mode, options in MODES:
+        if parsed_arguments.mode and mode not in parsed_arguments.mode:
+            continue
+        with TemporaryDirectory(prefix="atsim_bench") as build_dir:
+            try:
+                bench_path = build_mode(build_dir, list(options), parsed_arguments)
+            except CalledProcessError as error:
+                print("BUILD FAILURE: mode '{}'".format(mode), file=stderr)
+                return error.returncode
+
+            for name, workload_dir in WORKLOADS:
+                try:
+                    print(check_output([
+                        bench_path, mode, name,
+                        path.join(workload_dir, "{}.bin".format(name)),
+                        str(parsed_arguments.repeats)
+                    ]).decode().strip(),
+                          flush=True)
+                except CalledProcessError as error:
+                    print("BENCH FAILURE: workload '{}' in mode '{}'".format(name, mode),
+                          file=stderr)
+                    return error.returncode
+    return 0
+
+
+def main() -> int:
+    """Entry point."""
+    argument_parser = ArgumentParser()
+
+    argument_parser.add_argument("--cc", default="cc")
+    argument_parser.add_argument("--cflags", default="-std=c99 -O3")
+    argument_parser.add_argument("--python", default="python3")
+    argument_parser.add_argument("--repeats", type=int, default=5)
+    argument_parser.add_argument("--mode", action="append", choices=[mode for mode, _ in MODES])
+    argument_parser.add_argument("--no-build-workloads", action="store_true")
+
+    parsed_arguments = argument_parser.parse_args()
+
+    if parsed_arguments.repeats < 1:
+        argument_parser.error("--repeats must be at least 1")
+
+    if not parsed_arguments.no_build_workloads:
+        result = build_workloads()
+        if result != 0:
+            return result
+
+    return run_benchmarks(parsed_arguments)
+
+
+if __name__ == "__main__":
+    exit(main())
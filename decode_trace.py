@@ -0,0 +1,135 @@
+"""Decode a binary execution trace written by the simulator into text.
+
+Each line gives the program counter, opcode, instruction and operands, status
+register after the instruction, cycles taken and the last write it made.
+"""
+
+from argparse import ArgumentParser
+from struct import unpack_from
+from sys import stderr, stdout
+from typing import Iterator, Tuple
+
+from instructions import build_decode_table
+
+TRACE_MAGIC = b"ATTRACE"
+TRACE_FORMAT_RAW = b"R"
+TRACE_FORMAT_DELTA = b"D"
+
+RAW_RECORD = "<HHHHBBBx"
+RAW_RECORD_SIZE = 12
+
+SREG_FLAGS = "CZNVSHTI"
+
+# (pc, opcode, address, value, width, sreg, cycles)
+Record = Tuple[int, int, int, int, int, int, int]
+
+
+def read_varint(data: bytes, offset: int) -> Tuple[int, int]:
+    """Read an unsigned LEB128 varint, returning the value and new offset."""
+    value = 0
+    shift = 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if byte < 0x80:
+            return value, offset
+
+
+def unzigzag(value: int) -> int:
+    """Undo zigzag encoding of a signed value."""
+    return (value >> 1) ^ -(value & 1)
+
+
+def raw_records(data: bytes) -> Iterator[Record]:
+    """Parse fixed size records."""
+    for offset in range(0, len(data) - RAW_RECORD_SIZE + 1, RAW_RECORD_SIZE):
+        pc, opcode, address, value, sreg, width, cycles = unpack_from(RAW_RECORD, data, offset)
+        yield pc, opcode, address, value, width, sreg, cycles
+
+
+def delta_records(data: bytes) -> Iterator[Record]:
+    """Parse delta compressed records."""
+    offset = 0
+    last_pc = 0
+    last_address = 0
+    while offset < len(data):
+        pc_delta, offset = read_varint(data, offset)
+        pc = (last_pc + unzigzag(pc_delta)) & 0xffff
+        opcode, offset = read_varint(data, offset)
+        sreg = data[offset]
+        width = data[offset + 1] & 0x3
+        cycles = data[offset + 1] >> 2
+        offset += 2
+        address = 0
+        value = 0
+        if width != 0:
+            address_delta, offset = read_varint(data, offset)
+            address = (last_address + unzigzag(address_delta)) & 0xffff
+            value, offset = read_varint(data, offset)
+            last_address = address
+        last_pc = pc + 1
+        yield pc, opcode, address, value, width, sreg, cycles
+
+
+def decode_operands(instruction, opcode: int) -> str:
+    """Format the operands of a 16 bit instruction as the decoder would see them."""
+    offsets = {name: offset for name, *offset in instruction.var_offsets or ()}
+    operands = []
+    for name, variable in instruction.variables.items():
+        value = variable.decode(opcode)
+        if name in offsets:
+            add_val, *mul_val = offsets[name]
+            value = value * (mul_val[0] if mul_val else 1) + add_val
+        operands.append("{}={}".format(name, value))
+    return " ".join(operands)
+
+
+def format_sreg(sreg: int) -> str:
+    """Format the status register as flag letters, upper case when set."""
+    return "".join(flag if sreg & (1 << bit) else flag.lower()
+                   for bit, flag in reversed(list(enumerate(SREG_FLAGS))))
+
+
+def main() -> int:
+    """Entry point."""
+    argument_parser = ArgumentParser()
+    argument_parser.add_argument("trace_file", type=str, help="Trace file to decode.")
+    parsed_arguments = argument_parser.parse_args()
+
+    with open(parsed_arguments.trace_file, "rb") as trace_file:
+        data = trace_file.read()
+
+    if data[:len(TRACE_MAGIC)] != TRACE_MAGIC:
+        print("Not a trace file: {}".format(parsed_arguments.trace_file), file=stderr)
+        return 1
+    trace_format = data[len(TRACE_MAGIC):len(TRACE_MAGIC) + 1]
+    body = data[len(TRACE_MAGIC) + 1:]
+    if trace_format == TRACE_FORMAT_RAW:
+        records = raw_records(body)
+    elif trace_format == TRACE_FORMAT_DELTA:
+        records = delta_records(body)
+    else:
+        print("Unknown trace format: {!r}".format(trace_format), file=stderr)
+        return 1
+
+    decode_table = build_decode_table()
+    for pc, opcode, address, value, width, sreg, cycles in records:
+        instruction = decode_table[opcode]
+        if instruction is None:
+            text = "???"
+        elif instruction.is_32bit:
+            # Only the first word is recorded, so operands can't be shown
+            text = instruction.mnemonic
+        else:
+            text = "{} {}".format(instruction.mnemonic, decode_operands(instruction, opcode)).strip()
+        line = "{:04x}: {:04x} {:<24} {} {}".format(pc, opcode, text, format_sreg(sreg), cycles)
+        if width != 0:
+            line += " [{:04x}]={:0{}x}".format(address, value, width * 2)
+        stdout.write(line + "\n")
+    return 0
+
+
+if __name__ == "__main__":
+    exit(main())
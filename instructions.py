@@ -13,7 +13,9 @@ from argparse import ArgumentDefaultsHelpFormatter, ArgumentParser
 from dataclasses import dataclass
 from math import ceil
 from os import path
+import re
 from sys import stderr
+from zlib import crc32
 from typing import List, Optional, Tuple, Union
 
 try:
@@ -29,10 +31,27 @@ LINE_TERMINATORS = {
     "r": "\r",
     "nr": "\n\r"  # What are you, some kind of monster?
 }
+# Instructions which enter or leave a subroutine, used to track call stacks when profiling
+CALL_MNEMONICS = ("CALL", "EICALL", "ICALL", "RCALL")
+RETURN_MNEMONICS = ("RET", "RETI")
+# Branches which may close an idle loop, checked for fast forwarding
+LOOP_MNEMONICS = ("BRBC", "RJMP")
+# Instructions which set SREG I and always run the next instruction before an interrupt
+INTERRUPT_ENABLES = {"BSET": "if(s == SREG_I) InhibitInterrupts(m);", "RETI": "InhibitInterrupts(m);"}
+# Conditional branches, the only instructions which may end a superinstruction
+BRANCH_MNEMONICS = ("BRBC", "BRBS")
+FUSION_MAX_PARTS = 3
+# Operands stored in DecodedInstruction (see machine.h) and their widths in bits
+DECODED_OPERANDS = {"A": 8, "K": 8, "b": 8, "d": 8, "k": 32, "q": 8, "r": 8, "s": 8}
 
 
 def indented(to_indent: str, indent_depth: int = 1, indent_chars: str = "    ") -> str:
-    """Indent the input string."""
+    """Indent the input string.
+
+    Preprocessor directives are left at the start of the line.
+    """
+    if to_indent.startswith("#"):
+        return to_indent
     return "{}{}".format(indent_chars * indent_depth, to_indent)
 
 
@@ -145,6 +164,17 @@ class Variable:
 
         return bracket_string.format(" | ".join(group_strings))
 
+    def decode(self, opcode: int) -> int:
+        """Decode the variable from an opcode at generation time.
+
+        This mirrors the C produced by generate_decoder so that decisions made
+        in Python (such as precondition collisions) agree with the C decoder.
+        """
+        value = 0
+        for index, bit in enumerate(sorted(self.bits)):
+            value |= ((opcode >> bit) & 0x1) << index
+        return value
+
 
 @dataclass
 class Instruction:
@@ -166,6 +196,8 @@ class Instruction:
     flag_c: Optional[str] = None
     precondition: Optional[str] = None
     pc_post_inc: int = 1
+    cycles: int = 1
+    cycles_taken: Optional[int] = None
     var_offsets: Optional[Tuple[Union[Tuple[str, int], Tuple[str, int, int]], ...]] = None
 
     @property
@@ -178,6 +210,21 @@ class Instruction:
         """Get number of words in this instruction."""
         return 2 if self.is_32bit else 1
 
+    @property
+    def may_skip(self):
+        """Return true if this instruction may cause the next instruction to be skipped."""
+        return "m->SKIP" in self.operation or "m->SKIP" in (self.writeback or "")
+
+    @property
+    def ends_block(self):
+        """Return true if this instruction ends a basic block.
+
+        This is the case for any instruction which may transfer control, skip the
+        following instruction or write to program memory.
+        """
+        code = self.operation + (self.writeback or "")
+        return self.may_skip or "SetPC" in code or "SetProgMem" in code
+
     @property
     def plain_opcode(self):
         """Get plain 16bit opcode."""
@@ -263,26 +310,42 @@ class Instruction:
     def check_reads(self):
         """Get the code to perform pre-operation flag reads."""
         if self.flag_c:
-            yield "bool C = m->SREG[SREG_C];"
+            yield "bool C = ReadStatusFlag(m, SREG_C);"
 
         if self.flag_z:
-            yield "bool Z = m->SREG[SREG_Z];"
+            yield "bool Z = ReadStatusFlag(m, SREG_Z);"
 
         if self.flag_n:
-            yield "bool N = m->SREG[SREG_N];"
+            yield "bool N = ReadStatusFlag(m, SREG_N);"
 
         if self.flag_v:
-            yield "bool V = m->SREG[SREG_V];"
+            yield "bool V = ReadStatusFlag(m, SREG_V);"
 
         if self.flag_s:
-            yield "bool S = m->SREG[SREG_S];"
+            yield "bool S = ReadStatusFlag(m, SREG_S);"
 
         if self.flag_h:
-            yield "bool H = m->SREG[SREG_H];"
+            yield "bool H = ReadStatusFlag(m, SREG_H);"
 
     @property
     def check_writes(self):
-        """Get the code to perform post-operation flag writes."""
+        """Get the code to perform post-operation flag writes.
+
+        A packed SREG is updated with a single store of all written flags.
+        """
+        if not self.flags:
+            return
+        yield "#ifdef PACKED_SREG"
+        yield "m->SREG_BYTE = (m->SREG_BYTE & ~{}) | {};".format(
+            self.flag_mask,
+            " | ".join("({f} << SREG_{f})".format(f=flag) for flag in "CZNVSH" if flag in self.flags))
+        yield "#else"
+        yield from self.unpacked_check_writes
+        yield "#endif"
+
+    @property
+    def unpacked_check_writes(self):
+        """Get the code to write each flag to an unpacked SREG."""
         if self.flag_c:
             yield "m->SREG[SREG_C] = C;"
 
@@ -301,14 +364,165 @@ class Instruction:
         if self.flag_h:
             yield "m->SREG[SREG_H] = H;"
 
+    @property
+    def flags(self):
+        """Get the flags written by this instruction in the order they are checked."""
+        flags = {}
+        for flag, logic in (("N", self.flag_n), ("Z", self.flag_z), ("C", self.flag_c),
+                            ("H", self.flag_h), ("V", self.flag_v), ("S", self.flag_s)):
+            if logic:
+                flags[flag] = logic
+        return flags
+
+    @property
+    def flag_mask(self):
+        """Get the mask of SREG bits written by this instruction."""
+        positions = {"C": 0, "Z": 1, "N": 2, "V": 3, "S": 4, "H": 5}
+        return "0x{:02x}".format(sum(1 << positions[flag] for flag in self.flags))
+
+    @property
+    def operation_flags(self):
+        """Get the flags read by the operation itself, e.g. C for ADC."""
+        code = self.operation + (self.writeback or "")
+        return [flag for flag in "CZNVSH" if re.search(r"\b{}\b".format(flag), code)]
+
+    @property
+    def needs_old_flags(self):
+        """Return true if this instruction depends on flag values from before it.
+
+        This is the case if the operation reads a flag, or a flag's logic uses a
+        flag which has not been updated yet (or itself, as CPC does with Z).
+        """
+        if self.operation_flags:
+            return True
+        updated = set()
+        for flag, logic in self.flags.items():
+            if logic != "_" and set(re.findall(r"\b[CZNVSH]\b", logic)).difference(updated):
+                return True
+            updated.add(flag)
+        return False
+
+    @property
+    def lazy_operands(self):
+        """Get the type and value of the operands recorded for lazy flag evaluation.
+
+        These are the destination operand (Rd), the source operand or constant
+        (Rr or K) and the result (R), as used by the flag logic.
+        """
+        checks = "\n".join(self.checks)
+        read_sizes = {"R{}".format(index): size for _, index, size in (self.reads or ())}
+        result = re.search(r"const (\w+) R =", self.operation)
+        if result is None:
+            raise ValueError("Flags of {} have no result R".format(self.mnemonic))
+        operands = []
+        for slot, name in (("Rd", "Rd"), ("Rr", "Rr"), ("Rr", "K"), ("R", "R")):
+            if re.search(r"\b{}\b".format(name), checks):
+                if name == "R":
+                    operand_type = result.group(1)
+                elif name == "K":
+                    operand_type = self.variables["K"].data_type
+                else:
+                    operand_type = data_type(read_sizes[name], prefix="Reg", postfix="")
+                operands.append((slot, name, operand_type))
+        return operands
+
+    @property
+    def defer_flags(self):
+        """Get the code to record this instruction's flag inputs for lazy evaluation."""
+        values = {slot: name for slot, name, _ in self.lazy_operands}
+        return "DeferFlags(m, {}, {}, {}, {}, {});".format(handler_name(self), self.flag_mask,
+                                                           values.get("Rd", "0"),
+                                                           values.get("Rr", "0"),
+                                                           values.get("R", "0"))
+
+    @property
+    def trace_write(self):
+        """Get the TraceWrite arguments for the register or IO register this writes directly.
+
+        Writes through SetDataMem and SetIO are traced as they happen, so only
+        direct assignments need to be found here. Pointer updates of X, Y and Z
+        are not traced as they can be recovered from the instruction.
+        """
+        code = self.operation + (self.writeback or "")
+        pair = re.search(r"Set16\(m->R\[([^\]]+)\], m->R\[([^\]]+)\]", code)
+        if pair:
+            return "{l}, Get16(m->R[{h}], m->R[{l}]), 2".format(h=pair.group(1), l=pair.group(2))
+        registers = re.findall(r"m->R\[([^\]]+)\] = ", code)
+        if registers:
+            return "{r}, m->R[{r}], 1".format(r=registers[-1])
+        io_registers = re.findall(r"m->IO\[([^\]]+)\] = ", code)
+        if io_registers:
+            return "GP_REGISTERS + {a}, m->IO[{a}], 1".format(a=io_registers[-1])
+        return None
+
+    @property
+    def operand_decoders(self):
+        """Get the code to extract all operands from an opcode into a decoded instruction."""
+        # Get offsets if they exist
+        if self.var_offsets:
+            offsets_dict = {k: v for k, *v in self.var_offsets}
+        else:
+            offsets_dict = {}
+
+        for name, variable in self.variables.items():
+            if variable.bit_width > DECODED_OPERANDS.get(name, 0):
+                raise ValueError("Operand {} of {} does not fit in DecodedInstruction".format(
+                    name, self.mnemonic))
+            decoder = "i->{} = {{}}{}{{}};".format(
+                name,
+                variable.generate_decoder(var="extended_opcode" if self.is_32bit else "opcode"))
+            if name in offsets_dict:
+                add_val, *mul_val = offsets_dict[name]
+                if mul_val:
+                    mul_val = mul_val[0]
+                    yield decoder.format("({} * ".format(mul_val), ") + {}".format(add_val))
+                else:
+                    yield decoder.format("", " + {}".format(add_val))
+            else:
+                yield decoder.format("", "")
+
     @property
     def code(self):
-        """Get the function which performs this instruction's operation."""
+        """Get the functions which decode and perform this instruction's operation."""
         # Macro to allow removal of instruction in C code
         yield "#ifndef INSTRUCTION_{}_MISSING".format(self.mnemonic.upper())
 
+        # Start of decoder
+        yield ("static inline void decode_{}(DecodedInstruction *i, Mem16 opcode, Mem16 extension)"
+               ).format(self.mnemonic.lower())
+        yield "{"
+
+        # Only 32 bit instructions make use of the following word
+        if not self.is_32bit:
+            yield indented("UNUSED(extension);")
+
+        # Section heading
+        if any(self.variables):
+            yield indented("/* Extract operands from opcode. */")
+
+        # If this is a 32 bit instruction the operands span the following word too
+        if self.is_32bit:
+            yield indented("const Mem32 extended_opcode = ((Mem32)opcode << 16) | extension;")
+
+        # Macro to mark any unused variables as "used" to avoid compiler warnings
+        if not any(self.variables):
+            yield indented("/* No operands in opcode so mark as unused. */")
+            yield indented("UNUSED(opcode);")
+
+        # Code to extract variables from opcodes
+        for operand_decoder in self.operand_decoders:
+            yield indented(operand_decoder)
+
+        yield indented("i->handler = {};".format(handler_name(self)))
+        yield indented("i->words = {};".format(self.words))
+        yield indented("i->ends_block = {};".format("true" if self.ends_block else "false"))
+
+        # End of decoder
+        yield "}"
+        yield ""
+
         # Start of implementation
-        yield "static inline void instruction_{}(Machine *m, Mem16 opcode)".format(
+        yield "static inline void execute_{}(Machine *m, const DecodedInstruction *i)".format(
             self.mnemonic.lower())
         yield "{"
 
@@ -319,38 +533,23 @@ class Instruction:
         yield "#ifdef DEBUG_PRINT_MNEMONICS"
         yield indented('puts("{} {}");'.format(self.mnemonic, self.full_plain_opcode))
         yield "#endif"
+        yield "#ifdef PROFILE"
+        yield indented("ProfileInstruction(m, {});".format(handler_name(self)))
+        yield "#endif"
+        yield "#ifdef TRACE"
+        yield indented("TraceBegin(m);")
+        yield "#endif"
 
         # Section heading
         if any(self.variables):
-            yield indented("/* Extract operands from opcode. */")
-
-        # Get offsets if they exist
-        if self.var_offsets:
-            offsets_dict = {k: v for k, *v in self.var_offsets}
+            yield indented("/* Read decoded operands. */")
         else:
-            offsets_dict = {}
-
-        # If this is a 32 bit instruction we need to perform a second fetch of a word from memory
-        if self.is_32bit:
-            yield indented(
-                "const Mem32 extended_opcode = (opcode << 16) | GetProgMem(m, ((GetPC(m) + 1) & PC_MASK));"
-            )
+            yield indented("/* No operands in opcode so mark as unused. */")
+            yield indented("UNUSED(i);")
 
-        # Code to extract variables from opcodes
+        # Code to read the already extracted operands
         for name, variable in self.variables.items():
-            decoder = "const {} {} = {{}}{}{{}};".format(
-                variable.data_type, name,
-                variable.generate_decoder(var="extended_opcode" if self.is_32bit else "opcode"))
-            if name in offsets_dict:
-                add_val, *mul_val = offsets_dict[name]
-                if mul_val:
-                    mul_val = mul_val[0]
-                    yield indented(
-                        decoder.format("({} * ".format(mul_val), ") + {}".format(add_val)))
-                else:
-                    yield indented(decoder.format("", " + {}".format(add_val)))
-            else:
-                yield indented(decoder.format("", ""))
+            yield indented("const {} {n} = i->{n};".format(variable.data_type, n=name))
             yield "#ifdef DEBUG_PRINT_OPERANDS"
             if name in ("K", ):
                 yield indented('printf("  {n} = 0x%04x\\n", {n});'.format(n=name))
@@ -363,11 +562,6 @@ class Instruction:
             yield indented("/* Assert preconditions. */")
             yield indented("PRECONDITION({});".format(self.precondition))
 
-        # Macro to mark any unused variables as "used" to avoid compiler warnings
-        if not any(self.variables):
-            yield indented("/* No operands in opcode so mark as unused. */")
-            yield indented("UNUSED(opcode);")
-
         # Section heading
         if any(self.var_reads):
             yield indented("/* Read vars for operation. */")
@@ -376,6 +570,17 @@ class Instruction:
         for var_read in self.var_reads:
             yield indented(var_read)
 
+        # With lazy flags only the flags read by the operation are needed, and
+        # only once any deferred flags have been brought up to date.
+        if self.flags:
+            yield "#ifdef LAZY_FLAGS"
+            if self.needs_old_flags:
+                yield indented("/* Materialise flags for operation. */")
+                yield indented("MaterialiseFlags(m);")
+            for flag in self.operation_flags:
+                yield indented("bool {f} = ReadStatusFlag(m, SREG_{f});".format(f=flag))
+            yield "#else"
+
         # Section heading
         if any(self.check_reads):
             yield indented("/* Read flags for operation. */")
@@ -384,12 +589,25 @@ class Instruction:
         for check_read in self.check_reads:
             yield indented(check_read)
 
+        if self.flags:
+            yield "#endif"
+
         # Section heading
         yield indented("/* Perform instruction operation. */")
 
         # Perform operation of instruction
         yield indented(self.operation)
 
+        # Flags are deferred until they are needed when using lazy flags
+        if self.flags:
+            yield "#ifdef LAZY_FLAGS"
+            if self.writeback:
+                yield indented("/* Writeback vars. */")
+                yield indented(self.writeback)
+            yield indented("/* Defer flags. */")
+            yield indented(self.defer_flags)
+            yield "#else"
+
         # Section heading
         if any(self.checks):
             yield indented("/* Update flags. */")
@@ -412,27 +630,96 @@ class Instruction:
         for check_write in self.check_writes:
             yield indented(check_write)
 
+        if self.flags:
+            yield "#endif"
+
+        # Registers written directly rather than through SetDataMem are traced here
+        if self.trace_write:
+            yield "#ifdef TRACE"
+            yield indented("TraceWrite(m, {});".format(self.trace_write))
+            yield "#endif"
+
+        # Count cycles, branches record whether they were taken in "taken". The
+        # cost of skipping an instruction is counted where it is skipped.
+        yield indented("/* Count cycles. */")
+        if self.cycles_taken is not None:
+            yield indented("m->CYCLES += taken ? {} : {};".format(self.cycles_taken, self.cycles))
+        else:
+            yield indented("m->CYCLES += {};".format(self.cycles))
+
+        # Branches and skips count how often they were taken when profiling
+        if self.cycles_taken is not None or self.may_skip:
+            yield "#ifdef PROFILE"
+            yield indented("ProfileBranch(m, {});".format(
+                "taken" if self.cycles_taken is not None else "m->SKIP"))
+            yield "#endif"
+
         # Perform PC post increment/decrement if applicable
         if self.pc_post_inc != 0:
             yield indented("/* Increment PC. */")
             yield indented("SetPC(m, GetPC(m) + {});".format(self.pc_post_inc))
 
+        # Calls and returns move through the call tree once PC is final
+        if self.mnemonic in CALL_MNEMONICS + RETURN_MNEMONICS:
+            yield "#ifdef PROFILE"
+            yield indented("profile_call(m);" if self.mnemonic in
+                           CALL_MNEMONICS else "ProfileReturn(m);")
+            yield "#endif"
+
+        # SEI and RETI hold off interrupts until the next instruction, which
+        # starts at the cycle they end on
+        if self.mnemonic in INTERRUPT_ENABLES:
+            yield "#ifdef INTERRUPTS"
+            yield indented(INTERRUPT_ENABLES[self.mnemonic])
+            yield "#endif"
+
+        if self.mnemonic in LOOP_MNEMONICS:
+            yield "#ifdef FAST_FORWARD"
+            yield indented("FastForward(m);")
+            yield "#endif"
+
+        yield "#ifdef TRACE"
+        yield indented("TraceEnd(m);")
+        yield "#endif"
+
         # End of implementation
         yield "}"
 
         # If instruction is "missing" then yield no implementation.
         yield "#else"
-        yield "static inline void instruction_{}(Machine *m, Mem16 opcode)".format(
+        yield ("static inline void decode_{}(DecodedInstruction *i, Mem16 opcode, Mem16 extension)"
+               ).format(self.mnemonic.lower())
+        yield "{"
+        yield indented("UNUSED(opcode);")
+        yield indented("UNUSED(extension);")
+        yield indented("i->handler = {};".format(handler_name(self)))
+        yield indented("i->words = {};".format(self.words))
+        # Missing instructions do not increment PC so must end a block
+        yield indented("i->ends_block = true;")
+        yield "}"
+        yield ""
+        yield "static inline void execute_{}(Machine *m, const DecodedInstruction *i)".format(
             self.mnemonic.lower())
         yield "{"
         # Produce a warning and perform no actual operation
         # NB: this does not increment PC
-        yield indented("UNUSED(opcode);")
+        yield indented("UNUSED(i);")
         yield indented("UNUSED(m);")
-        yield indented('puts("Warning: Instruction {} not present on MCU");'.format(
+        yield indented('fputs("Warning: Instruction {} not present on MCU\\n", stderr);'.format(
             self.mnemonic.upper()))
         yield "}"
         yield "#endif"
+        yield ""
+
+        # Decode and execute in one step for when an opcode is not predecoded
+        yield "static inline void instruction_{}(Machine *m, Mem16 opcode)".format(
+            self.mnemonic.lower())
+        yield "{"
+        yield indented("DecodedInstruction i;")
+        yield indented("decode_{}(&i, opcode, {});".format(
+            self.mnemonic.lower(), "GetProgMem(m, GetPC(m) + 1)" if self.is_32bit else "0"))
+        yield indented("execute_{}(m, &i);".format(self.mnemonic.lower()))
+        yield "}"
 
 
 # Instruction definitions
@@ -461,6 +748,7 @@ INSTRUCTIONS = (
                 flag_c="Rd7 & Rr7 | Rr7 & !R7 | !R7 & Rd7"),
     Instruction(mnemonic="ADIW",
                 opcode="1001_0110_KKdd_KKKK",
+                cycles=2,
                 var_offsets=(("d", 24, 2), ),
                 reads=(("R", "d", 16), ),
                 operation="const Reg16 R = Rd + K;",
@@ -507,22 +795,28 @@ INSTRUCTIONS = (
     Instruction(mnemonic="BSET", opcode="1001_0100_0sss_1000", operation="SetStatusFlag(m, s);"),
     Instruction(mnemonic="BLD",
                 opcode="1111_100d_dddd_0bbb",
-                operation="m->R[d] = m->SREG[SREG_T] ? SetBit(m->R[d], b) : ClearBit(m->R[d], b);"),
+                operation="m->R[d] = GetStatusFlag(m, SREG_T) ? SetBit(m->R[d], b) : ClearBit(m->R[d], b);"),
     Instruction(mnemonic="BRBC",
                 opcode="1111_01kk_kkkk_ksss",
-                operation="if(!GetStatusFlag(m, s)) SetPC(m, GetPC(m) + ToSigned(k, 7));"),
+                operation="const bool taken = !GetStatusFlag(m, s);",
+                writeback="if(taken) SetPC(m, GetPC(m) + ToSigned(k, 7));",
+                cycles_taken=2),
     Instruction(mnemonic="BRBS",
                 opcode="1111_00kk_kkkk_ksss",
-                operation="if(GetStatusFlag(m, s)) SetPC(m, GetPC(m) + ToSigned(k, 7));"),
+                operation="const bool taken = GetStatusFlag(m, s);",
+                writeback="if(taken) SetPC(m, GetPC(m) + ToSigned(k, 7));",
+                cycles_taken=2),
     Instruction(mnemonic="BREAK", opcode="1001_0101_1001_1000", operation="interactive_break(m);"),
     Instruction(mnemonic="CALL",
                 opcode="1001_010k_kkkk_111k_kkkk_kkkk_kkkk_kkkk",
+                cycles=4,
                 operation="PushStack16(m, m->PC + 2);",
                 writeback="SetPC(m, k);",
                 pc_post_inc=0),
     Instruction(mnemonic="CBI",
                 opcode="1001_1000_AAAA_Abbb",
-                operation="m->IO[A] = ClearBit(m->IO[A], b);"),
+                cycles=2,
+                operation="SetIOBit(m, A, b, false);"),
     Instruction(mnemonic="COM",
                 opcode="1001_010d_dddd_0000",
                 reads=(("R", "d", 8), ),
@@ -586,8 +880,9 @@ INSTRUCTIONS = (
                 flag_z="_"),
     Instruction(mnemonic="IJMP",
                 opcode="1001_0100_0000_1001",
+                cycles=2,
                 operation="SetPC(m, Get16(m->Z_H, m->Z_L));"),
-    Instruction(mnemonic="IN", opcode="1011_0AAd_dddd_AAAA", operation="m->R[d] = m->IO[A];"),
+    Instruction(mnemonic="IN", opcode="1011_0AAd_dddd_AAAA", operation="m->R[d] = GetIO(m, A);"),
     Instruction(mnemonic="INC",
                 opcode="1001_010d_dddd_0011",
                 reads=(("R", "d", 8), ),
@@ -599,52 +894,65 @@ INSTRUCTIONS = (
                 flag_z="_"),
     Instruction(mnemonic="JMP",
                 opcode="1001_010k_kkkk_110k_kkkk_kkkk_kkkk_kkkk",
+                cycles=3,
                 operation="SetPC(m, k);",
                 pc_post_inc=2),
     Instruction(mnemonic="LD_X_i",
                 opcode="1001_000d_dddd_1100",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->X_H, m->X_L));"),
     Instruction(mnemonic="LD_X_ii",
                 opcode="1001_000d_dddd_1101",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->X_H, m->X_L));",
                 writeback="Set16(m->X_H, m->X_L, Get16(m->X_H, m->X_L) + 1);"),
     Instruction(mnemonic="LD_X_iii",
                 opcode="1001_000d_dddd_1110",
+                cycles=2,
                 operation="Set16(m->X_H, m->X_L, Get16(m->X_H, m->X_L) - 1);",
                 writeback="m->R[d] = GetDataMem(m, Get16(m->X_H, m->X_L));"
                 ),  # Bit of a hack reordering here but fine as no checks
     Instruction(mnemonic="LD_Y_i",
                 opcode="1000_000d_dddd_1000",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->Y_H, m->Y_L));"),
     Instruction(mnemonic="LD_Y_ii",
                 opcode="1001_000d_dddd_1001",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->Y_H, m->Y_L));",
                 writeback="Set16(m->Y_H, m->Y_L, Get16(m->Y_H, m->Y_L) + 1);"),
     Instruction(mnemonic="LD_Y_iii",
                 opcode="1001_000d_dddd_1010",
+                cycles=2,
                 operation="Set16(m->Y_H, m->Y_L, Get16(m->Y_H, m->Y_L) - 1);",
                 writeback="m->R[d] = GetDataMem(m, Get16(m->Y_H, m->Y_L));"
                 ),  # Bit of a hack reordering here but fine as no checks
     Instruction(mnemonic="LD_Y_iv",
                 opcode="10q0_qq0d_dddd_1qqq",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->Y_H, m->Y_L) + q);"),
     Instruction(mnemonic="LD_Z_i",
                 opcode="1000_000d_dddd_0000",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->Z_H, m->Z_L));"),
     Instruction(mnemonic="LD_Z_ii",
                 opcode="1001_000d_dddd_0001",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->Z_H, m->Z_L));",
                 writeback="Set16(m->Z_H, m->Z_L, Get16(m->Z_H, m->Z_L) + 1);"),
     Instruction(mnemonic="LD_Z_iii",
                 opcode="1001_000d_dddd_0010",
+                cycles=2,
                 operation="Set16(m->Z_H, m->Z_L, Get16(m->Z_H, m->Z_L) - 1);",
                 writeback="m->R[d] = GetDataMem(m, Get16(m->Z_H, m->Z_L));"
                 ),  # Bit of a hack reordering here but fine as no checks
     Instruction(mnemonic="LD_Z_iv",
                 opcode="10q0_qq0d_dddd_0qqq",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, Get16(m->Z_H, m->Z_L) + q);"),
     Instruction(mnemonic="LDS",
                 opcode="1001_000d_dddd_0000_kkkk_kkkk_kkkk_kkkk",
+                cycles=2,
                 operation="m->R[d] = GetDataMem(m, k);",
                 pc_post_inc=2),
     Instruction(mnemonic="LDI",
@@ -653,13 +961,16 @@ INSTRUCTIONS = (
                 operation="m->R[d] = K;"),
     Instruction(mnemonic="LPM_i",
                 opcode="1001_0101_1100_1000",
+                cycles=3,
                 operation="m->R[0] = GetProgMemByte(m, Get16(m->Z_H, m->Z_L));"),
     Instruction(mnemonic="LPM_ii",
                 opcode="1001_000d_dddd_0100",
+                cycles=3,
                 operation="m->R[d] = GetProgMemByte(m, Get16(m->Z_H, m->Z_L));",
                 writeback="Set16(m->Z_H, m->Z_L, Get16(m->Z_H, m->Z_L) + 1);"),
     Instruction(mnemonic="LPM_iii",
                 opcode="1001_000d_dddd_0101",
+                cycles=3,
                 operation="Set16(m->Z_H, m->Z_L, Get16(m->Z_H, m->Z_L) - 1);",
                 writeback="m->R[d] = GetProgMemByte(m, Get16(m->Z_H, m->Z_L));"
                 ),  # Bit of a hack reordering here but fine as no checks
@@ -688,10 +999,10 @@ INSTRUCTIONS = (
     Instruction(mnemonic="MOV", opcode="0010_11rd_dddd_rrrr", operation="m->R[d] = m->R[r];"),
     Instruction(mnemonic="MOVW",
                 opcode="0000_0001_dddd_rrrr",
-                operation="m->R[(d<<1) + 1] = m->R[(r<<1) + 1];",
-                writeback="m->R[d<<1] = m->R[r<<1];"),
+                operation="Set16(m->R[(d<<1) + 1], m->R[d<<1], Get16(m->R[(r<<1) + 1], m->R[r<<1]));"),
     Instruction(mnemonic="MUL",
                 opcode="1001_11rd_dddd_rrrr",
+                cycles=2,
                 reads=(("R", "d", 8), ("R", "r", 8)),
                 operation="const Reg16 R = Rd * Rr;",
                 writeback="Set16(m->R[1], m->R[0], R);",
@@ -732,22 +1043,35 @@ INSTRUCTIONS = (
         flag_n="R7",
         flag_z="_",
     ),
-    Instruction(mnemonic="OUT", opcode="1011_1AAr_rrrr_AAAA", operation="m->IO[A] = m->R[r];"),
-    Instruction(mnemonic="POP", opcode="1001_000d_dddd_1111", operation="m->R[d] = PopStack8(m);"),
+    Instruction(mnemonic="OUT", opcode="1011_1AAr_rrrr_AAAA", operation="SetIO(m, A, m->R[r]);"),
+    Instruction(mnemonic="POP",
+                opcode="1001_000d_dddd_1111",
+                cycles=2,
+                operation="m->R[d] = PopStack8(m);"),
     Instruction(mnemonic="PUSH",
                 opcode="1001_001d_dddd_1111",
+                cycles=2,
                 reads=(("R", "d", 8), ),
                 operation="PushStack8(m, Rd);"),
     Instruction(mnemonic="RCALL",
                 opcode="1101_kkkk_kkkk_kkkk",
+                cycles=3,
                 operation="PushStack16(m, m->PC + 1);",
                 writeback="SetPC(m, GetPC(m) + ToSigned(k, 12));"),
     Instruction(mnemonic="RET",
                 opcode="1001_0101_0000_1000",
+                cycles=4,
+                operation="SetPC(m, PopStack16(m));",
+                pc_post_inc=0),
+    Instruction(mnemonic="RETI",
+                opcode="1001_0101_0001_1000",
+                cycles=4,
                 operation="SetPC(m, PopStack16(m));",
+                writeback="SetStatusFlag(m, SREG_I);",
                 pc_post_inc=0),
     Instruction(mnemonic="RJMP",
                 opcode="1100_kkkk_kkkk_kkkk",
+                cycles=2,
                 operation="SetPC(m, GetPC(m) + ToSigned(k, 12));"),
     Instruction(mnemonic="ROL",
                 opcode="0001_11rd_dddd_rrrr",
@@ -796,7 +1120,8 @@ INSTRUCTIONS = (
                 flag_c="!Rd7 & K7 | K7 & R7 | R7 & !Rd7"),
     Instruction(mnemonic="SBI",
                 opcode="1001_1010_AAAA_Abbb",
-                operation="m->IO[A] = SetBit(m->IO[A], b);"),
+                cycles=2,
+                operation="SetIOBit(m, A, b, true);"),
     Instruction(mnemonic="SBIC",
                 opcode="1001_1001_AAAA_Abbb",
                 operation="if(!TestBit(m->IO[A], b)) m->SKIP = true;"),
@@ -805,6 +1130,7 @@ INSTRUCTIONS = (
                 operation="if(TestBit(m->IO[A], b)) m->SKIP = true;"),
     Instruction(mnemonic="SBIW",
                 opcode="1001_0111_KKdd_KKKK",
+                cycles=2,
                 var_offsets=(("d", 24, 2), ),
                 reads=(("R", "d", 16), ),
                 operation="const Reg16 R = Rd - K;",
@@ -820,47 +1146,64 @@ INSTRUCTIONS = (
     Instruction(mnemonic="SBRS",
                 opcode="1111_111r_rrrr_0bbb",
                 operation="if(TestBit(m->R[r], b)) m->SKIP = true;"),
+    Instruction(mnemonic="SLEEP",
+                opcode="1001_0101_1000_1000",
+                operation="const bool woken = machine_sleep(m);",
+                writeback="if(woken) SetPC(m, GetPC(m) + 1);",
+                pc_post_inc=0),
     Instruction(mnemonic="ST_X_i",
                 opcode="1001_001r_rrrr_1100",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->X_H, m->X_L), m->R[r]);"),
     Instruction(mnemonic="ST_X_ii",
                 opcode="1001_001r_rrrr_1101",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->X_H, m->X_L), m->R[r]);",
                 writeback="Set16(m->X_H, m->X_L, Get16(m->X_H, m->X_L) + 1);"),
     Instruction(mnemonic="ST_X_iii",
                 opcode="1001_001r_rrrr_1110",
+                cycles=2,
                 operation="Set16(m->X_H, m->X_L, Get16(m->X_H, m->X_L) - 1);",
                 writeback="SetDataMem(m, Get16(m->X_H, m->X_L), m->R[r]);"),
     Instruction(mnemonic="ST_Y_i",
                 opcode="1000_001r_rrrr_1000",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->Y_H, m->Y_L), m->R[r]);"),
     Instruction(mnemonic="ST_Y_ii",
                 opcode="1001_001r_rrrr_1001",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->Y_H, m->Y_L), m->R[r]);",
                 writeback="Set16(m->Y_H, m->Y_L, Get16(m->Y_H, m->Y_L) + 1);"),
     Instruction(mnemonic="ST_Y_iii",
                 opcode="1001_001r_rrrr_1010",
+                cycles=2,
                 operation="Set16(m->Y_H, m->Y_L, Get16(m->Y_H, m->Y_L) - 1);",
                 writeback="SetDataMem(m, Get16(m->Y_H, m->Y_L), m->R[r]);"),
     Instruction(mnemonic="ST_Y_iv",
                 opcode="10q0_qq1r_rrrr_1qqq",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->Y_H, m->Y_L) + q, m->R[r]);"),
     Instruction(mnemonic="ST_Z_i",
                 opcode="1000_001r_rrrr_0000",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->Z_H, m->Z_L), m->R[r]);"),
     Instruction(mnemonic="ST_Z_ii",
                 opcode="1001_001r_rrrr_0001",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->Z_H, m->Z_L), m->R[r]);",
                 writeback="Set16(m->Z_H, m->Z_L, Get16(m->Z_H, m->Z_L) + 1);"),
     Instruction(mnemonic="ST_Z_iii",
                 opcode="1001_001r_rrrr_0010",
+                cycles=2,
                 operation="Set16(m->Z_H, m->Z_L, Get16(m->Z_H, m->Z_L) - 1);",
                 writeback="SetDataMem(m, Get16(m->Z_H, m->Z_L), m->R[r]);"),
     Instruction(mnemonic="ST_Z_iv",
                 opcode="10q0_qq1r_rrrr_0qqq",
+                cycles=2,
                 operation="SetDataMem(m, Get16(m->Z_H, m->Z_L) + q, m->R[r]);"),
     Instruction(mnemonic="STS",
                 opcode="1001_001r_rrrr_0000_kkkk_kkkk_kkkk_kkkk",
+                cycles=2,
                 operation="SetDataMem(m, k, m->R[r]);",
                 pc_post_inc=2),
     Instruction(mnemonic="SUB",
@@ -892,11 +1235,96 @@ INSTRUCTIONS = (
 )
 
 
-def generate_decode_and_execute():
-    """Generate the instruction decode and execute logic."""
-    # Build a "tree" to find non-unique instructions
+@dataclass
+class Fusion:
+    """Represents a superinstruction, a fixed sequence of instructions run by one handler.
+
+    Every part is still executed by its own handler, so state, cycles, traces and
+    profiles are exactly those of running the parts separately. Only the last
+    part may transfer control and only branches may, whose offset is checked
+    when fusing so that no halt is missed or mistaken.
+    """
+
+    parts: Tuple[str, ...]
+
+    def __post_init__(self):
+        if len(self.parts) > FUSION_MAX_PARTS:
+            raise ValueError("Too many parts in superinstruction: {}".format(self.name))
+        for position, instruction in enumerate(self.instructions):
+            if instruction.words != 1 or instruction.may_skip:
+                raise ValueError("Part {} can't be fused: {}".format(instruction.mnemonic, self.name))
+            if instruction.ends_block and (position != len(self.parts) - 1
+                                           or instruction.mnemonic not in BRANCH_MNEMONICS):
+                raise ValueError("Part {} can't be fused: {}".format(instruction.mnemonic, self.name))
+
+    @property
+    def name(self) -> str:
+        """Get the name of the superinstruction."""
+        return "FUSED_" + "_".join(self.parts)
+
+    @property
+    def instructions(self) -> Tuple[Instruction, ...]:
+        """Get the instruction of each part."""
+        return tuple(next(instruction for instruction in INSTRUCTIONS if instruction.mnemonic == part)
+                     for part in self.parts)
+
+    @property
+    def condition(self) -> str:
+        """Get the C condition under which the instructions from the first part at "a" fuse."""
+        conditions = [
+            "fusion_part(m, a + {})->handler == {}".format(offset, handler_name(instruction))
+            for offset, instruction in enumerate(self.instructions[1:], 1)
+        ]
+        if self.instructions[-1].mnemonic in BRANCH_MNEMONICS:
+            conditions.append("!branches_within(fusion_part(m, a + {}), {})".format(
+                len(self.parts) - 1, len(self.parts)))
+        return " && ".join(conditions)
+
+    @property
+    def code(self):
+        """Generate the execute handler of the superinstruction."""
+        yield "static inline void execute_{}(Machine *m, const DecodedInstruction *i)".format(
+            self.name.lower())
+        yield "{"
+        yield indented("execute_{}(m, i);".format(self.parts[0].lower()))
+        for part in self.parts[1:]:
+            yield indented("if (FusionInterrupted(m))")
+            yield indented("{")
+            yield indented("return;", indent_depth=2)
+            yield indented("}")
+            yield indented("execute_{}(m, &m->DECODED[GetPC(m) % PROG_MEM_SIZE]);".format(
+                part.lower()))
+        yield "}"
+        yield ""
+
+
+# Superinstructions for common avr-gcc idioms, where a longer one sharing a first
+# part with a shorter one is tried first
+FUSIONS = (
+    Fusion(parts=("LDI", "LDI")),
+    Fusion(parts=("CP", "CPC", "BRBC")),
+    Fusion(parts=("CP", "CPC", "BRBS")),
+    Fusion(parts=("CP", "CPC")),
+    Fusion(parts=("CPI", "CPC", "BRBC")),
+    Fusion(parts=("CPI", "CPC", "BRBS")),
+    Fusion(parts=("CPI", "CPC")),
+    Fusion(parts=("CPC", "BRBC")),
+    Fusion(parts=("CPC", "BRBS")),
+    Fusion(parts=("SUBI", "SBCI")),
+    Fusion(parts=("PUSH", "PUSH")),
+    Fusion(parts=("POP", "POP")),
+    Fusion(parts=("MOVW", "ADIW")),
+    Fusion(parts=("MOVW", "SBIW")),
+)
+
+
+def build_instruction_tree():
+    """Group instructions which share a signature and mask.
+
+    Instructions with a precondition are placed ahead of those without so that
+    they are tried first, leaving the unconditional instruction as a fallback.
+    """
     # TODO: Add a second level to group operations that share a mask
-    # TODO: Also clean this whole function up XD
     instruction_tree = {}
     for instruction in INSTRUCTIONS:
         key = (instruction.signature, instruction.mask)
@@ -906,9 +1334,75 @@ def generate_decode_and_execute():
             instruction_tree[key].insert(0, instruction)
         else:
             instruction_tree[key].append(instruction)
+    return instruction_tree
+
+
+def resolve_collision(instructions, opcode):
+    """Select the instruction from a group of colliding instructions for an opcode.
 
+    Preconditions are evaluated in Python, so they must be written in the common
+    subset of C and Python (e.g. "r == d").
+    """
+    operands = {name: variable.decode(opcode) for name, variable in instructions[0].variables.items()}
+    for instruction in instructions:
+        if not instruction.precondition or eval(instruction.precondition, {}, operands):
+            return instruction
+    return None
+
+
+def build_decode_table():
+    """Build a table mapping every 16 bit opcode to the instruction it decodes to.
+
+    Opcodes which do not decode to any instruction map to None. Where signatures
+    overlap the first matching group wins, exactly as in the linear decoder.
+    """
+    decode_table: List[Optional[Instruction]] = [None] * 0x10000
+    for (signature, mask), instructions in reversed(list(build_instruction_tree().items())):
+        free_bits = ~int(mask, 16) & 0xffff
+        # Enumerate every combination of the free bits in the opcode
+        sub_opcode = free_bits
+        while True:
+            opcode = int(signature, 16) | sub_opcode
+            decode_table[opcode] = resolve_collision(instructions, opcode)
+            if sub_opcode == 0:
+                break
+            sub_opcode = (sub_opcode - 1) & free_bits
+    return decode_table
+
+
+def handler_name(instruction: Optional[Instruction]) -> str:
+    """Get the name of the dispatch table handler index for an instruction."""
+    if instruction is None:
+        return "HANDLER_UNDECODABLE"
+    return "HANDLER_{}".format(instruction.mnemonic.upper())
+
+
+def generate_linear_decode_and_execute():
+    """Generate the instruction decode and execute logic as an if/else chain."""
     yield "void decode_and_execute_instruction(Machine *m, Mem16 opcode) {"
-    yield indented("const bool skip = m->SKIP;")
+    yield from generate_skip()
+    yield from generate_linear_decode(
+        lambda instruction: "instruction_{}(m, opcode);".format(instruction.mnemonic.lower()),
+        'fprintf(stderr, "Warning: Instruction %04x at PC=%04x could not be decoded!\\n", opcode, GetPC(m));')
+    yield "}"
+    yield ""
+
+    yield from generate_handler_present()
+    yield "bool opcode_decodable(Mem16 opcode)"
+    yield "{"
+    yield from generate_linear_decode(
+        lambda instruction: "return handler_present({});".format(handler_name(instruction)),
+        "return false;")
+    yield "}"
+    yield ""
+
+
+def generate_linear_decode(action, fallback):
+    """Generate the if/else chain decoding an opcode, doing action(instruction) for the
+    instruction it decodes to, or fallback if it decodes to none."""
+    # TODO: Also clean this whole function up XD
+    instruction_tree = build_instruction_tree()
+
     first = True
     # Generate decode logic
     for (signature, mask), instructions in instruction_tree.items():
@@ -917,17 +1411,8 @@ def generate_decode_and_execute():
                                                              s=signature))
         first = False
         yield indented("{")
-        # If we need to skip this instruction, do so...
-        # This allows skipping of 32 bit instructions.
-        yield indented("if (skip)", indent_depth=2)
-        yield indented("{", indent_depth=2)
-        yield indented("SetPC(m, GetPC(m) + {});".format(instructions[0].words), indent_depth=3)
-        yield indented("m->SKIP = false;", indent_depth=3)
-        yield indented("return;", indent_depth=3)
-        yield indented("}", indent_depth=2)
         if len(instructions) == 1:
-            yield indented("instruction_{}(m, opcode);".format(instructions[0].mnemonic.lower()),
-                           indent_depth=2)
+            yield indented(action(instructions[0]), indent_depth=2)
         else:
             first_instruction = True
             for name, variable in instructions[0].variables.items():
@@ -951,8 +1436,7 @@ def generate_decode_and_execute():
                         print([instruction.mnemonic for instruction in instructions], file=stderr)
                         yield indented("#warning Unwanted Collision", indent_depth=2)
                 yield indented("{", indent_depth=2)
-                yield indented("instruction_{}(m, opcode);".format(instruction.mnemonic.lower()),
-                               indent_depth=3)
+                yield indented(action(instruction), indent_depth=3)
                 yield indented("}", indent_depth=2)
                 first_instruction = False
                 if got_else:
@@ -960,13 +1444,477 @@ def generate_decode_and_execute():
         yield indented("}")
     yield indented("else")
     yield indented("{")
+    yield indented(fallback, indent_depth=2)
+    yield indented("}")
+
+
+def generate_handler_present():
+    """Generate whether the instruction of each handler is present on the MCU.
+
+    Instructions missing from the MCU still decode, to a handler which only warns,
+    so are told apart from the rest by the same INSTRUCTION_*_MISSING macros.
+    """
+    yield "static bool handler_present(uint8_t handler)"
+    yield "{"
+    yield indented("switch (handler)")
+    yield indented("{")
+    yield indented("case {}:".format(handler_name(None)))
+    for instruction in INSTRUCTIONS:
+        yield "#ifdef INSTRUCTION_{}_MISSING".format(instruction.mnemonic.upper())
+        yield indented("case {}:".format(handler_name(instruction)))
+        yield "#endif"
+    yield indented("return false;", indent_depth=2)
+    yield indented("default:")
+    yield indented("return true;", indent_depth=2)
+    yield indented("}")
+    yield "}"
+    yield ""
+
+
+def handler_index(instruction: Optional[Instruction]) -> int:
+    """Get the dispatch table handler index for an instruction.
+
+    Index 0 is HANDLER_PREDECODE which marks an empty predecode cache entry and
+    index 1 is HANDLER_UNDECODABLE for opcodes which can't be decoded, both of
+    which are defined in machine.h.
+    """
+    if instruction is None:
+        return 1
+    return INSTRUCTIONS.index(instruction) + 2
+
+
+def generate_handler_enum():
+    """Generate the handler indices used by the dispatch table and predecode cache."""
+    yield "enum"
+    yield "{"
+    for instruction in INSTRUCTIONS:
+        yield indented("{} = {},".format(handler_name(instruction), handler_index(instruction)))
+    for index, fusion in enumerate(FUSIONS, handler_index(INSTRUCTIONS[-1]) + 1):
+        yield indented("HANDLER_{} = {},".format(fusion.name, index))
+    yield "};"
+    yield ""
+
+
+def generate_table_decode_and_execute():
+    """Generate the instruction decode and execute logic as an opcode dispatch table.
+
+    Every opcode is decoded at generation time, so at run time decoding is a
+    single table lookup followed by a switch over compact handler indices.
+    """
+    decode_table = build_decode_table()
+    handler_count = handler_index(INSTRUCTIONS[-1]) + 1
+
+    yield "static const {} DECODE_TABLE[0x10000] = {{".format(
+        data_type(handler_count.bit_length()))
+    for row in range(0, len(decode_table), 16):
+        yield indented("/* 0x{:04x} */ {},".format(
+            row, ", ".join(str(handler_index(instruction))
+                           for instruction in decode_table[row:row + 16])))
+    yield "};"
+    yield ""
+
+    yield "void decode_instruction(DecodedInstruction *i, Mem16 opcode, Mem16 extension)"
+    yield "{"
+    yield indented("switch (DECODE_TABLE[opcode])")
+    yield indented("{")
+    for instruction in INSTRUCTIONS:
+        yield indented("case {}:".format(handler_name(instruction)))
+        yield indented("decode_{}(i, opcode, extension);".format(instruction.mnemonic.lower()),
+                       indent_depth=2)
+        yield indented("break;", indent_depth=2)
+    yield indented("default:")
+    yield indented("i->handler = {};".format(handler_name(None)), indent_depth=2)
+    yield indented("i->words = 1;", indent_depth=2)
+    yield indented("i->ends_block = true;", indent_depth=2)
+    yield indented("break;", indent_depth=2)
+    yield indented("}")
+    yield "}"
+    yield ""
+
+    yield "void decode_and_execute_instruction(Machine *m, Mem16 opcode)"
+    yield "{"
+    yield from generate_skip()
+    yield indented("switch (DECODE_TABLE[opcode])")
+    yield indented("{")
+    for instruction in INSTRUCTIONS:
+        yield indented("case {}:".format(handler_name(instruction)))
+        yield indented("instruction_{}(m, opcode);".format(instruction.mnemonic.lower()),
+                       indent_depth=2)
+        yield indented("break;", indent_depth=2)
+    yield indented("default:")
     yield indented(
-        'printf("Warning: Instruction %04x at PC=%04x could not be decoded!\\n", opcode, GetPC(m));',
+        'fprintf(stderr, "Warning: Instruction %04x at PC=%04x could not be decoded!\\n", opcode, GetPC(m));',
         indent_depth=2)
+    yield indented("break;", indent_depth=2)
     yield indented("}")
     yield "}"
     yield ""
 
+    yield from generate_handler_present()
+    yield "bool opcode_decodable(Mem16 opcode)"
+    yield "{"
+    yield indented("return handler_present(DECODE_TABLE[opcode]);")
+    yield "}"
+    yield ""
+
+
+def generate_predecoded_execute():
+    """Generate execution of instructions from the predecode cache.
+
+    Each FLASH word is decoded the first time it is executed, after which only
+    the handler switch remains on the hot path.
+    """
+    yield "#ifdef PREDECODE"
+    yield "void predecode_instruction(Machine *m, Address16 a)"
+    yield "{"
+    yield indented("decode_instruction(&m->DECODED[a % PROG_MEM_SIZE], GetProgMem(m, a), GetProgMem(m, a + 1));")
+    yield "#ifdef FUSION"
+    yield indented("fuse_instruction(m, a);")
+    yield "#endif"
+    yield "}"
+    yield ""
+    yield "void execute_predecoded_instruction(Machine *m)"
+    yield "{"
+    yield indented("DecodedInstruction *i = &m->DECODED[GetPC(m) % PROG_MEM_SIZE];")
+    yield indented("if (i->handler == HANDLER_PREDECODE)")
+    yield indented("{")
+    yield indented("predecode_instruction(m, GetPC(m));", indent_depth=2)
+    yield indented("}")
+    # If we need to skip this instruction, do so...
+    yield indented("if (m->SKIP)")
+    yield indented("{")
+    yield indented("SetPC(m, GetPC(m) + i->words);", indent_depth=2)
+    yield indented("m->CYCLES += i->words;", indent_depth=2)
+    yield indented("m->SKIP = false;", indent_depth=2)
+    yield indented("return;", indent_depth=2)
+    yield indented("}")
+    yield indented("switch (i->handler)")
+    yield indented("{")
+    for instruction in INSTRUCTIONS:
+        yield indented("case {}:".format(handler_name(instruction)))
+        yield indented("execute_{}(m, i);".format(instruction.mnemonic.lower()), indent_depth=2)
+        yield indented("break;", indent_depth=2)
+    yield "#ifdef FUSION"
+    for fusion in FUSIONS:
+        yield indented("case HANDLER_{}:".format(fusion.name))
+        yield indented("execute_{}(m, i);".format(fusion.name.lower()), indent_depth=2)
+        yield indented("break;", indent_depth=2)
+    yield "#endif"
+    yield indented("default:")
+    yield indented(
+        'fprintf(stderr, "Warning: Instruction %04x at PC=%04x could not be decoded!\\n", '
+        'GetProgMem(m, GetPC(m)), GetPC(m));',
+        indent_depth=2)
+    yield indented("break;", indent_depth=2)
+    yield indented("}")
+    yield "}"
+    yield "#endif"
+    yield ""
+
+
+def generate_fusions():
+    """Generate the superinstruction handlers and their recognition by the predecoder.
+
+    A decoded instruction which starts a superinstruction keeps its operands and
+    only has its handler replaced, the later parts are run from their own
+    predecode cache entries.
+    """
+    yield "#ifdef FUSION"
+    for fusion in FUSIONS:
+        yield from fusion.code
+    yield "static inline DecodedInstruction *fusion_part(Machine *m, Address16 a)"
+    yield "{"
+    yield indented("DecodedInstruction *i = &m->DECODED[a % PROG_MEM_SIZE];")
+    yield indented("if (i->handler == HANDLER_PREDECODE)")
+    yield indented("{")
+    yield indented("decode_instruction(i, GetProgMem(m, a), GetProgMem(m, a + 1));", indent_depth=2)
+    yield indented("}")
+    yield indented("return i;")
+    yield "}"
+    yield ""
+    yield "/* Whether a branch ending a superinstruction of the given length targets it. */"
+    yield "static inline bool branches_within(const DecodedInstruction *i, int8_t length)"
+    yield "{"
+    yield indented("const int8_t k = ToSigned(i->k, 7);")
+    yield indented("return k < 0 && k >= -length;")
+    yield "}"
+    yield ""
+    yield "static void fuse_instruction(Machine *m, Address16 a)"
+    yield "{"
+    yield indented("DecodedInstruction *i = &m->DECODED[a % PROG_MEM_SIZE];")
+    yield indented("switch (i->handler)")
+    yield indented("{")
+    first_parts = []
+    for fusion in FUSIONS:
+        if fusion.parts[0] not in first_parts:
+            first_parts.append(fusion.parts[0])
+    for first_part in first_parts:
+        yield indented("case HANDLER_{}:".format(first_part))
+        for fusion in FUSIONS:
+            if fusion.parts[0] != first_part:
+                continue
+            yield indented("if ({})".format(fusion.condition), indent_depth=2)
+            yield indented("{", indent_depth=2)
+            yield indented("i->handler = HANDLER_{};".format(fusion.name), indent_depth=3)
+            yield indented("break;", indent_depth=3)
+            yield indented("}", indent_depth=2)
+        yield indented("break;", indent_depth=2)
+    yield indented("default:")
+    yield indented("break;", indent_depth=2)
+    yield indented("}")
+    yield "}"
+    yield "#endif"
+    yield ""
+
+
+def generate_execute_handlers():
+    """Generate a table of out of line execute functions indexed by handler.
+
+    This is used where handlers need to be called rather than inlined, such as
+    from code compiled by the JIT.
+    """
+    yield "#ifdef PREDECODE"
+    yield "const ExecuteHandler EXECUTE_HANDLERS[] = {"
+    yield indented("NULL,")
+    yield indented("NULL,")
+    for instruction in INSTRUCTIONS:
+        yield indented("execute_{},".format(instruction.mnemonic.lower()))
+    # Callers step through every instruction, so only run the first part
+    yield "#ifdef FUSION"
+    for fusion in FUSIONS:
+        yield indented("execute_{},".format(fusion.parts[0].lower()))
+    yield "#endif"
+    yield "};"
+    yield "#endif"
+    yield ""
+
+
+def generate_threaded_run():
+    """Generate a threaded interpreter core using computed goto.
+
+    Every handler gets a label in one function and jumps straight to the
+    handler of the next instruction, rather than returning to a dispatch loop.
+    Only instructions which may skip the next instruction need to check for a
+    pending skip. Like the other engines it returns true once the machine
+    halts, or false once CYCLES reaches RUN_END.
+    """
+    yield "#ifdef THREADED"
+    yield "#pragma GCC diagnostic push"
+    yield '#pragma GCC diagnostic ignored "-Wpedantic"'
+    yield "bool run_threaded_until_halt(Machine *m)"
+    yield "{"
+    yield indented("static const void *const HANDLER_LABELS[] = {")
+    yield indented("&&threaded_predecode,", indent_depth=2)
+    yield indented("&&threaded_undecodable,", indent_depth=2)
+    for instruction in INSTRUCTIONS:
+        yield indented("&&threaded_{},".format(instruction.mnemonic.lower()), indent_depth=2)
+    yield "#ifdef FUSION"
+    for fusion in FUSIONS:
+        yield indented("&&threaded_{},".format(fusion.name.lower()), indent_depth=2)
+    yield "#endif"
+    yield indented("};")
+    yield indented("Reg16 last_pc = 0xffff;")
+    yield indented("DecodedInstruction *i;")
+    yield ""
+    yield "#define THREADED_DISPATCH()                          \\"
+    yield "    do                                              \\"
+    yield "    {                                               \\"
+    yield "        CheckEvents(m);                             \\"
+    yield "        CheckInterrupts(m);                         \\"
+    yield "        if (Halted(m, last_pc))                     \\"
+    yield "        {                                           \\"
+    yield "            return true;                            \\"
+    yield "        }                                           \\"
+    yield "        if (m->CYCLES >= m->RUN_END)                \\"
+    yield "        {                                           \\"
+    yield "            return false;                           \\"
+    yield "        }                                           \\"
+    yield "        last_pc = GetPC(m);                         \\"
+    yield "        i = &m->DECODED[GetPC(m) % PROG_MEM_SIZE];  \\"
+    yield "        goto *HANDLER_LABELS[i->handler];           \\"
+    yield "    } while (0)"
+    yield ""
+    yield indented("if (m->SKIP)")
+    yield indented("{")
+    yield indented("goto threaded_skip;", indent_depth=2)
+    yield indented("}")
+    yield indented("THREADED_DISPATCH();")
+    yield ""
+    yield "threaded_skip:"
+    yield indented("if (Halted(m, last_pc))")
+    yield indented("{")
+    yield indented("return true;", indent_depth=2)
+    yield indented("}")
+    yield indented("if (m->CYCLES >= m->RUN_END)")
+    yield indented("{")
+    yield indented("return false;", indent_depth=2)
+    yield indented("}")
+    yield indented("last_pc = GetPC(m);")
+    yield indented("i = &m->DECODED[GetPC(m) % PROG_MEM_SIZE];")
+    yield indented("if (i->handler == HANDLER_PREDECODE)")
+    yield indented("{")
+    yield indented("predecode_instruction(m, GetPC(m));", indent_depth=2)
+    yield indented("}")
+    yield indented("SetPC(m, GetPC(m) + i->words);")
+    yield indented("m->CYCLES += i->words;")
+    yield indented("m->SKIP = false;")
+    yield indented("THREADED_DISPATCH();")
+    yield ""
+    yield "threaded_predecode:"
+    yield indented("predecode_instruction(m, GetPC(m));")
+    yield indented("goto *HANDLER_LABELS[i->handler];")
+    yield ""
+    yield "threaded_undecodable:"
+    yield indented(
+        'fprintf(stderr, "Warning: Instruction %04x at PC=%04x could not be decoded!\\n", '
+        'GetProgMem(m, GetPC(m)), GetPC(m));')
+    yield indented("THREADED_DISPATCH();")
+    for instruction in INSTRUCTIONS:
+        yield ""
+        yield "threaded_{}:".format(instruction.mnemonic.lower())
+        yield indented("execute_{}(m, i);".format(instruction.mnemonic.lower()))
+        if instruction.may_skip:
+            yield indented("if (m->SKIP)")
+            yield indented("{")
+            yield indented("goto threaded_skip;", indent_depth=2)
+            yield indented("}")
+        yield indented("THREADED_DISPATCH();")
+    yield "#ifdef FUSION"
+    for fusion in FUSIONS:
+        yield ""
+        yield "threaded_{}:".format(fusion.name.lower())
+        yield indented("execute_{}(m, i);".format(fusion.name.lower()))
+        yield indented("THREADED_DISPATCH();")
+    yield "#endif"
+    yield ""
+    yield "#undef THREADED_DISPATCH"
+    yield "}"
+    yield "#pragma GCC diagnostic pop"
+    yield "#endif"
+    yield ""
+
+
+def generate_materialise_flags():
+    """Generate evaluation of deferred flags for lazy flag evaluation.
+
+    The flag logic of the instruction which deferred its flags is evaluated from
+    its recorded operands and result, exactly as it would have been eagerly.
+    """
+    yield "#ifdef LAZY_FLAGS"
+    yield "void materialise_flags(Machine *m)"
+    yield "{"
+    yield indented("switch (m->LAZY.handler)")
+    yield indented("{")
+    for instruction in INSTRUCTIONS:
+        if not instruction.flags:
+            continue
+        yield indented("case {}:".format(handler_name(instruction)))
+        yield indented("{")
+        for slot, name, operand_type in instruction.lazy_operands:
+            yield indented("const {} {} = m->LAZY.{};".format(operand_type, name, slot),
+                           indent_depth=2)
+        for check_read in instruction.check_reads:
+            yield indented(check_read, indent_depth=2)
+        for check in instruction.checks:
+            yield indented(check, indent_depth=2)
+        for check_write in instruction.check_writes:
+            yield indented(check_write, indent_depth=2)
+        yield indented("break;", indent_depth=2)
+        yield indented("}")
+    yield indented("default:")
+    yield indented("break;", indent_depth=2)
+    yield indented("}")
+    yield indented("m->LAZY.mask = 0;")
+    yield "}"
+    yield "#endif"
+    yield ""
+
+
+def generate_opcode_words():
+    """Generate the length of every opcode as a bitmap of two word opcodes.
+
+    Skips only need the length of the instruction they skip, which this gives
+    without decoding it, in a table small enough for the linear decoder too.
+    Undecodable opcodes are a single word.
+    """
+    decode_table = build_decode_table()
+    yield "static const uint64_t TWO_WORD_OPCODES[0x10000 / 64] = {"
+    for row in range(0, len(decode_table), 64 * 8):
+        words = []
+        for word in range(row, row + 64 * 8, 64):
+            bits = sum(1 << bit for bit, instruction in enumerate(decode_table[word:word + 64])
+                       if instruction is not None and instruction.is_32bit)
+            words.append("0x{:016x}".format(bits))
+        yield indented("/* 0x{:04x} */ {},".format(row, ", ".join(words)))
+    yield "};"
+    yield ""
+    yield "static inline uint8_t opcode_words(Mem16 opcode)"
+    yield "{"
+    yield indented("return 1 + ((TWO_WORD_OPCODES[opcode / 64] >> (opcode % 64)) & 0x1);")
+    yield "}"
+    yield ""
+
+
+def generate_skip():
+    """Generate skipping the instruction at PC when SKIP is set, given its opcode."""
+    yield indented("if (m->SKIP)")
+    yield indented("{")
+    yield indented("const uint8_t words = opcode_words(opcode);", indent_depth=2)
+    yield indented("SetPC(m, GetPC(m) + words);", indent_depth=2)
+    yield indented("m->CYCLES += words;", indent_depth=2)
+    yield indented("m->SKIP = false;", indent_depth=2)
+    yield indented("return;", indent_depth=2)
+    yield indented("}")
+
+
+def generate_decode_and_execute():
+    """Generate the instruction decode and execute logic.
+
+    The dispatch table is used by default, the linear decoder is retained behind
+    the DECODE_LINEAR macro for comparison.
+    """
+    yield from generate_opcode_words()
+    yield "#ifdef DECODE_LINEAR"
+    yield from generate_linear_decode_and_execute()
+    yield "#else"
+    yield from generate_table_decode_and_execute()
+    yield from generate_fusions()
+    yield from generate_predecoded_execute()
+    yield from generate_threaded_run()
+    yield from generate_execute_handlers()
+    yield "#endif"
+    yield ""
+
+
+def generate_handler_table():
+    """Generate what identifies the handler table, for checking predecode caches.
+
+    A cache saved by another build is only taken if its hash, of everything which
+    decides the handler indices and the operands decoded for them, matches, and
+    then only holds handlers below DECODED_HANDLER_COUNT.
+    """
+    yield "const uint32_t HANDLER_TABLE_HASH = 0x{:08x};".format(
+        crc32(repr((INSTRUCTIONS, FUSIONS, DECODED_OPERANDS)).encode()))
+    yield "#ifdef FUSION"
+    yield "const uint8_t DECODED_HANDLER_COUNT = {};".format(handler_index(INSTRUCTIONS[-1]) + 1 + len(FUSIONS))
+    yield "#else"
+    yield "const uint8_t DECODED_HANDLER_COUNT = {};".format(handler_index(INSTRUCTIONS[-1]) + 1)
+    yield "#endif"
+    yield ""
+
+
+def generate_handler_mnemonics():
+    """Generate the mnemonic of each handler, for reporting such as by the profiler."""
+    yield "const uint8_t HANDLER_COUNT = {};".format(handler_index(INSTRUCTIONS[-1]) + 1)
+    yield ""
+    yield "const char *const HANDLER_MNEMONICS[] = {"
+    yield indented("NULL,")
+    yield indented("NULL,")
+    for instruction in INSTRUCTIONS:
+        yield indented('"{}",'.format(instruction.mnemonic))
+    yield "};"
+    yield ""
+
 
 def generate_instructions():
     """Generate instruction implementations."""
@@ -975,6 +1923,10 @@ def generate_instructions():
     yield "/* GENERATED CODE */"
     yield "/* This code should be compiled with compiler optimisations turned on. */"
     yield ""
+    yield from generate_handler_enum()
+    yield from generate_handler_table()
+    yield from generate_handler_mnemonics()
+    yield from generate_materialise_flags()
     for instruction in INSTRUCTIONS:
         yield from instruction.code
         yield ""
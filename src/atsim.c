@@ -1,15 +1,610 @@
+#include <inttypes.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include "machine.h"
+#include "instructions.h"
 
-int main(void)
+/* The headless runner, for launching in bulk. The final state is built up in
+   one buffer and written with a single call, and the exit status says why the
+   run stopped:
+
+     atsim [--mcu MCU] IMAGE [--max-cycles N] [--pc WORD] [--eeprom FILE]
+           [--gdb PORT] [--dump text|json|binary|none]
+           [--memory REGION:START:LENGTH]... [--trace FILE] [--profile PREFIX]
+     atsim [--mcu MCU] IMAGE --prepare FILE
+
+   The run stops at a halt or once it has run N cycles, by the threaded
+   interpreter or the JIT in builds with them, which take the count over N by
+   up to an instruction. REGION is data, flash or eeprom, with START and LENGTH
+   in bytes. EEPROM is kept in FILE with --eeprom, which is created if need be.
+   With --gdb the program is run under GDB, connected on PORT, until it
+   detaches, after which the run carries on as without it. With WATCHPOINTS,
+   --break WORD, --watch ADDRESS and --rwatch ADDRESS stop the run at a program
+   memory word or at a write or read of a data space address, and can be
+   repeated. With TRACE the run is traced to FILE, trace.bin by default, and
+   with PROFILE profiled to PREFIX.json, PREFIX.csv and PREFIX.folded,
+   profile.* by default. The binary dump is RESULT_MAGIC, a version byte, then
+   status, SREG, PC, SP, CYCLES and R0 to R31, then a count of memory ranges
+   each with its region, start, length and bytes. Integers are little endian,
+   PC and SP are 16 bit, CYCLES is 64 bit and counts and ranges are 16 bit
+   apart from the region byte.
+
+   With --prepare, IMAGE is written to FILE as a prepared image instead of
+   being run, which later runs load without parsing or decoding it. */
+
+#define ATSIM_MAX_RANGES 16
+#define ATSIM_MAX_WATCHES 16
+#define RESULT_MAGIC "ATSTATE"
+#define RESULT_VERSION 1
+
+/* Only the options built in. */
+static const char USAGE[] = "Usage: %s [--mcu MCU] IMAGE [--max-cycles N] [--pc WORD] [--eeprom FILE] [--gdb PORT]"
+                            " [--dump text|json|binary|none] [--memory data|flash|eeprom:START:LENGTH]..."
+#ifdef WATCHPOINTS
+                            " [--break WORD] [--watch ADDRESS] [--rwatch ADDRESS]"
+#endif
+#ifdef TRACE
+                            " [--trace FILE]"
+#endif
+#ifdef PROFILE
+                            " [--profile PREFIX]"
+#endif
+                            " [--prepare FILE]\n";
+
+/* Also the exit status. */
+typedef enum
+{
+    RUN_HALTED = 0,
+    RUN_TIMEOUT = 1,
+    RUN_USAGE = 2,
+    RUN_UNDECODABLE = 3,
+    RUN_DIVERGED = 4,
+    RUN_KILLED = 5,
+    RUN_BREAKPOINT = 6,
+    RUN_WATCHPOINT = 7,
+} RunStatus;
+
+static const char *const RUN_STATUS_NAMES[] = {"halted",   "timeout", "usage",      "undecodable",
+                                               "diverged", "killed",  "breakpoint", "watchpoint"};
+
+typedef enum
+{
+    DUMP_TEXT,
+    DUMP_JSON,
+    DUMP_BINARY,
+    DUMP_NONE,
+} DumpFormat;
+
+typedef enum
+{
+    REGION_DATA,
+    REGION_FLASH,
+    REGION_EEPROM,
+} MemoryRegion;
+
+static const char *const REGION_NAMES[] = {"data", "flash", "eeprom"};
+static const uint32_t REGION_SIZES[] = {DATA_MEM_SIZE, PROG_MEM_SIZE_BYTES, EEPROM_SIZE};
+
+typedef struct
+{
+    MemoryRegion region;
+    uint32_t start;
+    uint32_t length;
+} MemoryRange;
+
+typedef struct
+{
+    WatchKind kind;
+    Address16 address;
+} Watch;
+
+typedef struct
+{
+    const char *image;
+    const char *eeprom;
+    const char *prepare;
+    const char *trace;
+    const char *profile;
+    uint64_t max_cycles;
+    Address16 pc;
+    uint16_t gdb_port;
+    DumpFormat dump;
+    MemoryRange ranges[ATSIM_MAX_RANGES];
+    size_t range_count;
+    Watch watches[ATSIM_MAX_WATCHES];
+    size_t watch_count;
+} Options;
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+} Output;
+
+static bool output_reserve(Output *o, size_t n)
+{
+    if (o->size + n <= o->capacity)
+    {
+        return true;
+    }
+    size_t capacity = o->capacity > 0 ? o->capacity : 4096;
+    while (capacity < o->size + n)
+    {
+        capacity *= 2;
+    }
+    char *data = realloc(o->data, capacity);
+    if (data == NULL)
+    {
+        return false;
+    }
+    o->data = data;
+    o->capacity = capacity;
+    return true;
+}
+
+static void output_bytes(Output *o, const void *bytes, size_t n)
+{
+    if (output_reserve(o, n))
+    {
+        memcpy(o->data + o->size, bytes, n);
+        o->size += n;
+    }
+}
+
+static void output_format(Output *o, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    const int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (n < 0 || !output_reserve(o, (size_t)n + 1))
+    {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(o->data + o->size, (size_t)n + 1, format, args);
+    va_end(args);
+    o->size += n;
+}
+
+static void output_u16(Output *o, uint16_t v)
+{
+    const uint8_t bytes[] = {v & 0xff, v >> 8};
+    output_bytes(o, bytes, sizeof(bytes));
+}
+
+static void output_u64(Output *o, uint64_t v)
+{
+    uint8_t bytes[8];
+    for (size_t i = 0; i < sizeof(bytes); i++)
+    {
+        bytes[i] = (v >> (8 * i)) & 0xff;
+    }
+    output_bytes(o, bytes, sizeof(bytes));
+}
+
+static Mem8 read_region(Machine *m, MemoryRegion region, uint32_t a)
 {
-    // TODO: implement 32 bit instructions like STS
-    Machine m;
-    load_memory_from_file(&m, "test/fib/fib.bin");
-    m.PC = 0;
-    m.SKIP = false;
-    run_until_halt_loop(&m);
-    dump_registers(&m);
-    dump_stack(&m);
+    switch (region)
+    {
+    case REGION_DATA:
+        return PeekDataMem(m, a);
+    case REGION_FLASH:
+    {
+        const Mem16 word = GetProgMem(m, a / 2);
+        return a % 2 ? word >> 8 : word & 0xff;
+    }
+    case REGION_EEPROM:
+        return m->EEPROM[a % EEPROM_SIZE];
+    }
     return 0;
 }
+
+/* As dump_registers and dump_stack print them for the interactive debugger. */
+static void dump_text_registers(Machine *m, Output *o)
+{
+    output_format(o, "- PC & SP -\n  PC = 0x%04x\n  SP = 0x%04x\n", GetPC(m), GetSP(m));
+    output_format(o, "- Cycles -\n  CYCLES = %" PRIu64 "\n", m->CYCLES);
+    output_format(o, "- GP Registers -\n");
+    for (uint8_t i = 0; i < GP_REGISTERS; i++)
+    {
+        output_format(o, "  R[%02u] = 0x%02x\n", i, m->R[i]);
+    }
+    output_format(o, "  X     = 0x%04x\n  Y     = 0x%04x\n  Z     = 0x%04x\n", Get16(m->X_H, m->X_L),
+                  Get16(m->Y_H, m->Y_L), Get16(m->Z_H, m->Z_L));
+}
+
+static void dump_text_stack(Machine *m, Output *o)
+{
+    output_format(o, "- Stack -\n  TOS\n");
+    for (uint16_t i = GetSP(m) + 1; i < DATA_MEM_SIZE; i++)
+    {
+        output_format(o, "  STACK[%03u] = %02x\n", DATA_MEM_SIZE - i - 1, PeekDataMem(m, i));
+    }
+    output_format(o, "  BOS\n");
+}
+
+static void dump_text(Machine *m, RunStatus status, const Options *options, Output *o)
+{
+    dump_text_registers(m, o);
+    dump_text_stack(m, o);
+    for (size_t i = 0; i < options->range_count; i++)
+    {
+        const MemoryRange *r = &options->ranges[i];
+        output_format(o, "- %s 0x%04" PRIx32 " -", REGION_NAMES[r->region], r->start);
+        for (uint32_t a = 0; a < r->length; a++)
+        {
+            output_format(o, "%s%02x", a % 16 == 0 ? "\n  " : " ", read_region(m, r->region, r->start + a));
+        }
+        output_format(o, "\n");
+    }
+    output_format(o, "- Status -\n  %s\n", RUN_STATUS_NAMES[status]);
+}
+
+static void dump_json(Machine *m, RunStatus status, const Options *options, Output *o)
+{
+    output_format(o, "{\"status\": \"%s\", \"mcu\": \"%s\", \"pc\": %u, \"sp\": %u, \"sreg\": %u, \"cycles\": %" PRIu64,
+                  RUN_STATUS_NAMES[status], MCU, GetPC(m), GetSP(m), PackSREG(m), m->CYCLES);
+    output_format(o, ", \"r\": [");
+    for (uint8_t i = 0; i < GP_REGISTERS; i++)
+    {
+        output_format(o, "%s%u", i > 0 ? ", " : "", m->R[i]);
+    }
+    output_format(o, "], \"memory\": [");
+    for (size_t i = 0; i < options->range_count; i++)
+    {
+        const MemoryRange *r = &options->ranges[i];
+        output_format(o, "%s{\"region\": \"%s\", \"start\": %" PRIu32 ", \"bytes\": \"", i > 0 ? ", " : "",
+                      REGION_NAMES[r->region], r->start);
+        for (uint32_t a = 0; a < r->length; a++)
+        {
+            output_format(o, "%02x", read_region(m, r->region, r->start + a));
+        }
+        output_format(o, "\"}");
+    }
+    output_format(o, "]}\n");
+}
+
+static void dump_binary(Machine *m, RunStatus status, const Options *options, Output *o)
+{
+    output_bytes(o, RESULT_MAGIC, strlen(RESULT_MAGIC));
+    const uint8_t header[] = {RESULT_VERSION, status, PackSREG(m)};
+    output_bytes(o, header, sizeof(header));
+    output_u16(o, GetPC(m));
+    output_u16(o, GetSP(m));
+    output_u64(o, m->CYCLES);
+    output_bytes(o, m->R, GP_REGISTERS);
+    output_u16(o, options->range_count);
+    for (size_t i = 0; i < options->range_count; i++)
+    {
+        const MemoryRange *r = &options->ranges[i];
+        const uint8_t region = r->region;
+        output_bytes(o, &region, 1);
+        output_u16(o, r->start);
+        output_u16(o, r->length);
+        if (!output_reserve(o, r->length))
+        {
+            return;
+        }
+        for (uint32_t a = 0; a < r->length; a++)
+        {
+            o->data[o->size++] = read_region(m, r->region, r->start + a);
+        }
+    }
+}
+
+/* Takes an option given as "--name value" or "--name=value". */
+static const char *option_value(int argc, char *argv[], int *i, const char *name)
+{
+    const size_t length = strlen(name);
+    if (strncmp(argv[*i], name, length) != 0)
+    {
+        return NULL;
+    }
+    if (argv[*i][length] == '=')
+    {
+        return argv[*i] + length + 1;
+    }
+    if (argv[*i][length] == '\0' && *i + 1 < argc)
+    {
+        return argv[++*i];
+    }
+    return NULL;
+}
+
+static bool parse_number(const char *text, uint64_t max, uint64_t *value)
+{
+    char *end;
+    *value = strtoull(text, &end, 0);
+    return end != text && *end == '\0' && *value <= max;
+}
+
+static bool parse_range(const char *text, MemoryRange *r)
+{
+    const char *colon = strchr(text, ':');
+    if (colon == NULL)
+    {
+        return false;
+    }
+    size_t region = 0;
+    while (region < sizeof(REGION_NAMES) / sizeof(REGION_NAMES[0]) &&
+           (strlen(REGION_NAMES[region]) != (size_t)(colon - text) ||
+            strncmp(text, REGION_NAMES[region], colon - text) != 0))
+    {
+        region++;
+    }
+    if (region == sizeof(REGION_NAMES) / sizeof(REGION_NAMES[0]))
+    {
+        return false;
+    }
+    char start_text[32];
+    const char *length_text = strchr(colon + 1, ':');
+    if (length_text == NULL || (size_t)(length_text - colon - 1) >= sizeof(start_text))
+    {
+        return false;
+    }
+    memcpy(start_text, colon + 1, length_text - colon - 1);
+    start_text[length_text - colon - 1] = '\0';
+    uint64_t start, length;
+    const uint32_t size = REGION_SIZES[region];
+    if (!parse_number(start_text, size, &start) || !parse_number(length_text + 1, size - start, &length))
+    {
+        return false;
+    }
+    *r = (MemoryRange){(MemoryRegion)region, (uint32_t)start, (uint32_t)length};
+    return true;
+}
+
+#ifdef WATCHPOINTS
+/* Breakpoints are on program memory words, watchpoints on data addresses. */
+static bool parse_watch(const char *text, WatchKind kind, Options *options)
+{
+    uint64_t address;
+    if (options->watch_count == ATSIM_MAX_WATCHES ||
+        !parse_number(text, kind == WATCH_BREAKPOINT ? PROG_MEM_SIZE - 1 : DATA_MEM_SIZE - 1, &address))
+    {
+        return false;
+    }
+    options->watches[options->watch_count++] = (Watch){kind, (Address16)address};
+    return true;
+}
+#endif
+
+static bool parse_options(int argc, char *argv[], Options *options)
+{
+    *options = (Options){.image = NULL, .eeprom = NULL, .prepare = NULL, .trace = "trace.bin", .profile = "profile",
+                         .max_cycles = UINT64_MAX, .pc = 0, .gdb_port = 0, .dump = DUMP_TEXT, .range_count = 0,
+                         .watch_count = 0};
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value;
+        uint64_t number;
+        if ((value = option_value(argc, argv, &i, "--max-cycles")) != NULL)
+        {
+            if (!parse_number(value, UINT64_MAX, &options->max_cycles))
+            {
+                return false;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--pc")) != NULL)
+        {
+            if (!parse_number(value, PROG_MEM_SIZE - 1, &number))
+            {
+                return false;
+            }
+            options->pc = number;
+        }
+        else if ((value = option_value(argc, argv, &i, "--eeprom")) != NULL)
+        {
+            options->eeprom = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--prepare")) != NULL)
+        {
+            options->prepare = value;
+        }
+        else if ((value = option_value(argc, argv, &i, "--gdb")) != NULL)
+        {
+            if (!parse_number(value, UINT16_MAX, &number) || number == 0)
+            {
+                return false;
+            }
+            options->gdb_port = number;
+        }
+        else if ((value = option_value(argc, argv, &i, "--dump")) != NULL)
+        {
+            const char *const formats[] = {"text", "json", "binary", "none"};
+            size_t format = 0;
+            while (format < sizeof(formats) / sizeof(formats[0]) && strcmp(value, formats[format]) != 0)
+            {
+                format++;
+            }
+            if (format == sizeof(formats) / sizeof(formats[0]))
+            {
+                return false;
+            }
+            options->dump = (DumpFormat)format;
+        }
+        else if ((value = option_value(argc, argv, &i, "--memory")) != NULL)
+        {
+            if (options->range_count == ATSIM_MAX_RANGES ||
+                !parse_range(value, &options->ranges[options->range_count++]))
+            {
+                return false;
+            }
+        }
+#ifdef WATCHPOINTS
+        else if ((value = option_value(argc, argv, &i, "--break")) != NULL)
+        {
+            if (!parse_watch(value, WATCH_BREAKPOINT, options))
+            {
+                return false;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--watch")) != NULL)
+        {
+            if (!parse_watch(value, WATCH_WRITE, options))
+            {
+                return false;
+            }
+        }
+        else if ((value = option_value(argc, argv, &i, "--rwatch")) != NULL)
+        {
+            if (!parse_watch(value, WATCH_READ, options))
+            {
+                return false;
+            }
+        }
+#endif
+#ifdef TRACE
+        else if ((value = option_value(argc, argv, &i, "--trace")) != NULL)
+        {
+            options->trace = value;
+        }
+#endif
+#ifdef PROFILE
+        else if ((value = option_value(argc, argv, &i, "--profile")) != NULL)
+        {
+            options->profile = value;
+        }
+#endif
+        else if (argv[i][0] != '-' && options->image == NULL)
+        {
+            options->image = argv[i];
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return options->image != NULL;
+}
+
+static RunStatus run(Machine *m, const Options *options)
+{
+    bool halted;
+    if (options->gdb_port != 0)
+    {
+        bool resume;
+        if (!gdb_serve(m, options->gdb_port, &resume))
+        {
+            return RUN_USAGE;
+        }
+        if (!resume)
+        {
+            return RUN_KILLED;
+        }
+    }
+#ifdef LOCKSTEP
+    if (!run_lockstep(m, options->max_cycles, stderr, &halted))
+    {
+        return RUN_DIVERGED;
+    }
+#else
+    halted = options->max_cycles == UINT64_MAX ? run_until_halt(m) : run_for_cycles_fastest(m, options->max_cycles);
+#endif
+    if (!halted)
+    {
+        return RUN_TIMEOUT;
+    }
+#ifdef WATCHPOINTS
+    if (m->WATCH_HIT.kind != WATCH_NONE)
+    {
+        return m->WATCH_HIT.kind == WATCH_BREAKPOINT ? RUN_BREAKPOINT : RUN_WATCHPOINT;
+    }
+#endif
+    return m->SKIP || opcode_decodable(GetProgMem(m, GetPC(m))) ? RUN_HALTED : RUN_UNDECODABLE;
+}
+
+/* Called by main in main.c, once per run with the MCU already chosen. */
+int atsim_main(int argc, char *argv[])
+{
+    Options options;
+    if (!parse_options(argc, argv, &options))
+    {
+        fprintf(stderr, USAGE, argc > 0 ? argv[0] : "atsim");
+        return RUN_USAGE;
+    }
+    if (options.prepare != NULL)
+    {
+        return prepare_image(options.image, options.prepare) ? RUN_HALTED : RUN_USAGE;
+    }
+    /* The image stays open for the profiler's symbol names and a prepared
+       image's predecode cache, which is used where it is mapped. */
+    ProgramImage *image = image_open(options.image);
+    if (image == NULL)
+    {
+        return RUN_USAGE;
+    }
+    /* Zeroed, as the rest of the machine isn't set by loading. */
+    Machine *m = calloc(1, MACHINE_SIZE);
+    if (m == NULL)
+    {
+        image_close(image);
+        return RUN_USAGE;
+    }
+    load_image(m, image);
+    if (options.eeprom != NULL && !eeprom_map(m, options.eeprom))
+    {
+        fprintf(stderr, "Unable to map EEPROM from %s.\n", options.eeprom);
+        free(m);
+        image_close(image);
+        return RUN_USAGE;
+    }
+    m->PC = options.pc;
+    m->SKIP = false;
+    m->CYCLES = 0;
+#ifdef WATCHPOINTS
+    for (size_t i = 0; i < options.watch_count; i++)
+    {
+        const Watch *w = &options.watches[i];
+        if (w->kind == WATCH_BREAKPOINT)
+        {
+            watch_breakpoint(m, w->address, true);
+        }
+        else
+        {
+            watch_data(m, w->address, w->kind, true);
+        }
+    }
+#endif
+#ifdef TRACE
+    m->TRACER = trace_open(options.trace, true);
+#endif
+    const RunStatus status = run(m, &options);
+
+    Output output = {.data = NULL, .size = 0, .capacity = 0};
+    switch (options.dump)
+    {
+    case DUMP_TEXT:
+        dump_text(m, status, &options, &output);
+        break;
+    case DUMP_JSON:
+        dump_json(m, status, &options, &output);
+        break;
+    case DUMP_BINARY:
+        dump_binary(m, status, &options, &output);
+        break;
+    case DUMP_NONE:
+        break;
+    }
+    if (output.size > 0)
+    {
+        fwrite(output.data, 1, output.size, stdout);
+    }
+    free(output.data);
+    eeprom_unmap(m);
+#ifdef PROFILE
+    profile_write(m, options.profile);
+#endif
+#ifdef TRACE
+    if (m->TRACER != NULL)
+    {
+        trace_close(m->TRACER);
+    }
+#endif
+    free(m);
+    image_close(image);
+    return status;
+}
@@ -0,0 +1,411 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "machine.h"
+#include "instructions.h"
+
+/* Every instance in a batch runs the same program, which no instruction
+   writes, so the program is decoded once, before any worker starts, into a
+   predecode cache every worker shares and only reads. Each worker keeps one
+   Machine holding the program image, without a cache of its own, and swaps
+   the compact per-instance state in and out of it. The JIT code buffer is not
+   thread safe, so workers interpret. A MachineState has no port B, so the
+   image's pin callback and the inputs queued for it aren't given to any
+   instance, whose pins are left to their pull-ups.
+
+   With LANES a worker instead runs BATCH_LANES instances at once, one Machine
+   each, stepping every lane at the same PC through the one decoded
+   instruction of the lane furthest behind. Lanes which branch apart wait for
+   each other in cycle order, so they join up again wherever control flow
+   reconverges, and a lane with anything else to do between instructions, a
+   skip, an event or an interrupt, takes a machine_cycle of its own. */
+
+typedef struct
+{
+    const Machine *image;
+#ifdef PREDECODE
+    DecodedInstruction *decoded;
+#endif
+    MachineState *states;
+    size_t n;
+    uint64_t max_cycles;
+    size_t next;
+    pthread_mutex_t lock;
+} Batch;
+
+#ifdef LANES
+
+#define LANE_NONE UINT16_MAX
+
+#if BATCH_LANES >= LANE_NONE
+#error "BATCH_LANES must be below LANE_NONE"
+#endif
+
+typedef struct
+{
+    Machine *m;
+    MachineState *s;
+    uint64_t end;
+    /* The next lane at the same PC, or LANE_NONE. */
+    uint16_t next;
+} Lane;
+
+/* The lanes of a worker. Those still running are kept in a binary min-heap
+   ordered by cycle, with POSITION finding a lane in it, so the lane furthest
+   behind is always first, and in a list for each PC so that the lanes at its
+   PC are found without looking at any other. Every list is empty between
+   runs. */
+typedef struct
+{
+    Lane LANE[BATCH_LANES];
+    uint16_t HEAP[BATCH_LANES];
+    uint16_t POSITION[BATCH_LANES];
+    uint16_t COUNT;
+    uint16_t AT[PROG_MEM_SIZE];
+} Lanes;
+
+/* Whether a lane can run the next instruction alone, without the checks of
+   machine_cycle. */
+static inline bool lane_plain(const Machine *m)
+{
+#ifdef WATCHPOINTS
+    if (m->WATCHING)
+    {
+        return false;
+    }
+#endif
+#ifdef TIMERS
+    if (m->CYCLES >= m->PERIPHERALS.EVENTS.NEXT)
+    {
+        return false;
+    }
+#endif
+#ifdef INTERRUPTS
+    if (m->PENDING != 0)
+    {
+        return false;
+    }
+#endif
+    return !m->SKIP;
+}
+
+static inline uint64_t heap_cycles(const Lanes *w, uint16_t i)
+{
+    return w->LANE[w->HEAP[i]].m->CYCLES;
+}
+
+static void swap_lanes(Lanes *w, uint16_t a, uint16_t b)
+{
+    const uint16_t lane = w->HEAP[a];
+    w->HEAP[a] = w->HEAP[b];
+    w->HEAP[b] = lane;
+    w->POSITION[w->HEAP[a]] = a;
+    w->POSITION[w->HEAP[b]] = b;
+}
+
+static void sift_up(Lanes *w, uint16_t i)
+{
+    while (i > 0 && heap_cycles(w, (i - 1) / 2) > heap_cycles(w, i))
+    {
+        swap_lanes(w, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(Lanes *w, uint16_t i)
+{
+    while (true)
+    {
+        uint16_t first = i;
+        const uint32_t left = i * 2 + 1;
+        const uint32_t right = i * 2 + 2;
+        if (left < w->COUNT && heap_cycles(w, left) < heap_cycles(w, first))
+        {
+            first = left;
+        }
+        if (right < w->COUNT && heap_cycles(w, right) < heap_cycles(w, first))
+        {
+            first = right;
+        }
+        if (first == i)
+        {
+            return;
+        }
+        swap_lanes(w, i, first);
+        i = first;
+    }
+}
+
+static void lane_wait(Lanes *w, uint16_t l)
+{
+    Lane *lane = &w->LANE[l];
+    const Address16 pc = lane->m->PC % PROG_MEM_SIZE;
+    lane->next = w->AT[pc];
+    w->AT[pc] = l;
+}
+
+static void lane_start(Lanes *w, uint16_t l)
+{
+    const uint16_t i = w->COUNT++;
+    w->HEAP[i] = l;
+    w->POSITION[l] = i;
+    sift_up(w, i);
+    lane_wait(w, l);
+}
+
+/* Takes a lane out of the heap, moving the last lane into the gap. */
+static void lane_stop(Lanes *w, uint16_t l)
+{
+    const uint16_t i = w->POSITION[l];
+    w->COUNT--;
+    if (i != w->COUNT)
+    {
+        const uint16_t moved = w->HEAP[w->COUNT];
+        swap_lanes(w, i, w->COUNT);
+        sift_up(w, i);
+        sift_down(w, w->POSITION[moved]);
+    }
+}
+
+/* The lanes share the batch's predecode cache, which holds every word of the
+   program, so the instruction at the PC of the lane furthest behind is
+   already decoded for every lane at that PC. Each lane's cycles only grow, so
+   after its step it only moves down the heap. */
+static void run_lanes(Lanes *w, size_t n, uint64_t max_cycles)
+{
+    w->COUNT = 0;
+    for (uint16_t l = 0; l < n; l++)
+    {
+        Lane *lane = &w->LANE[l];
+        restore_machine_state(lane->m, lane->s);
+        lane->end = max_cycles < UINT64_MAX - lane->m->CYCLES ? lane->m->CYCLES + max_cycles : UINT64_MAX;
+        lane->s->HALTED = false;
+        lane->m->RUN_END = lane->end;
+#ifdef FUSION
+        lane->m->FUSION_LIMIT = lane->end;
+#endif
+        if (lane->m->CYCLES < lane->end)
+        {
+            lane_start(w, l);
+        }
+    }
+
+    while (w->COUNT > 0)
+    {
+        const Machine *behind = w->LANE[w->HEAP[0]].m;
+        const Reg16 pc = behind->PC;
+        const DecodedInstruction *i = &behind->DECODED[pc % PROG_MEM_SIZE];
+        const ExecuteHandler handler = i->handler != HANDLER_UNDECODABLE ? EXECUTE_HANDLERS[i->handler] : NULL;
+        uint16_t l = w->AT[pc % PROG_MEM_SIZE];
+        w->AT[pc % PROG_MEM_SIZE] = LANE_NONE;
+        while (l != LANE_NONE)
+        {
+            Lane *lane = &w->LANE[l];
+            const uint16_t next = lane->next;
+            if (handler != NULL && lane_plain(lane->m))
+            {
+                handler(lane->m, i);
+            }
+            else
+            {
+                machine_cycle(lane->m);
+            }
+            lane->s->HALTED = Halted(lane->m, pc);
+            if (lane->s->HALTED || lane->m->CYCLES >= lane->end)
+            {
+                lane_stop(w, l);
+            }
+            else
+            {
+                sift_down(w, w->POSITION[l]);
+                lane_wait(w, l);
+            }
+            l = next;
+        }
+    }
+
+    for (size_t l = 0; l < n; l++)
+    {
+        save_machine_state(w->LANE[l].m, w->LANE[l].s);
+    }
+}
+
+#endif
+
+/* A copy of the image sharing the batch's predecode cache. Its EEPROM is its
+   own, as it is restored from each instance's state. */
+static Machine *worker_machine(const Batch *batch)
+{
+    Machine *m = malloc(sizeof(Machine));
+    if (m == NULL)
+    {
+        return NULL;
+    }
+    memcpy(m, batch->image, sizeof(Machine));
+    m->EEPROM = m->EEPROM_DATA;
+#ifdef PREDECODE
+    m->DECODED = batch->decoded;
+#endif
+#ifdef TRACE
+    /* A trace sink only takes records from one thread. */
+    m->TRACER = NULL;
+#endif
+#ifdef GPIO
+    /* Nor can the image's pin callback tell the instances apart. */
+    gpio_reset(m);
+#endif
+    return m;
+}
+
+#ifdef PREDECODE
+/* Decodes every word the image hasn't yet, so workers never write the cache. A
+   word decoded as part of a superinstruction isn't fused itself, as when
+   preparing an image. */
+static bool decode_program(Batch *batch)
+{
+    batch->decoded = malloc(PROG_MEM_SIZE * sizeof(DecodedInstruction));
+    Machine *m = batch->decoded != NULL ? worker_machine(batch) : NULL;
+    if (m == NULL)
+    {
+        free(batch->decoded);
+        return false;
+    }
+    memcpy(batch->decoded, batch->image->DECODED, PROG_MEM_SIZE * sizeof(DecodedInstruction));
+    for (Address16 a = 0; a < PROG_MEM_SIZE; a++)
+    {
+        if (batch->decoded[a].handler == HANDLER_PREDECODE)
+        {
+            predecode_instruction(m, a);
+        }
+    }
+    free(m);
+    return true;
+}
+#endif
+
+/* Takes up to count of the next instances, returning how many were left. */
+static size_t take_instances(Batch *batch, size_t count, size_t *first)
+{
+    pthread_mutex_lock(&batch->lock);
+    *first = batch->next;
+    const size_t left = batch->next < batch->n ? batch->n - batch->next : 0;
+    const size_t taken = left < count ? left : count;
+    batch->next += taken;
+    pthread_mutex_unlock(&batch->lock);
+    return taken;
+}
+
+#ifdef LANES
+static void *batch_worker(void *arg)
+{
+    Batch *batch = arg;
+    Lanes *w = malloc(sizeof(Lanes));
+    size_t machines = 0;
+    if (w != NULL)
+    {
+        for (size_t a = 0; a < PROG_MEM_SIZE; a++)
+        {
+            w->AT[a] = LANE_NONE;
+        }
+        while (machines < BATCH_LANES && (w->LANE[machines].m = worker_machine(batch)) != NULL)
+        {
+            machines++;
+        }
+    }
+    size_t first;
+    size_t taken;
+    while (machines > 0 && (taken = take_instances(batch, machines, &first)) > 0)
+    {
+        for (size_t l = 0; l < taken; l++)
+        {
+            w->LANE[l].s = &batch->states[first + l];
+        }
+        run_lanes(w, taken, batch->max_cycles);
+    }
+    for (size_t l = 0; l < machines; l++)
+    {
+        free(w->LANE[l].m);
+    }
+    free(w);
+    return NULL;
+}
+#else
+static void run_instance(Machine *m, MachineState *s, uint64_t max_cycles)
+{
+    restore_machine_state(m, s);
+    s->HALTED = run_for_cycles(m, max_cycles);
+    save_machine_state(m, s);
+}
+
+static void *batch_worker(void *arg)
+{
+    Batch *batch = arg;
+    Machine *m = worker_machine(batch);
+    size_t i;
+    /* Leave the instances to the other workers without a machine. */
+    while (m != NULL && take_instances(batch, 1, &i) > 0)
+    {
+        run_instance(m, &batch->states[i], batch->max_cycles);
+    }
+    free(m);
+    return NULL;
+}
+#endif
+
+bool run_batch(const Machine *image, MachineState states[], size_t n, uint64_t max_cycles, size_t threads)
+{
+    if (n == 0)
+    {
+        return true;
+    }
+    if (threads == 0)
+    {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+    }
+    if (threads > n)
+    {
+        threads = n;
+    }
+
+    Batch batch = {.image = image, .states = states, .n = n, .max_cycles = max_cycles, .next = 0};
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+#ifdef PREDECODE
+    if (workers != NULL && !decode_program(&batch))
+    {
+        free(workers);
+        workers = NULL;
+    }
+#endif
+    if (workers == NULL)
+    {
+        return false;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+
+    /* Instances are handed out one at a time, or a set of lanes at a time, so
+       long running ones don't hold up the rest of a worker's share. */
+    size_t started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, batch_worker, &batch) == 0)
+    {
+        started++;
+    }
+    for (size_t t = 0; t < started; t++)
+    {
+        pthread_join(workers[t], NULL);
+    }
+
+    /* Instances are only left over if no worker could start. */
+    if (batch.next < n)
+    {
+        batch_worker(&batch);
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
+#ifdef PREDECODE
+    free(batch.decoded);
+#endif
+    return batch.next >= n;
+}
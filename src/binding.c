@@ -0,0 +1,194 @@
+#include "machine.h"
+
+/* The C side of the Python bindings in atsim.py, for bin/libatsim.so. A
+   Machine's layout changes with every config option, so bindings only see it
+   through these functions and the ones in machine.h taking plain arguments.
+   Memory is handed out as pointers into the machine so it can be wrapped
+   without copying. Like everything else each core has its own copy, under its
+   MCU_PREFIX. */
+
+typedef enum
+{
+    BINDING_R,
+    BINDING_IO,
+    BINDING_SRAM,
+    BINDING_EEPROM,
+    BINDING_FLASH,
+} BindingRegion;
+
+/* A machine with nothing loaded, or NULL if it can't be allocated. */
+Machine *binding_new(void)
+{
+    Machine *m = calloc(1, MACHINE_SIZE);
+    if (m != NULL)
+    {
+        uint8_t nop[2] = {0, 0};
+        load_memory(m, nop, sizeof(nop));
+    }
+    return m;
+}
+
+void binding_free(Machine *m)
+{
+    if (m != NULL)
+    {
+        eeprom_unmap(m);
+        free(m);
+    }
+}
+
+/* The EEPROM pointer is only valid until eeprom_map or eeprom_unmap. Only the
+   registers may be written through these pointers, anything else is written
+   with binding_write. SREG isn't in IO unless PACKED_SREG, use binding_sreg
+   and binding_set_sreg. */
+Mem8 *binding_memory(Machine *m, uint8_t region, size_t *size)
+{
+    switch (region)
+    {
+    case BINDING_R:
+        *size = GP_REGISTERS;
+        return m->R;
+    case BINDING_IO:
+        *size = IO_REGISTERS;
+        return m->IO;
+    case BINDING_SRAM:
+        *size = SRAM_SIZE;
+        return m->SRAM;
+    case BINDING_EEPROM:
+        *size = EEPROM_SIZE;
+        return m->EEPROM;
+    case BINDING_FLASH:
+        *size = PROG_MEM_SIZE_BYTES;
+        return (Mem8 *)m->FLASH;
+    default:
+        *size = 0;
+        return NULL;
+    }
+}
+
+/* Reads size bytes of a region from address as a debugger would, which unlike
+   binding_memory brings the timer counts in IO up to date. Returns false,
+   reading nothing, if the bytes run past the end of the region. */
+bool binding_read(Machine *m, uint8_t region, uint32_t address, uint8_t *data, size_t size)
+{
+    size_t region_size;
+    const Mem8 *memory = binding_memory(m, region, &region_size);
+    if (memory == NULL || address > region_size || size > region_size - address)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = region == BINDING_IO ? PeekDataMem(m, GP_REGISTERS + address + i) : memory[address + i];
+    }
+    return true;
+}
+
+/* Writes size bytes to a region from address as the program would, so IO
+   writes reach the peripherals, SRAM and EEPROM pages are marked dirty for
+   machine_restore and whatever was decoded from flash is dropped. Returns
+   false, writing nothing, if the bytes run past the end of the region. */
+bool binding_write(Machine *m, uint8_t region, uint32_t address, const uint8_t *data, size_t size)
+{
+    size_t region_size;
+    if (binding_memory(m, region, &region_size) == NULL || address > region_size || size > region_size - address)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        const uint32_t a = address + i;
+        switch (region)
+        {
+        case BINDING_R:
+            SetDataMem(m, a, data[i]);
+            break;
+        case BINDING_IO:
+            SetDataMem(m, GP_REGISTERS + a, data[i]);
+            break;
+        case BINDING_SRAM:
+            SetDataMem(m, GP_REGISTERS + IO_REGISTERS + a, data[i]);
+            break;
+        case BINDING_EEPROM:
+            SetEEPROM(m, a, data[i]);
+            break;
+        default:
+        {
+            const Mem16 word = GetProgMem(m, a / 2);
+            SetProgMem(m, a / 2, a % 2 ? Get16(data[i], word & 0xff) : Get16(word >> 8, data[i]));
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+uint32_t binding_pc(Machine *m)
+{
+    return GetPC(m);
+}
+
+void binding_set_pc(Machine *m, uint32_t pc)
+{
+    SetPC(m, pc);
+}
+
+uint8_t binding_sreg(Machine *m)
+{
+    return PackSREG(m);
+}
+
+void binding_set_sreg(Machine *m, uint8_t sreg)
+{
+    UnpackSREG(m, sreg);
+}
+
+uint64_t binding_cycles(Machine *m)
+{
+    return m->CYCLES;
+}
+
+/* Runs each of n snapshots for at least max_cycles through run_batch, with m
+   as the image, on threads workers or one per core if 0. The snapshots are
+   copied in and back out, as run_batch takes an array, and halted is set for
+   each. Returns false, leaving the snapshots as they were, if the batch
+   couldn't all be run. */
+bool binding_run_batch(Machine *m, MachineState *const snapshots[], size_t n, uint64_t max_cycles, size_t threads,
+                       bool halted[])
+{
+    MachineState *states = malloc((n > 0 ? n : 1) * sizeof(MachineState));
+    if (states == NULL)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        states[i] = *snapshots[i];
+    }
+    const bool ran = run_batch(m, states, n, max_cycles, threads);
+    for (size_t i = 0; ran && i < n; i++)
+    {
+        *snapshots[i] = states[i];
+        halted[i] = states[i].HALTED;
+    }
+#ifdef DIRTY_PAGES
+    /* m may have been tracking one of the snapshots, which have all changed. */
+    if (ran)
+    {
+        m->SNAPSHOT = NULL;
+    }
+#endif
+    free(states);
+    return ran;
+}
+
+/* Storage for machine_snapshot and machine_restore. */
+MachineState *binding_state_new(void)
+{
+    return malloc(sizeof(MachineState));
+}
+
+void binding_state_free(MachineState *s)
+{
+    free(s);
+}
@@ -1,7 +1,29 @@
 #ifndef __ATSIM_CONFIG
 #define __ATSIM_CONFIG
 
+/* Builds of every MCU in one binary select each MCU on the command line. */
+#if !defined(MCU_ATTiny25) && !defined(MCU_ATTiny45) && !defined(MCU_ATTiny85)
 #define MCU_ATTiny85
+#endif
+
+// #define DECODE_LINEAR
+#define PREDECODE
+#define FUSION
+// #define THREADED
+// #define JIT
+// #define LAZY_FLAGS
+// #define PACKED_SREG
+// #define FLAT_DATA
+// #define PROFILE
+// #define TRACE
+// #define DIRTY_PAGES
+// #define LOCKSTEP
+// #define LANES
+// #define WATCHPOINTS
+// #define TIMERS
+// #define INTERRUPTS
+// #define GPIO
+// #define FAST_FORWARD
 
 // #define DEBUG_PRINT_PC
 // #define DEBUG_PRINT_MNEMONICS
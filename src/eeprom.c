@@ -0,0 +1,219 @@
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include "machine.h"
+
+/* The EEPROM controller of the ATtiny25/45/85. Programming takes as long as
+   on the chip, at CPU_FREQUENCY, and finishes with an event, as does EEMPE
+   clearing itself, so nothing is polled between instructions. EECR always
+   holds the controller's state, so can be tested by SBIC/SBIS directly. */
+
+#ifdef TIMERS
+
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+#define EEPM0 4
+#define EEPM_MASK 0x30
+
+#define EEPM_ERASE 1
+#define EEPM_WRITE 2
+
+#ifndef CPU_FREQUENCY
+#define CPU_FREQUENCY 8000000
+#endif
+
+/* EEPE must be set within this many cycles of setting EEMPE. */
+#define EEPROM_MASTER_CYCLES 4
+/* The CPU stops for this long after starting programming or reading. */
+#define EEPROM_WRITE_HALT_CYCLES 2
+#define EEPROM_READ_HALT_CYCLES 4
+
+/* Programming times by EEPM mode, 3.4ms to erase and write, 1.8ms to only
+   erase or only write. The reserved mode is taken to erase and write. */
+static const uint64_t EEPROM_PROGRAMMING_CYCLES[4] = {
+    (uint64_t)CPU_FREQUENCY * 34 / 10000,
+    (uint64_t)CPU_FREQUENCY * 18 / 10000,
+    (uint64_t)CPU_FREQUENCY * 18 / 10000,
+    (uint64_t)CPU_FREQUENCY * 34 / 10000,
+};
+
+static void eeprom_schedule(Machine *m)
+{
+    const EepromController *e = &m->PERIPHERALS.EEPROM;
+    const uint64_t next = e->MASTER_END < e->WRITE_END ? e->MASTER_END : e->WRITE_END;
+    if (next == UINT64_MAX)
+    {
+        event_cancel(m, EVENT_EEPROM);
+        return;
+    }
+    event_schedule(m, EVENT_EEPROM, next);
+}
+
+/* EE_RDY is requested for as long as it is enabled and nothing is being
+   programmed, so entering it clears nothing. */
+static void eeprom_request(Machine *m)
+{
+#ifdef INTERRUPTS
+    const Mem8 eecr = m->IO[EECR_IO_ADDRESS];
+    const bool ready = TestBit(eecr, EERIE) && !TestBit(eecr, EEPE);
+    interrupts_request(m, UINT16_C(1) << VECTOR_EE_RDY, (uint16_t)ready << VECTOR_EE_RDY);
+#else
+    UNUSED(m);
+#endif
+}
+
+static void eeprom_program(Machine *m, const EepromController *e)
+{
+    switch (e->MODE)
+    {
+    case EEPM_ERASE:
+        SetEEPROM(m, e->ADDRESS, 0xff);
+        break;
+    case EEPM_WRITE:
+        /* Without an erase, programming can only clear bits. */
+        SetEEPROM(m, e->ADDRESS, GetEEPROM(m, e->ADDRESS) & e->DATA);
+        break;
+    default:
+        SetEEPROM(m, e->ADDRESS, e->DATA);
+        break;
+    }
+}
+
+void eeprom_reset(Machine *m)
+{
+    EepromController *e = &m->PERIPHERALS.EEPROM;
+    e->MASTER_END = UINT64_MAX;
+    e->WRITE_END = UINT64_MAX;
+    m->IO[EECR_IO_ADDRESS] &= ~((1 << EEMPE) | (1 << EEPE));
+    eeprom_schedule(m);
+    eeprom_request(m);
+}
+
+void eeprom_event(Machine *m)
+{
+    EepromController *e = &m->PERIPHERALS.EEPROM;
+    if (m->CYCLES >= e->MASTER_END)
+    {
+        m->IO[EECR_IO_ADDRESS] = ClearBit(m->IO[EECR_IO_ADDRESS], EEMPE);
+        e->MASTER_END = UINT64_MAX;
+    }
+    if (m->CYCLES >= e->WRITE_END)
+    {
+        eeprom_program(m, e);
+        m->IO[EECR_IO_ADDRESS] = ClearBit(m->IO[EECR_IO_ADDRESS], EEPE);
+        e->WRITE_END = UINT64_MAX;
+    }
+    eeprom_schedule(m);
+    eeprom_request(m);
+}
+
+/* A write to EECR. The mode can't change while programming, EEPE is only
+   cleared by the controller and EERE never reads as set. Programming starts
+   with EEPE written while EEMPE is still set from an earlier write, and takes
+   the address and data from EEAR and EEDR as it starts. */
+void eeprom_write(Machine *m, Mem8 v)
+{
+    EepromController *e = &m->PERIPHERALS.EEPROM;
+    const Mem8 eecr = m->IO[EECR_IO_ADDRESS];
+    const bool busy = TestBit(eecr, EEPE);
+    const Mem8 writable = (busy ? 0 : EEPM_MASK) | (1 << EERIE) | (1 << EEMPE);
+    Mem8 next = (eecr & ~writable) | (v & writable);
+    const Address16 address = Get16(m->IO[EEARH_IO_ADDRESS], m->IO[EEARL_IO_ADDRESS]) % EEPROM_SIZE;
+
+    if (!TestBit(next, EEMPE))
+    {
+        e->MASTER_END = UINT64_MAX;
+    }
+    else if (!TestBit(eecr, EEMPE))
+    {
+        e->MASTER_END = m->CYCLES + EEPROM_MASTER_CYCLES;
+    }
+
+    /* Events only run between instructions, so the window is checked too. */
+    if (TestBit(v, EEPE) && TestBit(eecr, EEMPE) && m->CYCLES < e->MASTER_END && !busy)
+    {
+        e->ADDRESS = address;
+        e->DATA = m->IO[EEDR_IO_ADDRESS];
+        e->MODE = (next & EEPM_MASK) >> EEPM0;
+        e->WRITE_END = m->CYCLES + EEPROM_PROGRAMMING_CYCLES[e->MODE];
+        next = SetBit(next, EEPE);
+        m->CYCLES += EEPROM_WRITE_HALT_CYCLES;
+    }
+    else if (TestBit(v, EERE) && !busy)
+    {
+        m->IO[EEDR_IO_ADDRESS] = GetEEPROM(m, address);
+        m->CYCLES += EEPROM_READ_HALT_CYCLES;
+    }
+    m->IO[EECR_IO_ADDRESS] = next;
+    eeprom_schedule(m);
+    eeprom_request(m);
+}
+
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Maps EEPROM from a file, so its contents last from one run to the next
+   without being read in or written out. Whatever the file is too short to
+   hold, all of it for a new file, is taken from the EEPROM as loaded. Loading
+   a program ends the mapping, so call this after loading. */
+bool eeprom_map(Machine *m, const char file_name[])
+{
+    eeprom_unmap(m);
+    const int fd = open(file_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size < EEPROM_SIZE && ftruncate(fd, EEPROM_SIZE) != 0))
+    {
+        close(fd);
+        return false;
+    }
+    Mem8 *eeprom = mmap(NULL, EEPROM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (eeprom == MAP_FAILED)
+    {
+        return false;
+    }
+    if (st.st_size < EEPROM_SIZE)
+    {
+        memcpy(eeprom + st.st_size, m->EEPROM + st.st_size, EEPROM_SIZE - st.st_size);
+    }
+    m->EEPROM = eeprom;
+    return true;
+}
+
+/* The file is already up to date, its last contents are kept in the machine. */
+void eeprom_unmap(Machine *m)
+{
+    if (m->EEPROM != m->EEPROM_DATA)
+    {
+        memcpy(m->EEPROM_DATA, m->EEPROM, EEPROM_SIZE);
+        munmap(m->EEPROM, EEPROM_SIZE);
+        m->EEPROM = m->EEPROM_DATA;
+    }
+}
+
+#else
+
+bool eeprom_map(Machine *m, const char file_name[])
+{
+    UNUSED(m);
+    UNUSED(file_name);
+    return false;
+}
+
+void eeprom_unmap(Machine *m)
+{
+    UNUSED(m);
+}
+
+#endif
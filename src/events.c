@@ -0,0 +1,136 @@
+#include "machine.h"
+
+#ifdef TIMERS
+
+/* Each source has at most one pending event, so the heap never holds more
+   than EVENT_SOURCES events and POSITION finds a source's event in it. */
+
+#define EVENT_NONE 0xff
+
+static void swap_events(EventQueue *q, uint8_t a, uint8_t b)
+{
+    const Event event = q->HEAP[a];
+    q->HEAP[a] = q->HEAP[b];
+    q->HEAP[b] = event;
+    q->POSITION[q->HEAP[a].source] = a;
+    q->POSITION[q->HEAP[b].source] = b;
+}
+
+static void sift_up(EventQueue *q, uint8_t i)
+{
+    while (i > 0 && q->HEAP[(i - 1) / 2].cycle > q->HEAP[i].cycle)
+    {
+        swap_events(q, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(EventQueue *q, uint8_t i)
+{
+    while (true)
+    {
+        uint8_t first = i;
+        const uint8_t left = i * 2 + 1;
+        const uint8_t right = i * 2 + 2;
+        if (left < q->COUNT && q->HEAP[left].cycle < q->HEAP[first].cycle)
+        {
+            first = left;
+        }
+        if (right < q->COUNT && q->HEAP[right].cycle < q->HEAP[first].cycle)
+        {
+            first = right;
+        }
+        if (first == i)
+        {
+            return;
+        }
+        swap_events(q, i, first);
+        i = first;
+    }
+}
+
+static void update_next(EventQueue *q)
+{
+    q->NEXT = q->COUNT > 0 ? q->HEAP[0].cycle : UINT64_MAX;
+}
+
+void events_reset(Machine *m)
+{
+    EventQueue *q = &m->PERIPHERALS.EVENTS;
+    q->COUNT = 0;
+    for (uint8_t source = 0; source < EVENT_SOURCES; source++)
+    {
+        q->POSITION[source] = EVENT_NONE;
+    }
+    update_next(q);
+}
+
+/* Schedules the event of a source, replacing any event it already had. */
+void event_schedule(Machine *m, EventSource source, uint64_t cycle)
+{
+    EventQueue *q = &m->PERIPHERALS.EVENTS;
+    uint8_t i = q->POSITION[source];
+    if (i == EVENT_NONE)
+    {
+        i = q->COUNT++;
+        q->HEAP[i].source = source;
+        q->POSITION[source] = i;
+    }
+    q->HEAP[i].cycle = cycle;
+    sift_up(q, i);
+    sift_down(q, q->POSITION[source]);
+    update_next(q);
+}
+
+void event_cancel(Machine *m, EventSource source)
+{
+    EventQueue *q = &m->PERIPHERALS.EVENTS;
+    const uint8_t i = q->POSITION[source];
+    if (i == EVENT_NONE)
+    {
+        return;
+    }
+    q->COUNT--;
+    if (i != q->COUNT)
+    {
+        /* Move the last event into the gap, then restore the heap around it. */
+        const uint8_t moved = q->HEAP[q->COUNT].source;
+        swap_events(q, i, q->COUNT);
+        sift_up(q, i);
+        sift_down(q, q->POSITION[moved]);
+    }
+    q->POSITION[source] = EVENT_NONE;
+    update_next(q);
+}
+
+/* Runs every event due by the current cycle. A source may schedule its next
+   event while handling one, which runs in this call if it is also due. */
+void run_events(Machine *m)
+{
+    EventQueue *q = &m->PERIPHERALS.EVENTS;
+    while (q->COUNT > 0 && q->HEAP[0].cycle <= m->CYCLES)
+    {
+        const EventSource source = q->HEAP[0].source;
+        event_cancel(m, source);
+        switch (source)
+        {
+        case EVENT_TIMER0:
+        case EVENT_TIMER1:
+            timer_event(m, source);
+            break;
+        case EVENT_EEPROM:
+            eeprom_event(m);
+            break;
+#ifdef GPIO
+        case EVENT_GPIO_FLUSH:
+        case EVENT_GPIO_INPUT:
+            gpio_event(m, source);
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+}
+
+#endif
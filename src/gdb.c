@@ -0,0 +1,846 @@
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <string.h>
+#include "machine.h"
+
+/* A GDB remote serial protocol stub, serving one connection on a TCP port.
+   The connection is handled by an epoll event loop on the calling thread while
+   the target runs on a thread of its own. A running target is only ever
+   interrupted by testing a breakpoint bitmap indexed by PC and an atomic stop
+   flag after each instruction, which GDB's interrupt and BREAK set. Software
+   and hardware breakpoints are both kept in the bitmap, so program memory is
+   never patched.
+
+   GDB sees the AVR address spaces as it does for avr-gdb: program memory from
+   0, the data space from GDB_DATA_BASE and EEPROM from GDB_EEPROM_BASE.
+   Registers are R0 to R31, SREG, SP and PC, which is a byte address. With
+   WATCHPOINTS, watchpoints on the data space are armed on the machine. */
+
+#if defined(__linux__) && defined(__GNUC__)
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_DATA_BASE 0x800000
+#define GDB_EEPROM_BASE 0x810000
+#define GDB_REGISTER_SREG 32
+#define GDB_REGISTER_SP 33
+#define GDB_REGISTER_PC 34
+#define GDB_REGISTERS 35
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+
+typedef enum
+{
+    COMMAND_NONE,
+    COMMAND_CONTINUE,
+    COMMAND_STEP,
+    COMMAND_EXIT,
+} GdbCommand;
+
+typedef enum
+{
+    PACKET_IDLE,
+    PACKET_DATA,
+    PACKET_CHECKSUM_HIGH,
+    PACKET_CHECKSUM_LOW,
+} PacketState;
+
+typedef struct GdbSession
+{
+    Machine *m;
+    uint64_t BREAKPOINTS[(PROG_MEM_SIZE + 63) / 64];
+    /* The signal to stop with, set by the event loop or BREAK and read after
+       every instruction. */
+    int stop;
+    /* Only the event loop changes running, the machine belongs to the target
+       thread while it is set. */
+    bool running;
+    bool done;
+    bool resume;
+    int signal;
+    int client;
+    int wake;
+    pthread_mutex_t lock;
+    pthread_cond_t resumed;
+    GdbCommand command;
+    PacketState state;
+    char packet[GDB_PACKET_SIZE];
+    size_t packet_size;
+    uint8_t checksum;
+    uint8_t received_checksum;
+    char reply[GDB_PACKET_SIZE + 4];
+    size_t reply_size;
+} GdbSession;
+
+static inline bool BreakpointAt(const GdbSession *s, Reg16 pc)
+{
+    return (s->BREAKPOINTS[pc / 64] >> (pc % 64)) & 0x1;
+}
+
+/* The target's hot loop, superinstructions stop after each part while a
+   debugger is attached so every instruction boundary is seen. Returns the
+   signal to report. */
+static int gdb_run(GdbSession *s, bool step)
+{
+    Machine *m = s->m;
+    while (true)
+    {
+        const Reg16 last_pc = GetPC(m);
+        machine_cycle(m);
+        if (step || Halted(m, last_pc) || BreakpointAt(s, GetPC(m)))
+        {
+            return GDB_SIGTRAP;
+        }
+        const int stop = __atomic_load_n(&s->stop, __ATOMIC_RELAXED);
+        if (stop != 0)
+        {
+            return stop;
+        }
+    }
+}
+
+static void *gdb_target(void *arg)
+{
+    GdbSession *s = arg;
+    while (true)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (s->command == COMMAND_NONE)
+        {
+            pthread_cond_wait(&s->resumed, &s->lock);
+        }
+        const GdbCommand command = s->command;
+        s->command = COMMAND_NONE;
+        pthread_mutex_unlock(&s->lock);
+        if (command == COMMAND_EXIT)
+        {
+            return NULL;
+        }
+
+        const int signal = gdb_run(s, command == COMMAND_STEP);
+        pthread_mutex_lock(&s->lock);
+        s->signal = signal;
+        pthread_mutex_unlock(&s->lock);
+        const uint64_t stopped = 1;
+        if (write(s->wake, &stopped, sizeof(stopped)) != sizeof(stopped))
+        {
+            return NULL;
+        }
+    }
+}
+
+/* Hands the machine to the target thread, which is waiting for a command. */
+static void gdb_command(GdbSession *s, GdbCommand command)
+{
+    pthread_mutex_lock(&s->lock);
+    __atomic_store_n(&s->stop, 0, __ATOMIC_RELAXED);
+    s->command = command;
+    pthread_cond_signal(&s->resumed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void gdb_send(GdbSession *s, const char *bytes, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t sent = send(s->client, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            s->done = true;
+            return;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+}
+
+/* Replies are kept until acknowledged in case GDB asks for them again. */
+static void gdb_reply(GdbSession *s, const char *data)
+{
+    static const char HEX[] = "0123456789abcdef";
+    const size_t size = strlen(data);
+    uint8_t checksum = 0;
+    s->reply[0] = '$';
+    for (size_t i = 0; i < size; i++)
+    {
+        s->reply[1 + i] = data[i];
+        checksum += (uint8_t)data[i];
+    }
+    s->reply[1 + size] = '#';
+    s->reply[2 + size] = HEX[checksum >> 4];
+    s->reply[3 + size] = HEX[checksum & 0xf];
+    s->reply_size = 4 + size;
+    gdb_send(s, s->reply, s->reply_size);
+}
+
+static void gdb_reply_stop(GdbSession *s)
+{
+    char reply[32];
+    snprintf(reply, sizeof(reply), "S%02x", s->signal);
+#ifdef WATCHPOINTS
+    const WatchHit *hit = &s->m->WATCH_HIT;
+    if (hit->kind == WATCH_READ || hit->kind == WATCH_WRITE)
+    {
+        snprintf(reply, sizeof(reply), "T%02x%s:%x;", s->signal, hit->kind == WATCH_READ ? "rwatch" : "watch",
+                 GDB_DATA_BASE + hit->address);
+    }
+#endif
+    gdb_reply(s, reply);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Reads a hex number of at most 8 digits and leaves p after it. */
+static bool parse_hex(const char **p, uint32_t *value)
+{
+    *value = 0;
+    size_t digits = 0;
+    for (int digit; (digit = hex_value(**p)) >= 0 && digits < 8; (*p)++, digits++)
+    {
+        *value = (*value << 4) | (uint32_t)digit;
+    }
+    return digits > 0 && hex_value(**p) < 0;
+}
+
+static bool parse_hex_byte(const char *p, Mem8 *value)
+{
+    const int high = hex_value(p[0]);
+    const int low = high < 0 ? -1 : hex_value(p[1]);
+    *value = (Mem8)((high << 4) | low);
+    return low >= 0;
+}
+
+static size_t register_size(uint32_t n)
+{
+    return n == GDB_REGISTER_PC ? 4 : n == GDB_REGISTER_SP ? 2 : 1;
+}
+
+static uint32_t read_register(Machine *m, uint32_t n)
+{
+    if (n < GP_REGISTERS)
+    {
+        return m->R[n];
+    }
+    if (n == GDB_REGISTER_SREG)
+    {
+        return PackSREG(m);
+    }
+    return n == GDB_REGISTER_SP ? GetSP(m) : (uint32_t)GetPC(m) * 2;
+}
+
+static void write_register(Machine *m, uint32_t n, uint32_t v)
+{
+    if (n < GP_REGISTERS)
+    {
+        m->R[n] = v;
+    }
+    else if (n == GDB_REGISTER_SREG)
+    {
+        UnpackSREG(m, v);
+    }
+    else if (n == GDB_REGISTER_SP)
+    {
+        SetSP(m, v);
+    }
+    else
+    {
+        SetPC(m, v / 2);
+    }
+}
+
+/* Registers are sent as little endian hex of their size. */
+static char *format_register(char *out, Machine *m, uint32_t n)
+{
+    const uint32_t v = read_register(m, n);
+    for (size_t i = 0; i < register_size(n); i++)
+    {
+        out += sprintf(out, "%02x", (v >> (8 * i)) & 0xff);
+    }
+    return out;
+}
+
+static bool parse_register(const char **p, uint32_t n, uint32_t *v)
+{
+    *v = 0;
+    for (size_t i = 0; i < register_size(n); i++, *p += 2)
+    {
+        Mem8 byte;
+        if (!parse_hex_byte(*p, &byte))
+        {
+            return false;
+        }
+        *v |= (uint32_t)byte << (8 * i);
+    }
+    return true;
+}
+
+static bool read_memory(Machine *m, uint32_t a, Mem8 *v)
+{
+    if (a < GDB_DATA_BASE)
+    {
+        if (a >= PROG_MEM_SIZE_BYTES)
+        {
+            return false;
+        }
+        *v = (GetProgMem(m, a / 2) >> (8 * (a % 2))) & 0xff;
+    }
+    else if (a < GDB_EEPROM_BASE)
+    {
+        if (a - GDB_DATA_BASE >= DATA_MEM_SIZE)
+        {
+            return false;
+        }
+        *v = PeekDataMem(m, a - GDB_DATA_BASE);
+    }
+    else
+    {
+        if (a - GDB_EEPROM_BASE >= EEPROM_SIZE)
+        {
+            return false;
+        }
+        *v = GetEEPROM(m, a - GDB_EEPROM_BASE);
+    }
+    return true;
+}
+
+static bool write_memory(Machine *m, uint32_t a, Mem8 v)
+{
+    if (a < GDB_DATA_BASE)
+    {
+        if (a >= PROG_MEM_SIZE_BYTES)
+        {
+            return false;
+        }
+        const Mem16 word = GetProgMem(m, a / 2);
+        SetProgMem(m, a / 2, a % 2 ? Get16(v, word & 0xff) : Get16(word >> 8, v));
+    }
+    else if (a < GDB_EEPROM_BASE)
+    {
+        if (a - GDB_DATA_BASE >= DATA_MEM_SIZE)
+        {
+            return false;
+        }
+        PokeDataMem(m, a - GDB_DATA_BASE, v);
+    }
+    else
+    {
+        if (a - GDB_EEPROM_BASE >= EEPROM_SIZE)
+        {
+            return false;
+        }
+        SetEEPROM(m, a - GDB_EEPROM_BASE, v);
+    }
+    return true;
+}
+
+static void handle_registers(GdbSession *s)
+{
+    char reply[GDB_REGISTERS * 8 + 1];
+    char *out = reply;
+    for (uint32_t n = 0; n < GDB_REGISTERS; n++)
+    {
+        out = format_register(out, s->m, n);
+    }
+    gdb_reply(s, reply);
+}
+
+static void handle_write_registers(GdbSession *s, const char *p)
+{
+    for (uint32_t n = 0; n < GDB_REGISTERS && *p != '\0'; n++)
+    {
+        uint32_t v;
+        if (!parse_register(&p, n, &v))
+        {
+            gdb_reply(s, "E01");
+            return;
+        }
+        write_register(s->m, n, v);
+    }
+    gdb_reply(s, "OK");
+}
+
+static void handle_register(GdbSession *s, const char *p)
+{
+    uint32_t n;
+    char reply[9];
+    if (!parse_hex(&p, &n) || *p != '\0' || n >= GDB_REGISTERS)
+    {
+        gdb_reply(s, "E01");
+        return;
+    }
+    *format_register(reply, s->m, n) = '\0';
+    gdb_reply(s, reply);
+}
+
+static void handle_write_register(GdbSession *s, const char *p)
+{
+    uint32_t n, v;
+    if (!parse_hex(&p, &n) || *p++ != '=' || n >= GDB_REGISTERS || !parse_register(&p, n, &v))
+    {
+        gdb_reply(s, "E01");
+        return;
+    }
+    write_register(s->m, n, v);
+    gdb_reply(s, "OK");
+}
+
+static void handle_memory(GdbSession *s, const char *p)
+{
+    uint32_t a, length;
+    char reply[GDB_PACKET_SIZE];
+    if (!parse_hex(&p, &a) || *p++ != ',' || !parse_hex(&p, &length) || length > sizeof(reply) / 2 - 1)
+    {
+        gdb_reply(s, "E01");
+        return;
+    }
+    size_t size = 0;
+    Mem8 v;
+    for (uint32_t i = 0; i < length && read_memory(s->m, a + i, &v); i++)
+    {
+        size += sprintf(reply + size, "%02x", v);
+    }
+    reply[size] = '\0';
+    /* A read which starts out of range fails, one which ends there is cut short. */
+    gdb_reply(s, size > 0 || length == 0 ? reply : "E01");
+}
+
+static void handle_write_memory(GdbSession *s, const char *p)
+{
+    uint32_t a, length;
+    if (!parse_hex(&p, &a) || *p++ != ',' || !parse_hex(&p, &length) || *p++ != ':' || strlen(p) != 2 * length)
+    {
+        gdb_reply(s, "E01");
+        return;
+    }
+    for (uint32_t i = 0; i < length; i++, p += 2)
+    {
+        Mem8 v;
+        if (!parse_hex_byte(p, &v) || !write_memory(s->m, a + i, v))
+        {
+            gdb_reply(s, "E01");
+            return;
+        }
+    }
+    gdb_reply(s, "OK");
+}
+
+#ifdef WATCHPOINTS
+/* Watchpoints are armed on the machine itself, type 2 watches writes, 3 reads
+   and 4 both. */
+static void handle_watchpoint(GdbSession *s, uint32_t type, uint32_t a, uint32_t length, bool insert)
+{
+    if (a < GDB_DATA_BASE || a - GDB_DATA_BASE > DATA_MEM_SIZE || length > DATA_MEM_SIZE - (a - GDB_DATA_BASE))
+    {
+        gdb_reply(s, "E01");
+        return;
+    }
+    for (uint32_t i = 0; i < length; i++)
+    {
+        if (type != 3)
+        {
+            watch_data(s->m, a - GDB_DATA_BASE + i, WATCH_WRITE, insert);
+        }
+        if (type != 2)
+        {
+            watch_data(s->m, a - GDB_DATA_BASE + i, WATCH_READ, insert);
+        }
+    }
+    gdb_reply(s, "OK");
+}
+#endif
+
+static void handle_breakpoint(GdbSession *s, const char *p, bool insert)
+{
+    uint32_t type, a, kind;
+    if (!parse_hex(&p, &type) || *p++ != ',' || !parse_hex(&p, &a) || *p++ != ',' || !parse_hex(&p, &kind))
+    {
+        gdb_reply(s, "E01");
+        return;
+    }
+    if (type > 1)
+    {
+#ifdef WATCHPOINTS
+        if (type <= 4)
+        {
+            handle_watchpoint(s, type, a, kind, insert);
+            return;
+        }
+#endif
+        gdb_reply(s, "");
+        return;
+    }
+    if (a >= PROG_MEM_SIZE_BYTES || a % 2 != 0)
+    {
+        gdb_reply(s, "E01");
+        return;
+    }
+    const Address16 pc = a / 2;
+    if (insert)
+    {
+        s->BREAKPOINTS[pc / 64] |= UINT64_C(1) << (pc % 64);
+    }
+    else
+    {
+        s->BREAKPOINTS[pc / 64] &= ~(UINT64_C(1) << (pc % 64));
+    }
+    gdb_reply(s, "OK");
+}
+
+static void handle_resume(GdbSession *s, const char *p, GdbCommand command)
+{
+    uint32_t a;
+    if (*p != '\0')
+    {
+        if (!parse_hex(&p, &a))
+        {
+            gdb_reply(s, "E01");
+            return;
+        }
+        SetPC(s->m, a / 2);
+    }
+    s->running = true;
+    gdb_command(s, command);
+}
+
+static void handle_query(GdbSession *s, const char *p)
+{
+    if (strncmp(p, "Supported", strlen("Supported")) == 0)
+    {
+        char reply[64];
+        snprintf(reply, sizeof(reply), "PacketSize=%x;hwbreak+", GDB_PACKET_SIZE);
+        gdb_reply(s, reply);
+    }
+    else if (strcmp(p, "Attached") == 0)
+    {
+        gdb_reply(s, "1");
+    }
+    else
+    {
+        gdb_reply(s, "");
+    }
+}
+
+static void handle_packet(GdbSession *s)
+{
+    s->packet[s->packet_size] = '\0';
+    const char *p = s->packet + 1;
+    switch (s->packet[0])
+    {
+    case '?':
+        gdb_reply_stop(s);
+        break;
+    case 'g':
+        handle_registers(s);
+        break;
+    case 'G':
+        handle_write_registers(s, p);
+        break;
+    case 'p':
+        handle_register(s, p);
+        break;
+    case 'P':
+        handle_write_register(s, p);
+        break;
+    case 'm':
+        handle_memory(s, p);
+        break;
+    case 'M':
+        handle_write_memory(s, p);
+        break;
+    case 'Z':
+        handle_breakpoint(s, p, true);
+        break;
+    case 'z':
+        handle_breakpoint(s, p, false);
+        break;
+    case 'c':
+        handle_resume(s, p, COMMAND_CONTINUE);
+        break;
+    case 's':
+        handle_resume(s, p, COMMAND_STEP);
+        break;
+    case 'q':
+        handle_query(s, p);
+        break;
+    case 'H':
+        gdb_reply(s, "OK");
+        break;
+    case 'D':
+        gdb_reply(s, "OK");
+        s->resume = true;
+        s->done = true;
+        break;
+    case 'k':
+        s->done = true;
+        break;
+    default:
+        gdb_reply(s, "");
+        break;
+    }
+}
+
+/* While the target runs only interrupts are looked for, GDB sends nothing
+   else until it has stopped. */
+static void gdb_receive(GdbSession *s, const char *bytes, size_t size)
+{
+    for (size_t i = 0; i < size && !s->done; i++)
+    {
+        const char c = bytes[i];
+        if (s->running)
+        {
+            if (c == 0x03)
+            {
+                __atomic_store_n(&s->stop, GDB_SIGINT, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+        switch (s->state)
+        {
+        case PACKET_IDLE:
+            if (c == '$')
+            {
+                s->state = PACKET_DATA;
+                s->packet_size = 0;
+                s->checksum = 0;
+            }
+            else if (c == '-' && s->reply_size > 0)
+            {
+                gdb_send(s, s->reply, s->reply_size);
+            }
+            break;
+        case PACKET_DATA:
+            if (c == '#')
+            {
+                s->state = PACKET_CHECKSUM_HIGH;
+            }
+            else if (s->packet_size < GDB_PACKET_SIZE - 1)
+            {
+                s->packet[s->packet_size++] = c;
+                s->checksum += (uint8_t)c;
+            }
+            break;
+        case PACKET_CHECKSUM_HIGH:
+            s->received_checksum = (uint8_t)(hex_value(c) << 4);
+            s->state = PACKET_CHECKSUM_LOW;
+            break;
+        case PACKET_CHECKSUM_LOW:
+            s->received_checksum |= (uint8_t)hex_value(c);
+            s->state = PACKET_IDLE;
+            if (s->received_checksum != s->checksum)
+            {
+                gdb_send(s, "-", 1);
+                break;
+            }
+            gdb_send(s, "+", 1);
+            handle_packet(s);
+            break;
+        }
+    }
+}
+
+static int gdb_listen(uint16_t port)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 1) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool gdb_watch(int epoll, int fd)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    return epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+static void gdb_event_loop(GdbSession *s, int epoll, int listener)
+{
+    while (!s->done)
+    {
+        struct epoll_event events[3];
+        const int n = epoll_wait(epoll, events, 3, -1);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return;
+        }
+        for (int i = 0; i < n && !s->done; i++)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == listener)
+            {
+                /* Only the one connection is served. */
+                s->client = accept(listener, NULL, NULL);
+                const int on = 1;
+                if (s->client < 0 || !gdb_watch(epoll, s->client) ||
+                    epoll_ctl(epoll, EPOLL_CTL_DEL, listener, NULL) != 0)
+                {
+                    return;
+                }
+                setsockopt(s->client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                fputs("GDB connected.\n", stderr);
+            }
+            else if (fd == s->wake)
+            {
+                uint64_t stopped;
+                if (read(s->wake, &stopped, sizeof(stopped)) == sizeof(stopped))
+                {
+                    pthread_mutex_lock(&s->lock);
+                    s->running = false;
+                    pthread_mutex_unlock(&s->lock);
+                    gdb_reply_stop(s);
+                }
+            }
+            else if (fd == s->client)
+            {
+                char bytes[GDB_PACKET_SIZE];
+                const ssize_t size = recv(s->client, bytes, sizeof(bytes), 0);
+                if (size < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (size <= 0)
+                {
+                    /* GDB went away, which leaves the target to carry on. */
+                    s->resume = true;
+                    s->done = true;
+                }
+                else
+                {
+                    gdb_receive(s, bytes, size);
+                }
+            }
+        }
+    }
+}
+
+/* Serves GDB on port of the loopback interface until it detaches, which sets
+   resume, or kills the target. Returns false if the port couldn't be served. */
+bool gdb_serve(Machine *m, uint16_t port, bool *resume)
+{
+    *resume = false;
+    GdbSession *s = calloc(1, sizeof(GdbSession));
+    if (s == NULL)
+    {
+        return false;
+    }
+    s->m = m;
+    s->signal = GDB_SIGTRAP;
+    s->client = -1;
+    s->state = PACKET_IDLE;
+    s->command = COMMAND_NONE;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->resumed, NULL);
+
+    const int listener = gdb_listen(port);
+    const int epoll = epoll_create1(0);
+    s->wake = eventfd(0, 0);
+    pthread_t target;
+    bool served = listener >= 0 && epoll >= 0 && s->wake >= 0 && gdb_watch(epoll, listener) &&
+                  gdb_watch(epoll, s->wake) && pthread_create(&target, NULL, gdb_target, s) == 0;
+    if (served)
+    {
+        fprintf(stderr, "Waiting for GDB on port %u.\n", port);
+        m->DEBUGGER = s;
+#ifdef FUSION
+        m->FUSION_LIMIT = 0;
+#endif
+        gdb_event_loop(s, epoll, listener);
+
+        /* Stop the target if it's still running and wait for it. */
+        __atomic_store_n(&s->stop, GDB_SIGINT, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&s->lock);
+        s->command = COMMAND_EXIT;
+        pthread_cond_signal(&s->resumed);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(target, NULL);
+        m->DEBUGGER = NULL;
+#ifdef FUSION
+        m->FUSION_LIMIT = UINT64_MAX;
+#endif
+        *resume = s->resume;
+    }
+    else
+    {
+        fprintf(stderr, "Unable to serve GDB on port %u.\n", port);
+    }
+
+    const int fds[] = {s->client, s->wake, epoll, listener};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+    pthread_cond_destroy(&s->resumed);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    return served;
+}
+
+/* Called by BREAK with a debugger attached, which stops after it. */
+void gdb_break(Machine *m)
+{
+    __atomic_store_n(&m->DEBUGGER->stop, GDB_SIGTRAP, __ATOMIC_RELAXED);
+}
+
+#else
+
+bool gdb_serve(Machine *m, uint16_t port, bool *resume)
+{
+    UNUSED(m);
+    *resume = false;
+    fprintf(stderr, "Unable to serve GDB on port %u, the GDB stub needs a Linux host.\n", port);
+    return false;
+}
+
+void gdb_break(Machine *m)
+{
+    UNUSED(m);
+}
+
+#endif
@@ -0,0 +1,198 @@
+#include "machine.h"
+
+#ifdef GPIO
+
+/* Port B of the ATtiny25/45/85 and its pin change interrupt. What the program
+   writes to DDRB, PORTB and PINB is recorded with the cycle of the write and
+   passed to the host in batches, and the host drives pins in turn through an
+   event at the cycle it asks for, so PINB and GIFR only change on a write or
+   an event. PINB follows the pins without the input synchronizer's delay, and
+   INT0 and the USI aren't modelled. */
+
+#define PCIF 5
+#define PCIE 5
+
+static void gpio_request(Machine *m)
+{
+#ifdef INTERRUPTS
+    const bool requested = TestBit(m->IO[GIFR_IO_ADDRESS], PCIF) && TestBit(m->IO[GIMSK_IO_ADDRESS], PCIE);
+    interrupts_request(m, UINT16_C(1) << VECTOR_PCINT0, (uint16_t)requested << VECTOR_PCINT0);
+#else
+    UNUSED(m);
+#endif
+}
+
+/* Brings PINB up to date with the pins, an input the host doesn't drive reads
+   as its pull-up. A pin enabled in PCMSK which changes sets PCIF, whether the
+   program or the host changed it. */
+static void gpio_update(Machine *m)
+{
+    const GpioPins *p = &m->PINS;
+    const Mem8 ddr = m->IO[DDRB_IO_ADDRESS];
+    const Mem8 port = m->IO[PORTB_IO_ADDRESS];
+    const Mem8 inputs = (p->DRIVEN & p->LEVELS) | (~p->DRIVEN & port);
+    const Mem8 pins = ((ddr & port) | (~ddr & inputs)) & GPIO_PINS;
+    if ((pins ^ m->IO[PINB_IO_ADDRESS]) & m->IO[PCMSK_IO_ADDRESS])
+    {
+        m->IO[GIFR_IO_ADDRESS] = SetBit(m->IO[GIFR_IO_ADDRESS], PCIF);
+    }
+    m->IO[PINB_IO_ADDRESS] = pins;
+    gpio_request(m);
+}
+
+/* The first change of a batch schedules its flush, a full batch is flushed
+   early so nothing is lost. */
+static void gpio_record(Machine *m)
+{
+    GpioPins *p = &m->PINS;
+    if (p->CALLBACK == NULL)
+    {
+        return;
+    }
+    if (p->CHANGE_COUNT == GPIO_BATCH_SIZE)
+    {
+        gpio_flush(m);
+    }
+    if (p->CHANGE_COUNT == 0)
+    {
+        const uint64_t flush = p->INTERVAL < UINT64_MAX - m->CYCLES ? m->CYCLES + p->INTERVAL : UINT64_MAX - 1;
+        event_schedule(m, EVENT_GPIO_FLUSH, flush);
+    }
+    PinChange *change = &p->CHANGES[p->CHANGE_COUNT++];
+    change->cycle = m->CYCLES;
+    change->ddr = m->IO[DDRB_IO_ADDRESS] & GPIO_PINS;
+    change->port = m->IO[PORTB_IO_ADDRESS] & GPIO_PINS;
+}
+
+static void gpio_input(Machine *m)
+{
+    GpioPins *p = &m->PINS;
+    uint8_t done = 0;
+    while (done < p->INPUT_COUNT && p->INPUTS[done].cycle <= m->CYCLES)
+    {
+        p->DRIVEN = p->INPUTS[done].driven;
+        p->LEVELS = p->INPUTS[done].levels;
+        gpio_update(m);
+        done++;
+    }
+    p->INPUT_COUNT -= done;
+    for (uint8_t i = 0; i < p->INPUT_COUNT; i++)
+    {
+        p->INPUTS[i] = p->INPUTS[i + done];
+    }
+    if (p->INPUT_COUNT > 0)
+    {
+        event_schedule(m, EVENT_GPIO_INPUT, p->INPUTS[0].cycle);
+    }
+}
+
+/* The callback is dropped along with anything queued for it. */
+void gpio_reset(Machine *m)
+{
+    GpioPins *p = &m->PINS;
+    p->CALLBACK = NULL;
+    p->CONTEXT = NULL;
+    p->INTERVAL = 0;
+    p->CHANGE_COUNT = 0;
+    p->INPUT_COUNT = 0;
+    p->DRIVEN = 0;
+    p->LEVELS = 0;
+    event_cancel(m, EVENT_GPIO_FLUSH);
+    event_cancel(m, EVENT_GPIO_INPUT);
+    gpio_update(m);
+}
+
+void gpio_event(Machine *m, EventSource source)
+{
+    if (source == EVENT_GPIO_FLUSH)
+    {
+        gpio_flush(m);
+        return;
+    }
+    gpio_input(m);
+}
+
+/* A write to one of GPIO_IO_HOOKS. Writing ones to PINB toggles those bits of
+   PORTB and writing ones to GIFR clears those flags. */
+void gpio_write(Machine *m, uint8_t a, Mem8 v)
+{
+    const Mem8 ddr = m->IO[DDRB_IO_ADDRESS];
+    const Mem8 port = m->IO[PORTB_IO_ADDRESS];
+    switch (a)
+    {
+    case PINB_IO_ADDRESS:
+        m->IO[PORTB_IO_ADDRESS] ^= v;
+        break;
+    case GIFR_IO_ADDRESS:
+        m->IO[GIFR_IO_ADDRESS] &= ~v;
+        break;
+    default:
+        m->IO[a] = v;
+        break;
+    }
+    if (m->IO[DDRB_IO_ADDRESS] != ddr || m->IO[PORTB_IO_ADDRESS] != port)
+    {
+        gpio_record(m);
+    }
+    gpio_update(m);
+}
+
+/* Passes pin changes to callback from now on, each within interval cycles of
+   when it happened. Anything queued for the last callback is flushed to it
+   first. A NULL callback stops recording. */
+void gpio_callback(Machine *m, PinCallback callback, void *context, uint64_t interval)
+{
+    gpio_flush(m);
+    GpioPins *p = &m->PINS;
+    p->CALLBACK = callback;
+    p->CONTEXT = context;
+    p->INTERVAL = interval;
+}
+
+/* Passes every queued change to the callback now, which may call gpio_drive. */
+void gpio_flush(Machine *m)
+{
+    GpioPins *p = &m->PINS;
+    event_cancel(m, EVENT_GPIO_FLUSH);
+    const uint16_t n = p->CHANGE_COUNT;
+    if (n == 0)
+    {
+        return;
+    }
+    p->CHANGE_COUNT = 0;
+    p->CALLBACK(p->CONTEXT, p->CHANGES, n);
+}
+
+/* Drives the pins set in driven to levels, and releases the rest, from cycle
+   on, or from now if cycle has passed. Returns false if too many inputs are
+   already waiting. */
+bool gpio_drive(Machine *m, uint64_t cycle, uint8_t driven, uint8_t levels)
+{
+    GpioPins *p = &m->PINS;
+    if (p->INPUT_COUNT == GPIO_INPUT_QUEUE_SIZE)
+    {
+        return false;
+    }
+    cycle = cycle > m->CYCLES ? cycle : m->CYCLES;
+    uint8_t i = p->INPUT_COUNT++;
+    while (i > 0 && p->INPUTS[i - 1].cycle > cycle)
+    {
+        p->INPUTS[i] = p->INPUTS[i - 1];
+        i--;
+    }
+    p->INPUTS[i].cycle = cycle;
+    p->INPUTS[i].driven = driven & GPIO_PINS;
+    p->INPUTS[i].levels = levels & GPIO_PINS;
+    event_schedule(m, EVENT_GPIO_INPUT, p->INPUTS[0].cycle);
+    return true;
+}
+
+#ifdef INTERRUPTS
+void gpio_acknowledge(Machine *m)
+{
+    m->IO[GIFR_IO_ADDRESS] = ClearBit(m->IO[GIFR_IO_ADDRESS], PCIF);
+    gpio_request(m);
+}
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+#include "machine.h"
+
+/* Waiting is skipped rather than simulated. Nothing but an event or an
+   interrupt changes what a sleeping machine or an idle loop does, so the
+   cycle count can jump to just before the next event. Peripherals must only
+   change IO registers from their events for this to hold, apart from the
+   timer counts, which are never polled by a recognised loop. */
+
+static uint64_t next_event(Machine *m)
+{
+#ifdef TIMERS
+    return m->PERIPHERALS.EVENTS.NEXT;
+#else
+    UNUSED(m);
+    return UINT64_MAX;
+#endif
+}
+
+static bool interrupt_pending(Machine *m)
+{
+#ifdef INTERRUPTS
+    return m->PENDING != 0;
+#else
+    UNUSED(m);
+    return false;
+#endif
+}
+
+/* Sleeps until an interrupt is pending, running events on the way. Returns
+   false if nothing could ever wake the machine, in which case SLEEP stays on
+   itself and the machine halts, or if the run ends first, in which case SLEEP
+   is run again by the next run. SLEEP is a NOP unless MCUCR SE is set. */
+bool machine_sleep(Machine *m)
+{
+    if (!TestBit(m->IO[MCUCR_IO_ADDRESS], MCUCR_SE))
+    {
+        return true;
+    }
+    while (!interrupt_pending(m))
+    {
+        const uint64_t next = next_event(m);
+        if (next == UINT64_MAX)
+        {
+            return false;
+        }
+        if (next > m->RUN_END)
+        {
+            /* SLEEP's own cycle takes the count to the end, as it would the
+               next run to the event after sleeping from there. */
+            m->CYCLES = m->RUN_END > m->CYCLES + 1 ? m->RUN_END - 1 : m->CYCLES;
+            return false;
+        }
+        m->CYCLES = next > m->CYCLES ? next : m->CYCLES;
+        CheckEvents(m);
+    }
+    return true;
+}
+
+#ifdef FAST_FORWARD
+
+/* Recognised loops, where K is a signed branch offset back to the start:
+
+     sbis/sbic A, b; rjmp K              polling an IO bit
+     in Rd, A; sbrs/sbrc Rd, b; rjmp K   polling any other IO register
+     dec Rd; brne K                      8 bit delay
+     sbiw Rd, 1; brne K                  16 bit delay
+     subi Rd, 1; [sbci Rd, 0]...; brne K delays of up to 24 bits
+     rjmp .                              waiting for an interrupt
+
+   Cycle costs are those counted by instructions.py for a pass which loops. */
+
+#define OPCODE_SBIC 0x9900
+#define OPCODE_SBIS 0x9B00
+#define OPCODE_IN 0xB000
+#define OPCODE_SBRC 0xFC00
+#define OPCODE_SBRS 0xFE00
+#define OPCODE_RJMP 0xC000
+#define OPCODE_BRNE 0xF401
+#define OPCODE_DEC 0x940A
+#define OPCODE_SBIW 0x9700
+#define OPCODE_SUBI 0x5000
+#define OPCODE_SBCI 0x4000
+
+#define DELAY_MAX_BYTES 3
+
+static inline bool is_rjmp_to(Mem16 opcode, int8_t offset)
+{
+    return (opcode & 0xF000) == OPCODE_RJMP && ToSigned(opcode & 0xFFF, 12) == offset;
+}
+
+static inline bool is_brne_to(Mem16 opcode, int8_t offset)
+{
+    return (opcode & 0xFC07) == OPCODE_BRNE && ToSigned((opcode >> 3) & 0x7F, 7) == offset;
+}
+
+static inline uint8_t in_address(Mem16 opcode)
+{
+    return ((opcode >> 5) & 0x30) | (opcode & 0xF);
+}
+
+static inline uint8_t immediate_register(Mem16 opcode)
+{
+    return 16 + ((opcode >> 4) & 0xF);
+}
+
+static inline uint8_t immediate_value(Mem16 opcode)
+{
+    return ((opcode >> 4) & 0xF0) | (opcode & 0xF);
+}
+
+/* A delay loop as the registers of its count, least significant first. */
+typedef struct
+{
+    uint8_t bytes;
+    uint8_t R[DELAY_MAX_BYTES];
+    uint8_t cycles;
+} DelayLoop;
+
+static bool delay_loop(Machine *m, Address16 pc, DelayLoop *d)
+{
+    const Mem16 first = GetProgMem(m, pc);
+    const Mem16 second = GetProgMem(m, pc + 1);
+    if ((first & 0xFE0F) == OPCODE_DEC && is_brne_to(second, -2))
+    {
+        *d = (DelayLoop){1, {(first >> 4) & 0x1F, 0, 0}, 3};
+        return true;
+    }
+    if ((first & 0xFF00) == OPCODE_SBIW && ((first >> 2) & 0x30) == 0 && (first & 0xF) == 1 &&
+        is_brne_to(second, -2))
+    {
+        const uint8_t d_low = 24 + ((first >> 4) & 0x3) * 2;
+        *d = (DelayLoop){2, {d_low, d_low + 1, 0}, 4};
+        return true;
+    }
+    if ((first & 0xF000) != OPCODE_SUBI || immediate_value(first) != 1)
+    {
+        return false;
+    }
+    *d = (DelayLoop){1, {immediate_register(first), 0, 0}, 3};
+    for (Address16 a = pc + 1; a < pc + DELAY_MAX_BYTES + 1; a++)
+    {
+        const Mem16 opcode = GetProgMem(m, a);
+        if (is_brne_to(opcode, -(int8_t)d->bytes - 1))
+        {
+            return true;
+        }
+        if ((opcode & 0xF000) != OPCODE_SBCI || immediate_value(opcode) != 0 || d->bytes == DELAY_MAX_BYTES)
+        {
+            return false;
+        }
+        for (uint8_t byte = 0; byte < d->bytes; byte++)
+        {
+            if (d->R[byte] == immediate_register(opcode))
+            {
+                return false;
+            }
+        }
+        d->R[d->bytes++] = immediate_register(opcode);
+        d->cycles++;
+    }
+    return false;
+}
+
+static IdleLoop classify_loop(Machine *m, Address16 pc)
+{
+    const Mem16 first = GetProgMem(m, pc);
+    const Mem16 second = GetProgMem(m, pc + 1);
+    if (first == OPCODE_RJMP_SELF)
+    {
+        return LOOP_WAIT;
+    }
+    if (((first & 0xFF00) == OPCODE_SBIS || (first & 0xFF00) == OPCODE_SBIC) && is_rjmp_to(second, -2))
+    {
+        return LOOP_POLL;
+    }
+    if ((first & 0xF800) == OPCODE_IN && in_address(first) != TCNT0_IO_ADDRESS &&
+        in_address(first) != TCNT1_IO_ADDRESS && ((second & 0xFE08) == OPCODE_SBRS || (second & 0xFE08) == OPCODE_SBRC) &&
+        ((second >> 4) & 0x1F) == ((first >> 4) & 0x1F) && is_rjmp_to(GetProgMem(m, pc + 2), -3))
+    {
+        return LOOP_POLL;
+    }
+    DelayLoop d;
+    return delay_loop(m, pc, &d) ? LOOP_DELAY : LOOP_NONE;
+}
+
+/* Whether a polling loop goes round again, and the cycles it takes to. */
+static bool poll_loops(Machine *m, Address16 pc, uint8_t *cycles)
+{
+    const Mem16 first = GetProgMem(m, pc);
+    if ((first & 0xF800) == OPCODE_IN)
+    {
+        const Mem16 second = GetProgMem(m, pc + 1);
+        *cycles = 4;
+        return TestBit(GetIO(m, in_address(first)), second & 0x7) == ((second & 0xFE08) == OPCODE_SBRC);
+    }
+    *cycles = 3;
+    return TestBit(m->IO[(first >> 3) & 0x1F], first & 0x7) == ((first & 0xFF00) == OPCODE_SBIC);
+}
+
+/* Skips whole passes of the idle loop starting at PC. Passes end before the
+   next event so it and any interrupt it raises happen on the same cycle as
+   without skipping, and by the end of the run, and delay loops are left their
+   last pass so it sets the flags. Traces and profiles only see the passes
+   which were run. */
+void fast_forward(Machine *m)
+{
+    const Address16 pc = GetPC(m) % PROG_MEM_SIZE;
+    if (m->LOOPS[pc] == LOOP_UNKNOWN)
+    {
+        m->LOOPS[pc] = classify_loop(m, pc);
+    }
+    if (m->LOOPS[pc] == LOOP_NONE || m->SKIP || interrupt_pending(m))
+    {
+        return;
+    }
+    const uint64_t next = next_event(m);
+    const uint64_t to_event = next == UINT64_MAX ? UINT64_MAX : next > m->CYCLES ? next - m->CYCLES - 1 : 0;
+    const uint64_t to_end = m->RUN_END == UINT64_MAX ? UINT64_MAX : m->RUN_END > m->CYCLES ? m->RUN_END - m->CYCLES : 0;
+    const uint64_t available = to_event < to_end ? to_event : to_end;
+
+    if (m->LOOPS[pc] == LOOP_WAIT)
+    {
+        /* Without SREG I set, or with no event to come, the jump is a halt. */
+        if (next != UINT64_MAX && GetStatusFlag(m, SREG_I))
+        {
+            m->CYCLES += available / 2 * 2;
+        }
+        return;
+    }
+    if (m->LOOPS[pc] == LOOP_POLL)
+    {
+        uint8_t cycles;
+        /* With no event to come the loop runs to the end, or forever as it
+           would anyway. */
+        if (available != UINT64_MAX && poll_loops(m, pc, &cycles))
+        {
+            m->CYCLES += available / cycles * cycles;
+        }
+        return;
+    }
+
+    DelayLoop d;
+    delay_loop(m, pc, &d);
+    uint32_t count = 0;
+    for (uint8_t byte = 0; byte < d.bytes; byte++)
+    {
+        count |= (uint32_t)m->R[d.R[byte]] << (8 * byte);
+    }
+    const uint32_t passes = count == 0 ? UINT32_C(1) << (8 * d.bytes) : count;
+    const uint64_t skipped = (uint64_t)passes - 1 < available / d.cycles ? passes - 1 : available / d.cycles;
+    count -= skipped;
+    for (uint8_t byte = 0; byte < d.bytes; byte++)
+    {
+        m->R[d.R[byte]] = (count >> (8 * byte)) & 0xFF;
+    }
+    m->CYCLES += skipped * d.cycles;
+}
+
+#endif
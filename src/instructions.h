@@ -4,6 +4,26 @@
 #include <stdio.h>
 #include "machine.h"
 
+extern const uint8_t HANDLER_COUNT;
+extern const uint32_t HANDLER_TABLE_HASH;
+extern const uint8_t DECODED_HANDLER_COUNT;
+extern const char *const HANDLER_MNEMONICS[];
+
 void decode_and_execute_instruction(Machine *m, Mem16 opcode);
+bool opcode_decodable(Mem16 opcode);
+#ifndef DECODE_LINEAR
+void decode_instruction(DecodedInstruction *i, Mem16 opcode, Mem16 extension);
+#endif
+#ifdef PREDECODE
+void predecode_instruction(Machine *m, Address16 a);
+void execute_predecoded_instruction(Machine *m);
+#endif
+#ifdef THREADED
+bool run_threaded_until_halt(Machine *m);
+#endif
+#ifdef PREDECODE
+typedef void (*ExecuteHandler)(Machine *m, const DecodedInstruction *i);
+extern const ExecuteHandler EXECUTE_HANDLERS[];
+#endif
 
 #endif
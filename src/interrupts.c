@@ -0,0 +1,62 @@
+#include "machine.h"
+
+#ifdef INTERRUPTS
+
+/* Peripherals request and withdraw their vectors as their flags and enable
+   bits change, and SREG I gates them, so that whether an interrupt is due is
+   already known when the run loops test PENDING between instructions. */
+
+void interrupts_request(Machine *m, uint16_t vectors, uint16_t requested)
+{
+    m->REQUESTED = (m->REQUESTED & ~vectors) | (requested & vectors);
+    UpdateInterrupts(m);
+}
+
+/* Enters the vector with the highest priority. The return address is pushed
+   and I cleared as by the hardware, which takes INTERRUPT_CYCLES to do it.
+   An interrupt never comes between a skip and the instruction it skips, nor
+   between SEI or RETI and the instruction after them. */
+void service_interrupt(Machine *m)
+{
+    if (m->SKIP || m->CYCLES == m->INHIBITED_AT)
+    {
+        return;
+    }
+    uint8_t vector = 0;
+    while (!TestBit(m->PENDING, vector))
+    {
+        vector++;
+    }
+
+    PushStack16(m, GetPC(m));
+    ClearStatusFlag(m, SREG_I);
+    SetPC(m, vector);
+
+    /* Flags which are cleared by entering their vector. */
+    switch (vector)
+    {
+#ifdef TIMERS
+    case VECTOR_TIMER1_COMPA:
+    case VECTOR_TIMER1_OVF:
+    case VECTOR_TIMER0_OVF:
+    case VECTOR_TIMER1_COMPB:
+    case VECTOR_TIMER0_COMPA:
+    case VECTOR_TIMER0_COMPB:
+        timer_acknowledge(m, vector);
+        break;
+#endif
+#ifdef GPIO
+    case VECTOR_PCINT0:
+        gpio_acknowledge(m);
+        break;
+#endif
+    default:
+        break;
+    }
+    m->CYCLES += INTERRUPT_CYCLES;
+#ifdef PROFILE
+    profile_call(m);
+#endif
+}
+
+#endif
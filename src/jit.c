@@ -0,0 +1,461 @@
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include "machine.h"
+#include "instructions.h"
+
+#ifdef PREDECODE
+static inline DecodedInstruction *jit_decoded(Machine *m, Address16 a)
+{
+    DecodedInstruction *i = &m->DECODED[a % PROG_MEM_SIZE];
+    if (i->handler == HANDLER_PREDECODE)
+    {
+        predecode_instruction(m, a);
+    }
+    return i;
+}
+#endif
+
+/* Interpret a block one instruction at a time, returns false on halt. Without
+   PREDECODE every instruction is treated as a block of its own. */
+static bool jit_interpret_block(Machine *m)
+{
+    for (size_t count = 0; count < JIT_MAX_BLOCK_INSTRUCTIONS; count++)
+    {
+        const Reg16 last_pc = GetPC(m);
+#ifdef PREDECODE
+        const bool ends_block = m->SKIP || jit_decoded(m, last_pc)->ends_block;
+#else
+        const bool ends_block = true;
+#endif
+        machine_cycle(m);
+        if (Halted(m, last_pc))
+        {
+            return false;
+        }
+        if (ends_block)
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+/* Compiled blocks are a sequence of calls to the generated execute handlers,
+   so the instruction semantics are only ever defined in instructions.py. What
+   is saved is the fetch, predecode check, halt check and indirect dispatch of
+   every instruction in the block. Between calls a block checks, as the run
+   loops do between instructions, for a due event, a pending interrupt or the
+   end of a run, and returns early if there is one, so it never runs an
+   instruction the interpreter wouldn't have. */
+
+#define JIT_CODE_SIZE (1024 * 1024)
+
+#if defined(__x86_64__)
+#define JIT_BLOCK_OVERHEAD 8
+#define JIT_INSTRUCTION_SIZE 29
+#define JIT_CHECK_SIZE 44
+#elif defined(__aarch64__)
+#define JIT_BLOCK_OVERHEAD 36
+#define JIT_INSTRUCTION_SIZE 48
+#define JIT_CHECK_SIZE 88
+#endif
+
+/* Handlers are passed their instruction by its offset in m->DECODED, which may
+   be a cache shared with other machines. */
+#define JIT_DECODED_OFFSET offsetof(Machine, DECODED)
+
+/* The code buffer is shared by every Machine, without a lock, so only one
+   thread may run machines through the JIT at a time. When it fills up it is
+   reused from the start and the generation is bumped, which invalidates all
+   blocks compiled before, as does failing to make it executable again. */
+static uint8_t *jit_code = NULL;
+static size_t jit_code_used = 0;
+static uint32_t jit_generation = 1;
+
+/* Returns true if the block stopped before its last instruction. */
+typedef bool (*JitBlockCode)(Machine *m);
+
+static inline bool jit_block_valid(const JitBlock *b)
+{
+    return b->code != NULL && b->generation == jit_generation;
+}
+
+static inline bool jit_call_block(Machine *m, const JitBlock *b)
+{
+    JitBlockCode code;
+    /* ISO C has no conversion from object to function pointers, copy instead. */
+    memcpy(&code, &b->code, sizeof(code));
+    return code(m);
+}
+
+#if defined(__x86_64__)
+static uint8_t *emit_bytes(uint8_t *p, const uint8_t bytes[], size_t len)
+{
+    memcpy(p, bytes, len);
+    return p + len;
+}
+
+static uint8_t *emit_u32(uint8_t *p, uint32_t v)
+{
+    for (size_t i = 0; i < 4; i++)
+    {
+        *p++ = (v >> (8 * i)) & 0xff;
+    }
+    return p;
+}
+
+static uint8_t *emit_u64(uint8_t *p, uint64_t v)
+{
+    for (size_t i = 0; i < 8; i++)
+    {
+        *p++ = (v >> (8 * i)) & 0xff;
+    }
+    return p;
+}
+
+static uint8_t *emit_prologue(uint8_t *p)
+{
+    /* push rbx; mov rbx, rdi */
+    const uint8_t prologue[] = {0x53, 0x48, 0x89, 0xfb};
+    return emit_bytes(p, prologue, sizeof(prologue));
+}
+
+static uint8_t *emit_call(uint8_t *p, uint32_t entry_offset, uintptr_t handler)
+{
+    /* mov rdi, rbx; mov rsi, [rbx + JIT_DECODED_OFFSET]; add rsi, entry_offset */
+    const uint8_t args[] = {0x48, 0x89, 0xdf, 0x48, 0x8b, 0xb3};
+    p = emit_bytes(p, args, sizeof(args));
+    p = emit_u32(p, JIT_DECODED_OFFSET);
+    const uint8_t add_rsi[] = {0x48, 0x81, 0xc6};
+    p = emit_bytes(p, add_rsi, sizeof(add_rsi));
+    p = emit_u32(p, entry_offset);
+    /* mov rax, handler; call rax */
+    const uint8_t mov_rax[] = {0x48, 0xb8};
+    p = emit_bytes(p, mov_rax, sizeof(mov_rax));
+    p = emit_u64(p, handler);
+    const uint8_t call_rax[] = {0xff, 0xd0};
+    return emit_bytes(p, call_rax, sizeof(call_rax));
+}
+
+/* Stops the block, returning true, while CYCLES >= RUN_END, CYCLES >=
+   EVENTS.NEXT or PENDING != 0. */
+static uint8_t *emit_check(uint8_t *p)
+{
+    uint8_t *stops[3];
+    size_t stop_count = 0;
+    const uint8_t cmp_rax[] = {0x48, 0x3b, 0x83};
+    const uint8_t jae[] = {0x73, 0x00};
+    /* mov rax, [rbx + CYCLES] */
+    const uint8_t mov_rax[] = {0x48, 0x8b, 0x83};
+    p = emit_bytes(p, mov_rax, sizeof(mov_rax));
+    p = emit_u32(p, offsetof(Machine, CYCLES));
+    /* cmp rax, [rbx + RUN_END]; jae stop */
+    p = emit_bytes(p, cmp_rax, sizeof(cmp_rax));
+    p = emit_u32(p, offsetof(Machine, RUN_END));
+    p = emit_bytes(p, jae, sizeof(jae));
+    stops[stop_count++] = p - 1;
+#ifdef TIMERS
+    /* cmp rax, [rbx + EVENTS.NEXT]; jae stop */
+    p = emit_bytes(p, cmp_rax, sizeof(cmp_rax));
+    p = emit_u32(p, offsetof(Machine, PERIPHERALS.EVENTS.NEXT));
+    p = emit_bytes(p, jae, sizeof(jae));
+    stops[stop_count++] = p - 1;
+#endif
+#ifdef INTERRUPTS
+    /* cmp word [rbx + PENDING], 0; jne stop */
+    const uint8_t cmp_pending[] = {0x66, 0x83, 0xbb};
+    p = emit_bytes(p, cmp_pending, sizeof(cmp_pending));
+    p = emit_u32(p, offsetof(Machine, PENDING));
+    const uint8_t zero_jne[] = {0x00, 0x75, 0x00};
+    p = emit_bytes(p, zero_jne, sizeof(zero_jne));
+    stops[stop_count++] = p - 1;
+#endif
+    /* jmp next; stop: mov eax, 1; pop rbx; ret; next: */
+    const uint8_t stop[] = {0xeb, 0x07, 0xb8, 0x01, 0x00, 0x00, 0x00, 0x5b, 0xc3};
+    for (size_t s = 0; s < stop_count; s++)
+    {
+        *stops[s] = p + 2 - (stops[s] + 1);
+    }
+    return emit_bytes(p, stop, sizeof(stop));
+}
+
+static uint8_t *emit_epilogue(uint8_t *p)
+{
+    /* xor eax, eax; pop rbx; ret */
+    const uint8_t epilogue[] = {0x31, 0xc0, 0x5b, 0xc3};
+    return emit_bytes(p, epilogue, sizeof(epilogue));
+}
+#elif defined(__aarch64__)
+static uint8_t *emit_u32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static uint8_t *emit_mov64(uint8_t *p, uint8_t reg, uint64_t v)
+{
+    /* movz reg, #v[15:0]; movk reg, #v[n+15:n], lsl #n */
+    p = emit_u32(p, 0xd2800000 | ((v & 0xffff) << 5) | reg);
+    for (uint32_t hw = 1; hw < 4; hw++)
+    {
+        p = emit_u32(p, 0xf2800000 | (hw << 21) | (((v >> (16 * hw)) & 0xffff) << 5) | reg);
+    }
+    return p;
+}
+
+static uint8_t *emit_prologue(uint8_t *p)
+{
+    p = emit_u32(p, 0xa9be7bfd); /* stp x29, x30, [sp, #-32]! */
+    p = emit_u32(p, 0x910003fd); /* mov x29, sp */
+    p = emit_u32(p, 0xf9000bf3); /* str x19, [sp, #16] */
+    return emit_u32(p, 0xaa0003f3); /* mov x19, x0 */
+}
+
+static uint8_t *emit_call(uint8_t *p, uint32_t entry_offset, uintptr_t handler)
+{
+    p = emit_u32(p, 0xaa1303e0); /* mov x0, x19 */
+    p = emit_u32(p, 0xd2800001 | ((JIT_DECODED_OFFSET & 0xffff) << 5)); /* movz x1, #lo */
+    p = emit_u32(p, 0xf2a00001 | (((JIT_DECODED_OFFSET >> 16) & 0xffff) << 5)); /* movk x1, #hi, lsl #16 */
+    p = emit_u32(p, 0xf8616a61); /* ldr x1, [x19, x1] */
+    p = emit_u32(p, 0xd2800002 | ((entry_offset & 0xffff) << 5)); /* movz x2, #lo */
+    p = emit_u32(p, 0xf2a00002 | (((entry_offset >> 16) & 0xffff) << 5)); /* movk x2, #hi, lsl #16 */
+    p = emit_u32(p, 0x8b020021); /* add x1, x1, x2 */
+    p = emit_mov64(p, 16, handler);
+    return emit_u32(p, 0xd63f0200); /* blr x16 */
+}
+
+static uint8_t *emit_return(uint8_t *p, bool stopped)
+{
+    p = emit_u32(p, 0x52800000 | (stopped << 5)); /* mov w0, #stopped */
+    p = emit_u32(p, 0xf9400bf3); /* ldr x19, [sp, #16] */
+    p = emit_u32(p, 0xa8c27bfd); /* ldp x29, x30, [sp], #32 */
+    return emit_u32(p, 0xd65f03c0); /* ret */
+}
+
+/* Loads a field of m into register reg with the load instruction op, through
+   x10. */
+static uint8_t *emit_load(uint8_t *p, uint32_t op, uint8_t reg, uint32_t offset)
+{
+    p = emit_u32(p, 0xd280000a | ((offset & 0xffff) << 5)); /* movz x10, #lo */
+    p = emit_u32(p, 0xf2a0000a | (((offset >> 16) & 0xffff) << 5)); /* movk x10, #hi, lsl #16 */
+    return emit_u32(p, op | (10 << 16) | (19 << 5) | reg); /* op reg, [x19, x10] */
+}
+
+/* Fills in the offset to target of the conditional branch at branch. */
+static void patch_branch(uint8_t *branch, const uint8_t *target)
+{
+    uint32_t instruction;
+    memcpy(&instruction, branch, sizeof(instruction));
+    instruction |= (((uint32_t)(target - branch) / 4) & 0x7ffff) << 5;
+    memcpy(branch, &instruction, sizeof(instruction));
+}
+
+/* Stops the block, returning true, while CYCLES >= RUN_END, CYCLES >=
+   EVENTS.NEXT or PENDING != 0. */
+static uint8_t *emit_check(uint8_t *p)
+{
+    const uint32_t ldr_x = 0xf8606800;
+    uint8_t *stops[3];
+    size_t stop_count = 0;
+    p = emit_load(p, ldr_x, 9, offsetof(Machine, CYCLES));
+    p = emit_load(p, ldr_x, 11, offsetof(Machine, RUN_END));
+    p = emit_u32(p, 0xeb0b013f); /* cmp x9, x11 */
+    stops[stop_count++] = p;
+    p = emit_u32(p, 0x54000002); /* b.hs stop */
+#ifdef TIMERS
+    p = emit_load(p, ldr_x, 11, offsetof(Machine, PERIPHERALS.EVENTS.NEXT));
+    p = emit_u32(p, 0xeb0b013f); /* cmp x9, x11 */
+    stops[stop_count++] = p;
+    p = emit_u32(p, 0x54000002); /* b.hs stop */
+#endif
+#ifdef INTERRUPTS
+    p = emit_load(p, 0x78606800, 11, offsetof(Machine, PENDING)); /* ldrh */
+    stops[stop_count++] = p;
+    p = emit_u32(p, 0x3500000b); /* cbnz w11, stop */
+#endif
+    p = emit_u32(p, 0x14000005); /* b next */
+    for (size_t s = 0; s < stop_count; s++)
+    {
+        patch_branch(stops[s], p);
+    }
+    return emit_return(p, true);
+}
+
+static uint8_t *emit_epilogue(uint8_t *p)
+{
+    return emit_return(p, false);
+}
+#endif
+
+static bool jit_reserve(size_t size)
+{
+    if (jit_code == NULL)
+    {
+        void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED)
+        {
+            return false;
+        }
+        jit_code = code;
+    }
+    if (jit_code_used + size > JIT_CODE_SIZE)
+    {
+        jit_code_used = 0;
+        jit_generation++;
+    }
+    return true;
+}
+
+static void jit_compile(Machine *m, Address16 start)
+{
+    JitBlock *b = &m->BLOCKS[start];
+    b->code = NULL;
+
+    /* Find the extent of the block, undecodable instructions are left to the
+       interpreter. */
+    Address16 a = start;
+    Address16 last = start;
+    size_t count = 0;
+    while (count < JIT_MAX_BLOCK_INSTRUCTIONS && a < PROG_MEM_SIZE)
+    {
+        const DecodedInstruction *i = jit_decoded(m, a);
+        if (i->handler == HANDLER_UNDECODABLE)
+        {
+            break;
+        }
+        last = a;
+        count++;
+        a += i->words;
+        if (i->ends_block)
+        {
+            break;
+        }
+    }
+    if (count == 0)
+    {
+        return;
+    }
+
+    const size_t size = JIT_BLOCK_OVERHEAD + count * (JIT_INSTRUCTION_SIZE + JIT_CHECK_SIZE);
+    if (!jit_reserve(size) || mprotect(jit_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        return;
+    }
+
+    uint8_t *const code = jit_code + jit_code_used;
+    uint8_t *p = emit_prologue(code);
+    for (Address16 c = start; c <= last; c += m->DECODED[c].words)
+    {
+        p = emit_call(p, c * sizeof(DecodedInstruction), (uintptr_t)EXECUTE_HANDLERS[m->DECODED[c].handler]);
+        if (c != last)
+        {
+            p = emit_check(p);
+        }
+    }
+    p = emit_epilogue(p);
+    jit_code_used += p - code;
+
+    __builtin___clear_cache((char *)code, (char *)p);
+    if (mprotect(jit_code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0)
+    {
+        jit_code_used = 0;
+        jit_generation++;
+        return;
+    }
+
+    b->code = code;
+    b->generation = jit_generation;
+    b->last = last;
+    b->end = a - 1;
+}
+
+bool jit_run_block(Machine *m)
+{
+    CheckEvents(m);
+    CheckInterrupts(m);
+    JitBlock *b = &m->BLOCKS[GetPC(m) % PROG_MEM_SIZE];
+    if (!m->SKIP)
+    {
+        if (!jit_block_valid(b) && ++b->hits >= JIT_HOT_THRESHOLD)
+        {
+            b->hits = 0;
+            jit_compile(m, GetPC(m) % PROG_MEM_SIZE);
+        }
+        if (jit_block_valid(b))
+        {
+            /* Only the last instruction of a block can leave PC unchanged, so
+               a block which stopped early hasn't halted. */
+            return jit_call_block(m, b) || !Halted(m, b->last);
+        }
+    }
+    return jit_interpret_block(m);
+}
+
+bool run_until_halt_jit(Machine *m)
+{
+#ifdef WATCHPOINTS
+    /* Breakpoints and watchpoints are only checked by machine_cycle. */
+    if (m->WATCHING)
+    {
+        return run_until_halt_loop(m);
+    }
+#endif
+    while (m->CYCLES < m->RUN_END)
+    {
+        if (!jit_run_block(m))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void jit_invalidate(Machine *m, Address16 a)
+{
+    /* A block can only contain this word if it starts at most a block's worth
+       of words before it. */
+    const Address16 first = a > JIT_MAX_BLOCK_INSTRUCTIONS * 2 ? a - JIT_MAX_BLOCK_INSTRUCTIONS * 2 : 0;
+    for (Address16 start = first; start <= a; start++)
+    {
+        JitBlock *b = &m->BLOCKS[start];
+        if (jit_block_valid(b) && b->end >= a)
+        {
+            b->code = NULL;
+            b->hits = 0;
+        }
+    }
+}
+
+void jit_reset(Machine *m)
+{
+    memset(m->BLOCKS, 0, sizeof(m->BLOCKS));
+}
+
+#else
+
+bool jit_run_block(Machine *m)
+{
+    return jit_interpret_block(m);
+}
+
+bool run_until_halt_jit(Machine *m)
+{
+    return run_until_halt_threaded(m);
+}
+
+void jit_invalidate(Machine *m, Address16 a)
+{
+    UNUSED(m);
+    UNUSED(a);
+}
+
+void jit_reset(Machine *m)
+{
+    UNUSED(m);
+}
+
+#endif
@@ -0,0 +1,448 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mcu.h"
+#include "loader.h"
+
+/* Files are mapped read only. ELF files are placed by their program headers
+   straight from the mapping, Intel HEX files are decoded once into a buffer
+   owned by the image and anything else is taken as a raw program memory
+   image, as written by avr-objcopy -O binary. Prepared images are used
+   straight from the mapping too, predecode cache and all. */
+
+#define ELF_HEADER_SIZE 52
+#define ELF_PROGRAM_HEADER_SIZE 32
+#define ELF_SECTION_HEADER_SIZE 40
+#define ELF_SYMBOL_SIZE 16
+#define ELF_PT_LOAD 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_STT_NOTYPE 0
+#define ELF_STT_FUNC 2
+#define ELF_SHN_UNDEF 0
+#define ELF_SHN_LORESERVE 0xff00
+
+static uint16_t read_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool in_file(const ProgramImage *image, uint32_t offset, uint32_t size)
+{
+    return offset <= image->map_size && size <= image->map_size - offset;
+}
+
+static bool add_segment(ProgramImage *image, ImageRegion region, uint32_t address, const uint8_t *bytes, size_t size)
+{
+    if (image->segment_count == IMAGE_MAX_SEGMENTS)
+    {
+        fputs("Too many segments in input file.\n", stderr);
+        return false;
+    }
+    image->segments[image->segment_count++] = (ImageSegment){region, address, bytes, size};
+    return true;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const ImageSymbol *x = a;
+    const ImageSymbol *y = b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+/* Keeps function and label symbols in program memory, sorted by address. A
+   missing or broken symbol table only loses the names. */
+static bool read_elf_symbols(ProgramImage *image)
+{
+    const uint8_t *elf = image->map;
+    const uint32_t section_offset = read_u32(elf + 32);
+    const uint16_t section_count = read_u16(elf + 48);
+    if (read_u16(elf + 46) != ELF_SECTION_HEADER_SIZE ||
+        !in_file(image, section_offset, (uint32_t)section_count * ELF_SECTION_HEADER_SIZE))
+    {
+        return true;
+    }
+
+    for (uint16_t i = 0; i < section_count; i++)
+    {
+        const uint8_t *section = elf + section_offset + i * ELF_SECTION_HEADER_SIZE;
+        const uint32_t link = read_u32(section + 24);
+        if (read_u32(section + 4) != ELF_SHT_SYMTAB || link >= section_count)
+        {
+            continue;
+        }
+        const uint8_t *strings = elf + section_offset + link * ELF_SECTION_HEADER_SIZE;
+        const uint32_t strings_offset = read_u32(strings + 16);
+        const uint32_t strings_size = read_u32(strings + 20);
+        const uint32_t symbols_offset = read_u32(section + 16);
+        const uint32_t symbols_count = read_u32(section + 20) / ELF_SYMBOL_SIZE;
+        if (!in_file(image, strings_offset, strings_size) ||
+            !in_file(image, symbols_offset, symbols_count * ELF_SYMBOL_SIZE) || strings_size == 0 ||
+            elf[strings_offset + strings_size - 1] != '\0' || symbols_count == 0)
+        {
+            continue;
+        }
+
+        ImageSymbol *symbols = realloc(image->symbols, (image->symbol_count + symbols_count) * sizeof(ImageSymbol));
+        if (symbols == NULL)
+        {
+            return false;
+        }
+        image->symbols = symbols;
+        for (uint32_t s = 0; s < symbols_count; s++)
+        {
+            const uint8_t *symbol = elf + symbols_offset + s * ELF_SYMBOL_SIZE;
+            const uint32_t name = read_u32(symbol);
+            const uint32_t address = read_u32(symbol + 4);
+            const uint8_t type = symbol[12] & 0xf;
+            const uint16_t index = read_u16(symbol + 14);
+            if ((type == ELF_STT_FUNC || type == ELF_STT_NOTYPE) && index != ELF_SHN_UNDEF &&
+                index < ELF_SHN_LORESERVE && name != 0 && name < strings_size && address < IMAGE_DATA_OFFSET)
+            {
+                image->symbols[image->symbol_count++] =
+                    (ImageSymbol){address, read_u32(symbol + 8), (const char *)elf + strings_offset + name};
+            }
+        }
+    }
+    qsort(image->symbols, image->symbol_count, sizeof(ImageSymbol), compare_symbols);
+    return true;
+}
+
+static bool read_elf(ProgramImage *image)
+{
+    const uint8_t *elf = image->map;
+    if (image->map_size < ELF_HEADER_SIZE || elf[4] != 1 || elf[5] != 1)
+    {
+        fputs("Input file is not a 32 bit little endian ELF file.\n", stderr);
+        return false;
+    }
+    const uint32_t program_offset = read_u32(elf + 28);
+    const uint16_t program_count = read_u16(elf + 44);
+    if (read_u16(elf + 42) != ELF_PROGRAM_HEADER_SIZE ||
+        !in_file(image, program_offset, (uint32_t)program_count * ELF_PROGRAM_HEADER_SIZE))
+    {
+        fputs("Input file has invalid program headers.\n", stderr);
+        return false;
+    }
+
+    /* Segments are placed at their load address, so initial values of .data
+       land in program memory after .text exactly as avr-objcopy places them. */
+    for (uint16_t i = 0; i < program_count; i++)
+    {
+        const uint8_t *header = elf + program_offset + i * ELF_PROGRAM_HEADER_SIZE;
+        const uint32_t offset = read_u32(header + 4);
+        const uint32_t address = read_u32(header + 12);
+        const uint32_t size = read_u32(header + 16);
+        if (read_u32(header) != ELF_PT_LOAD || size == 0)
+        {
+            continue;
+        }
+        if (!in_file(image, offset, size))
+        {
+            fputs("Input file has a segment outside of the file.\n", stderr);
+            return false;
+        }
+        if (address < IMAGE_DATA_OFFSET)
+        {
+            if (!add_segment(image, IMAGE_FLASH, address, elf + offset, size))
+            {
+                return false;
+            }
+        }
+        else if (address >= IMAGE_EEPROM_OFFSET)
+        {
+            if (!add_segment(image, IMAGE_EEPROM, address - IMAGE_EEPROM_OFFSET, elf + offset, size))
+            {
+                return false;
+            }
+        }
+    }
+    return read_elf_symbols(image);
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool decode_hex_bytes(const char *text, size_t count, uint8_t bytes[])
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const int high = hex_digit(text[i * 2]);
+        const int low = hex_digit(text[i * 2 + 1]);
+        if (high < 0 || low < 0)
+        {
+            return false;
+        }
+        bytes[i] = (high << 4) | low;
+    }
+    return true;
+}
+
+/* Data records at IMAGE_EEPROM_OFFSET and above go to EEPROM, as written by
+   avr-objcopy -O ihex for the .eeprom section, every other address to program
+   memory. */
+static bool read_hex(ProgramImage *image)
+{
+    if (NULL == (image->decoded = calloc(1, FLASH_SIZE + EEPROM_SIZE)))
+    {
+        return false;
+    }
+    uint8_t *const eeprom = image->decoded + FLASH_SIZE;
+    size_t flash_size = 0;
+    size_t eeprom_size = 0;
+    uint32_t base = 0;
+
+    const char *text = image->map;
+    const char *const end = text + image->map_size;
+    while (text < end)
+    {
+        if (*text != ':')
+        {
+            text++;
+            continue;
+        }
+        uint8_t record[4 + 255 + 1];
+        if (end - text < 11 || !decode_hex_bytes(text + 1, 4, record) || end - text < 11 + record[0] * 2 ||
+            !decode_hex_bytes(text + 1, 5 + record[0], record))
+        {
+            fputs("Invalid record in input HEX file.\n", stderr);
+            return false;
+        }
+        text += 11 + record[0] * 2;
+
+        uint8_t checksum = 0;
+        for (size_t i = 0; i < 5u + record[0]; i++)
+        {
+            checksum += record[i];
+        }
+        if (checksum != 0)
+        {
+            fputs("Invalid checksum in input HEX file.\n", stderr);
+            return false;
+        }
+
+        const uint8_t *data = record + 4;
+        const uint8_t type = record[3];
+        if (type == 0x00)
+        {
+            for (size_t i = 0; i < record[0]; i++)
+            {
+                const uint32_t address = base + ((record[1] << 8) | record[2]) + i;
+                if (address < FLASH_SIZE)
+                {
+                    image->decoded[address] = data[i];
+                    flash_size = address + 1 > flash_size ? address + 1 : flash_size;
+                }
+                else if (address >= IMAGE_EEPROM_OFFSET && address - IMAGE_EEPROM_OFFSET < EEPROM_SIZE)
+                {
+                    eeprom[address - IMAGE_EEPROM_OFFSET] = data[i];
+                    eeprom_size = address - IMAGE_EEPROM_OFFSET + 1 > eeprom_size ? address - IMAGE_EEPROM_OFFSET + 1
+                                                                                  : eeprom_size;
+                }
+            }
+        }
+        else if (type == 0x01)
+        {
+            break;
+        }
+        else if (type == 0x02 && record[0] == 2)
+        {
+            base = ((data[0] << 8) | data[1]) << 4;
+        }
+        else if (type == 0x04 && record[0] == 2)
+        {
+            base = (uint32_t)((data[0] << 8) | data[1]) << 16;
+        }
+    }
+
+    return (flash_size == 0 || add_segment(image, IMAGE_FLASH, 0, image->decoded, flash_size)) &&
+           (eeprom_size == 0 || add_segment(image, IMAGE_EEPROM, 0, eeprom, eeprom_size));
+}
+
+/* A header, then program memory as little endian words, EEPROM, the predecode
+   cache and the symbols, each of which is an address, a size and the offset
+   of its name in the strings after them. Everything is little endian. */
+static bool read_prepared(ProgramImage *image)
+{
+    const uint8_t *prepared = image->map;
+    if (image->map_size < PREPARED_HEADER_SIZE || read_u32(prepared + 8) != PREPARED_VERSION)
+    {
+        fputs("Prepared image is from another version of the simulator.\n", stderr);
+        return false;
+    }
+    if (strncmp((const char *)prepared + 12, MCU, PREPARED_MCU_SIZE) != 0)
+    {
+        fputs("Prepared image is for another MCU.\n", stderr);
+        return false;
+    }
+    const uint32_t flash_size = read_u32(prepared + 24);
+    const uint32_t eeprom_size = read_u32(prepared + 28);
+    ImagePredecoded *predecoded = &image->predecoded;
+    predecoded->entry_size = read_u32(prepared + 32);
+    predecoded->count = read_u32(prepared + 36);
+    predecoded->handler_hash = read_u32(prepared + 40);
+    predecoded->flags = read_u32(prepared + 44);
+    const uint32_t symbol_count = read_u32(prepared + 48);
+    const uint32_t strings_size = read_u32(prepared + 52);
+
+    const uint64_t predecoded_size = (uint64_t)predecoded->entry_size * predecoded->count;
+    const uint64_t symbols_size = (uint64_t)symbol_count * PREPARED_SYMBOL_SIZE;
+    const uint32_t flash = PREPARED_HEADER_SIZE;
+    const uint32_t eeprom = flash + flash_size;
+    const uint32_t cache = eeprom + eeprom_size;
+    if (!in_file(image, flash, flash_size) || !in_file(image, eeprom, eeprom_size) || predecoded_size > UINT32_MAX ||
+        !in_file(image, cache, predecoded_size) || symbols_size > UINT32_MAX ||
+        !in_file(image, cache + predecoded_size, symbols_size) ||
+        !in_file(image, cache + predecoded_size + symbols_size, strings_size))
+    {
+        fputs("Prepared image is truncated.\n", stderr);
+        return false;
+    }
+    predecoded->entries = prepared + cache;
+
+    const uint8_t *symbols = prepared + cache + predecoded_size;
+    const char *strings = (const char *)symbols + symbols_size;
+    if (symbol_count > 0 && strings_size > 0 && strings[strings_size - 1] == '\0')
+    {
+        image->symbols = malloc(symbol_count * sizeof(ImageSymbol));
+        if (image->symbols == NULL)
+        {
+            return false;
+        }
+        for (uint32_t s = 0; s < symbol_count; s++)
+        {
+            const uint8_t *symbol = symbols + s * PREPARED_SYMBOL_SIZE;
+            const uint32_t name = read_u32(symbol + 8);
+            if (name < strings_size)
+            {
+                image->symbols[image->symbol_count++] =
+                    (ImageSymbol){read_u32(symbol), read_u32(symbol + 4), strings + name};
+            }
+        }
+    }
+
+    return (flash_size == 0 || add_segment(image, IMAGE_FLASH, 0, prepared + flash, flash_size)) &&
+           (eeprom_size == 0 || add_segment(image, IMAGE_EEPROM, 0, prepared + eeprom, eeprom_size));
+}
+
+ProgramImage *image_open(const char file_name[])
+{
+    const int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        fputs("Unable to open input file.\n", stderr);
+        return NULL;
+    }
+    struct stat status;
+    ProgramImage *image = calloc(1, sizeof(ProgramImage));
+    if (image == NULL || fstat(fd, &status) != 0)
+    {
+        free(image);
+        close(fd);
+        return NULL;
+    }
+
+    image->map_size = status.st_size;
+    if (image->map_size > 0)
+    {
+        image->map = mmap(NULL, image->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (image->map == MAP_FAILED)
+    {
+        fputs("Unable to map input file.\n", stderr);
+        free(image);
+        return NULL;
+    }
+
+    const uint8_t *bytes = image->map;
+    bool ok;
+    if (image->map_size >= 4 && memcmp(bytes, "\x7f" "ELF", 4) == 0)
+    {
+        ok = read_elf(image);
+    }
+    else if (image->map_size >= PREPARED_MAGIC_SIZE && memcmp(bytes, PREPARED_MAGIC, PREPARED_MAGIC_SIZE) == 0)
+    {
+        ok = read_prepared(image);
+    }
+    else if (image->map_size > 0 && bytes[0] == ':')
+    {
+        ok = read_hex(image);
+    }
+    else
+    {
+        ok = image->map_size == 0 || add_segment(image, IMAGE_FLASH, 0, bytes, image->map_size);
+    }
+
+    if (!ok)
+    {
+        image_close(image);
+        return NULL;
+    }
+    return image;
+}
+
+void image_close(ProgramImage *image)
+{
+    if (image->map != NULL)
+    {
+        munmap(image->map, image->map_size);
+    }
+    free(image->decoded);
+    free(image->symbols);
+    free(image);
+}
+
+/* Get the name of the symbol covering a program memory byte address, or NULL
+   if there isn't one. Symbols without a size only cover their own address. */
+const char *image_symbol(const ProgramImage *image, uint32_t address)
+{
+    /* Find the first symbol after address, then search back from it. */
+    size_t low = 0;
+    size_t high = image->symbol_count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        if (image->symbols[middle].address <= address)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    while (low > 0)
+    {
+        const ImageSymbol *symbol = &image->symbols[--low];
+        if (symbol->address == address || address - symbol->address < symbol->size)
+        {
+            return symbol->name;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef __ATSIM_LOADER
+#define __ATSIM_LOADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Byte addresses at which avr-gcc places each memory in an ELF file. */
+#define IMAGE_DATA_OFFSET 0x800000
+#define IMAGE_EEPROM_OFFSET 0x810000
+
+#define IMAGE_MAX_SEGMENTS 16
+
+/* Prepared images, written by atsim --prepare, see prepared.c. */
+#define PREPARED_MAGIC "ATPREP\0\0"
+#define PREPARED_MAGIC_SIZE 8
+#define PREPARED_VERSION 2
+#define PREPARED_MCU_SIZE 12
+#define PREPARED_HEADER_SIZE 56
+#define PREPARED_SYMBOL_SIZE 12
+#define PREPARED_FUSION 0x1
+
+typedef enum
+{
+    IMAGE_FLASH,
+    IMAGE_EEPROM
+} ImageRegion;
+
+/* Bytes to place at a byte address in program memory or EEPROM. */
+typedef struct
+{
+    ImageRegion region;
+    uint32_t address;
+    const uint8_t *bytes;
+    size_t size;
+} ImageSegment;
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+    const char *name;
+} ImageSymbol;
+
+/* The predecode cache saved in a prepared image, as the build which saved it
+   laid it out. Only a build which lays it out the same way may use it. */
+typedef struct
+{
+    const uint8_t *entries;
+    uint32_t count;
+    uint32_t entry_size;
+    uint32_t handler_hash;
+    uint32_t flags;
+} ImagePredecoded;
+
+/* A parsed program file. Segments and symbol names point into the mapped
+   file where possible, so an image must stay open while anything uses them.
+   Images are never changed once open and may be shared between threads. */
+typedef struct
+{
+    void *map;
+    size_t map_size;
+    uint8_t *decoded;
+    ImageSegment segments[IMAGE_MAX_SEGMENTS];
+    size_t segment_count;
+    ImageSymbol *symbols;
+    size_t symbol_count;
+    ImagePredecoded predecoded;
+} ProgramImage;
+
+ProgramImage *image_open(const char file_name[]);
+void image_close(ProgramImage *image);
+const char *image_symbol(const ProgramImage *image, uint32_t address);
+
+#endif
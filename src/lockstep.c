@@ -0,0 +1,189 @@
+#include <inttypes.h>
+#include <string.h>
+#include "machine.h"
+#include "instructions.h"
+
+/* Lockstep runs the reference decoder, decode_and_execute_instruction, on a
+   copy of the machine while the machine itself runs on the engine
+   run_until_halt uses, a block at a time: a compiled block with the JIT, as
+   many cycles as a block has instructions through the threaded core with
+   THREADED, or a block through the predecoded interpreter otherwise. After
+   every block the reference catches up to the same cycle and the architectural
+   state of both is compared, so a divergence is found within a block of where
+   it happened. */
+
+typedef struct
+{
+    Reg16 block;
+    bool reported;
+    FILE *report;
+} Divergence;
+
+static bool reference_step(Machine *m)
+{
+    const Reg16 last_pc = GetPC(m);
+    CheckEvents(m);
+    CheckInterrupts(m);
+    decode_and_execute_instruction(m, fetch_instruction(m));
+    return !Halted(m, last_pc);
+}
+
+/* Runs m for a block on the fast engine, returning false on halt. RUN_END is
+   left where the block's run ended. */
+static bool fast_step(Machine *m, uint64_t end)
+{
+#if defined(THREADED) && !defined(JIT)
+    m->RUN_END = end - m->CYCLES > JIT_MAX_BLOCK_INSTRUCTIONS ? m->CYCLES + JIT_MAX_BLOCK_INSTRUCTIONS : end;
+    return !run_until_halt_threaded(m);
+#else
+    m->RUN_END = end;
+    return jit_run_block(m);
+#endif
+}
+
+static void report_header(Divergence *d)
+{
+    if (!d->reported)
+    {
+        fprintf(d->report, "Lockstep divergence in block at PC=0x%04x:\n", d->block);
+        d->reported = true;
+    }
+}
+
+static void compare_value(Divergence *d, const char *name, uint64_t reference, uint64_t fast)
+{
+    if (reference != fast)
+    {
+        report_header(d);
+        fprintf(d->report, "  %-8s reference 0x%" PRIx64 " fast 0x%" PRIx64 "\n", name, reference, fast);
+    }
+}
+
+static void compare_bytes(Divergence *d, const char *name, const Mem8 reference[], const Mem8 fast[], size_t offset,
+                          size_t size)
+{
+    for (size_t i = offset; i < offset + size; i++)
+    {
+        if (reference[i] != fast[i])
+        {
+            char field[32];
+            snprintf(field, sizeof(field), "%s[%zu]", name, i);
+            compare_value(d, field, reference[i], fast[i]);
+        }
+    }
+}
+
+/* Compares SRAM or EEPROM. Only pages written by either machine since the last
+   comparison are compared with DIRTY_PAGES, the bits are cleared as they are
+   checked. */
+static void compare_memory(Divergence *d, const char *name, const Mem8 reference[], const Mem8 fast[], size_t size,
+                           uint64_t reference_dirty[], uint64_t fast_dirty[])
+{
+#ifdef DIRTY_PAGES
+    for (size_t page = 0; page * DIRTY_PAGE_SIZE < size; page++)
+    {
+        const uint64_t bit = UINT64_C(1) << (page % 64);
+        if ((reference_dirty[page / 64] | fast_dirty[page / 64]) & bit)
+        {
+            const size_t offset = page * DIRTY_PAGE_SIZE;
+            compare_bytes(d, name, reference, fast, offset,
+                          size - offset < DIRTY_PAGE_SIZE ? size - offset : DIRTY_PAGE_SIZE);
+        }
+    }
+    memset(reference_dirty, 0, DIRTY_WORDS(size) * sizeof(uint64_t));
+    memset(fast_dirty, 0, DIRTY_WORDS(size) * sizeof(uint64_t));
+#else
+    UNUSED(reference_dirty);
+    UNUSED(fast_dirty);
+    if (memcmp(reference, fast, size) != 0)
+    {
+        compare_bytes(d, name, reference, fast, 0, size);
+    }
+#endif
+}
+
+static bool compare_machines(Divergence *d, Machine *reference, Machine *fast)
+{
+    compare_value(d, "PC", GetPC(reference), GetPC(fast));
+    compare_value(d, "SP", GetSP(reference), GetSP(fast));
+    compare_value(d, "SREG", PackSREG(reference), PackSREG(fast));
+    compare_value(d, "SKIP", reference->SKIP, fast->SKIP);
+    compare_value(d, "CYCLES", reference->CYCLES, fast->CYCLES);
+    compare_bytes(d, "R", reference->R, fast->R, 0, GP_REGISTERS);
+    /* Timer counts in IO are only brought up to date when accessed, which
+       both machines do at the same instructions. */
+    compare_bytes(d, "IO", reference->IO, fast->IO, 0, IO_REGISTERS);
+#ifdef DIRTY_PAGES
+    compare_memory(d, "SRAM", reference->SRAM, fast->SRAM, SRAM_SIZE, reference->DIRTY_SRAM, fast->DIRTY_SRAM);
+    compare_memory(d, "EEPROM", reference->EEPROM, fast->EEPROM, EEPROM_SIZE, reference->DIRTY_EEPROM,
+                   fast->DIRTY_EEPROM);
+#else
+    compare_memory(d, "SRAM", reference->SRAM, fast->SRAM, SRAM_SIZE, NULL, NULL);
+    compare_memory(d, "EEPROM", reference->EEPROM, fast->EEPROM, EEPROM_SIZE, NULL, NULL);
+#endif
+    return !d->reported;
+}
+
+/* Runs m on the fast engine until it halts, which sets halted, or has run for
+   at least max_cycles, checked against the reference decoder. Returns false at
+   the first divergence, which is written to report, and leaves m where it
+   diverged. */
+bool run_lockstep(Machine *m, uint64_t max_cycles, FILE *report, bool *halted)
+{
+    *halted = false;
+    Machine *reference = malloc(MACHINE_SIZE);
+    if (reference == NULL)
+    {
+        fputs("Unable to allocate the lockstep reference machine.\n", report);
+        return false;
+    }
+    machine_copy(reference, m);
+#ifdef TRACE
+    /* Only the fast engine is traced. */
+    reference->TRACER = NULL;
+#endif
+#ifdef GPIO
+    /* Only the fast engine reports pin changes, so pins the host drives from
+       its callback aren't seen by the reference. */
+    reference->PINS.CALLBACK = NULL;
+#endif
+#ifdef DIRTY_PAGES
+    /* The dirty bits are taken over, so the next restore copies everything. */
+    m->SNAPSHOT = NULL;
+    memset(m->DIRTY_SRAM, 0, sizeof(m->DIRTY_SRAM));
+    memset(m->DIRTY_EEPROM, 0, sizeof(m->DIRTY_EEPROM));
+    memset(reference->DIRTY_SRAM, 0, sizeof(reference->DIRTY_SRAM));
+    memset(reference->DIRTY_EEPROM, 0, sizeof(reference->DIRTY_EEPROM));
+#endif
+
+    const uint64_t end = max_cycles < UINT64_MAX - m->CYCLES ? m->CYCLES + max_cycles : UINT64_MAX;
+    Divergence d = {.block = 0, .reported = false, .report = report};
+    bool running = true;
+    while (running && m->CYCLES < end)
+    {
+        d.block = GetPC(m);
+        running = fast_step(m, end);
+        /* Idle loops and sleep are skipped no further than RUN_END, so the
+           reference has the same one. */
+        reference->RUN_END = m->RUN_END;
+        bool reference_running = true;
+        while (reference_running && reference->CYCLES < m->CYCLES)
+        {
+            reference_running = reference_step(reference);
+        }
+        /* Undecodable opcodes halt without taking a cycle. */
+        if (!running && reference_running && reference->CYCLES == m->CYCLES)
+        {
+            reference_running = reference_step(reference);
+        }
+        compare_value(&d, "halted", !reference_running, !running);
+        if (!compare_machines(&d, reference, m))
+        {
+            break;
+        }
+    }
+    free(reference);
+    m->RUN_END = UINT64_MAX;
+    *halted = !running;
+    return !d.reported;
+}
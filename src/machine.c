@@ -1,3 +1,5 @@
+#include <inttypes.h>
+#include <string.h>
 #include "machine.h"
 #include "instructions.h"
 
@@ -8,18 +10,222 @@ Mem16 fetch_instruction(Machine *m)
 
 void machine_cycle(Machine *m)
 {
+#ifdef WATCHPOINTS
+    if (m->WATCHING && WatchStop(m))
+    {
+        return;
+    }
+#endif
+    CheckEvents(m);
+    CheckInterrupts(m);
+#ifdef PREDECODE
+    execute_predecoded_instruction(m);
+#else
     const Mem16 opcode = fetch_instruction(m);
     decode_and_execute_instruction(m, opcode);
+#endif
 }
 
-void run_until_halt_loop(Machine *m)
+/* Each engine runs until the machine halts, returning true, or until CYCLES
+   reaches RUN_END, returning false. RUN_END is UINT64_MAX outside runs for
+   a number of cycles. */
+bool run_until_halt_loop(Machine *m)
 {
-    Reg16 last_pc = 0xffff;
-    while (last_pc != m->PC)
+    while (m->CYCLES < m->RUN_END)
     {
-        last_pc = m->PC;
+        const Reg16 last_pc = m->PC;
         machine_cycle(m);
+        if (Halted(m, last_pc))
+        {
+            return true;
+        }
     }
+    return false;
+}
+
+bool run_until_halt_threaded(Machine *m)
+{
+#ifdef WATCHPOINTS
+    /* Breakpoints and watchpoints are only checked by machine_cycle. */
+    if (m->WATCHING)
+    {
+        return run_until_halt_loop(m);
+    }
+#endif
+#ifdef THREADED
+    return run_threaded_until_halt(m);
+#else
+    return run_until_halt_loop(m);
+#endif
+}
+
+bool run_until_halt(Machine *m)
+{
+#if defined(JIT)
+    return run_until_halt_jit(m);
+#else
+    return run_until_halt_threaded(m);
+#endif
+}
+
+static void run_begin(Machine *m, uint64_t n)
+{
+    m->RUN_END = n < UINT64_MAX - m->CYCLES ? m->CYCLES + n : UINT64_MAX;
+#ifdef FUSION
+    m->FUSION_LIMIT = m->RUN_END;
+#endif
+}
+
+static void run_end(Machine *m)
+{
+#ifdef FUSION
+    m->FUSION_LIMIT = UINT64_MAX;
+#endif
+    m->RUN_END = UINT64_MAX;
+}
+
+/* Run for at least n cycles, returns true if the machine halted first. The
+   last instruction may take the count up to a few cycles over n. */
+bool run_for_cycles(Machine *m, uint64_t n)
+{
+    run_begin(m, n);
+    const bool halted = run_until_halt_loop(m);
+    run_end(m);
+    return halted;
+}
+
+/* As run_for_cycles, through the engine run_until_halt uses. The JIT shares
+   its code between machines, so only one machine may run this way at a time. */
+bool run_for_cycles_fastest(Machine *m, uint64_t n)
+{
+    run_begin(m, n);
+    const bool halted = run_until_halt(m);
+    run_end(m);
+    return halted;
+}
+
+/* The copy keeps EEPROM to itself, even if from's is mapped from a file, and
+   its own predecode cache, so to must have been allocated MACHINE_SIZE. */
+void machine_copy(Machine *to, const Machine *from)
+{
+    memcpy(to, from, sizeof(Machine));
+    to->EEPROM = to->EEPROM_DATA;
+    memcpy(to->EEPROM_DATA, from->EEPROM, sizeof(to->EEPROM_DATA));
+#ifdef PREDECODE
+    to->DECODED = to->DECODED_DATA;
+    memcpy(to->DECODED_DATA, from->DECODED, PROG_MEM_SIZE * sizeof(DecodedInstruction));
+#endif
+}
+
+/* Gives m a copy of the shared predecode cache it uses, before anything changes
+   it. Only machines allocated MACHINE_SIZE have room for one, which batch
+   workers, never changing program memory, aren't. */
+void machine_unshare(Machine *m)
+{
+#ifdef PREDECODE
+    memcpy(m->DECODED_DATA, m->DECODED, PROG_MEM_SIZE * sizeof(DecodedInstruction));
+    m->DECODED = m->DECODED_DATA;
+#else
+    UNUSED(m);
+#endif
+}
+
+void save_machine_state(Machine *m, MachineState *s)
+{
+    s->PC = m->PC;
+    s->SREG = PackSREG(m);
+    s->SKIP = m->SKIP;
+    s->CYCLES = m->CYCLES;
+    memcpy(s->R, m->R, sizeof(s->R));
+    memcpy(s->IO, m->IO, sizeof(s->IO));
+    memcpy(s->SRAM, m->SRAM, sizeof(s->SRAM));
+    memcpy(s->EEPROM, m->EEPROM, sizeof(s->EEPROM));
+#ifdef TIMERS
+    s->PERIPHERALS = m->PERIPHERALS;
+#endif
+#ifdef INTERRUPTS
+    s->REQUESTED = m->REQUESTED;
+    s->INHIBITED_AT = m->INHIBITED_AT;
+#endif
+}
+
+static void restore_registers(Machine *m, const MachineState *s)
+{
+    m->PC = s->PC;
+    m->SKIP = s->SKIP;
+    m->CYCLES = s->CYCLES;
+    memcpy(m->R, s->R, sizeof(s->R));
+    memcpy(m->IO, s->IO, sizeof(s->IO));
+#ifdef INTERRUPTS
+    m->REQUESTED = s->REQUESTED;
+    m->INHIBITED_AT = s->INHIBITED_AT;
+#endif
+    UnpackSREG(m, s->SREG);
+#ifdef TIMERS
+    m->PERIPHERALS = s->PERIPHERALS;
+#endif
+}
+
+void restore_machine_state(Machine *m, const MachineState *s)
+{
+    restore_registers(m, s);
+    memcpy(m->SRAM, s->SRAM, sizeof(s->SRAM));
+    memcpy(m->EEPROM, s->EEPROM, sizeof(s->EEPROM));
+#ifdef DIRTY_PAGES
+    /* s may be changed after this, so the next machine_restore copies it all. */
+    m->SNAPSHOT = NULL;
+#endif
+}
+
+#ifdef DIRTY_PAGES
+static void restore_dirty_pages(Mem8 to[], const Mem8 from[], uint64_t dirty[], size_t size)
+{
+    for (size_t page = 0; page * DIRTY_PAGE_SIZE < size; page++)
+    {
+        if ((dirty[page / 64] >> (page % 64)) & 0x1)
+        {
+            const size_t offset = page * DIRTY_PAGE_SIZE;
+            memcpy(to + offset, from + offset, size - offset < DIRTY_PAGE_SIZE ? size - offset : DIRTY_PAGE_SIZE);
+        }
+    }
+    memset(dirty, 0, DIRTY_WORDS(size) * sizeof(uint64_t));
+}
+
+static void track_snapshot(Machine *m, const MachineState *s)
+{
+    m->SNAPSHOT = s;
+    memset(m->DIRTY_SRAM, 0, sizeof(m->DIRTY_SRAM));
+    memset(m->DIRTY_EEPROM, 0, sizeof(m->DIRTY_EEPROM));
+}
+#endif
+
+/* Snapshots are MachineStates which must not be changed while in use. With
+   DIRTY_PAGES, restoring the snapshot a machine was last snapshotted to or
+   restored from only copies the SRAM and EEPROM pages written since. Program
+   memory is shared by every snapshot and never copied. */
+void machine_snapshot(Machine *m, MachineState *s)
+{
+    save_machine_state(m, s);
+#ifdef DIRTY_PAGES
+    track_snapshot(m, s);
+#endif
+}
+
+void machine_restore(Machine *m, const MachineState *s)
+{
+#ifdef DIRTY_PAGES
+    if (m->SNAPSHOT == s)
+    {
+        restore_registers(m, s);
+        restore_dirty_pages(m->SRAM, s->SRAM, m->DIRTY_SRAM, SRAM_SIZE);
+        restore_dirty_pages(m->EEPROM, s->EEPROM, m->DIRTY_EEPROM, EEPROM_SIZE);
+        return;
+    }
+#endif
+    restore_machine_state(m, s);
+#ifdef DIRTY_PAGES
+    track_snapshot(m, s);
+#endif
 }
 
 void dump_registers(Machine *m)
@@ -27,6 +233,8 @@ void dump_registers(Machine *m)
     puts("- PC & SP -");
     printf("  PC = 0x%04x\n", GetPC(m));
     printf("  SP = 0x%04x\n", GetSP(m));
+    puts("- Cycles -");
+    printf("  CYCLES = %" PRIu64 "\n", m->CYCLES);
     puts("- GP Registers -");
     for (uint8_t i = 0; i < GP_REGISTERS; i++)
     {
@@ -43,35 +251,140 @@ void dump_stack(Machine *m)
     puts("  TOS");
     for (uint16_t i = GetSP(m) + 1; i < DATA_MEM_SIZE; i++)
     {
-        printf("  STACK[%03u] = %02x\n", DATA_MEM_SIZE - i - 1, GetDataMem(m, i));
+        printf("  STACK[%03u] = %02x\n", DATA_MEM_SIZE - i - 1, PeekDataMem(m, i));
     }
     puts("  BOS");
 }
 
-void load_memory(Machine *m, uint8_t bytes[], size_t max)
+static void reset_program(Machine *m)
 {
-    for (size_t word_index = 0; word_index < max / 2; word_index++)
+#ifdef PREDECODE
+    m->DECODED = m->DECODED_DATA;
+    for (size_t word_index = 0; word_index < PROG_MEM_SIZE; word_index++)
     {
-        SetProgMem(m, word_index, Get16(bytes[word_index * 2 + 1], bytes[word_index * 2]));
+        m->DECODED[word_index].handler = HANDLER_PREDECODE;
     }
+#endif
+    jit_reset(m);
+#ifdef FAST_FORWARD
+    memset(m->LOOPS, LOOP_UNKNOWN, sizeof(m->LOOPS));
+#endif
+#ifdef PROFILE
+    profile_reset(m);
+#endif
+#ifdef TRACE
+    m->TRACER = NULL;
+#endif
+#ifdef DIRTY_PAGES
+    m->SNAPSHOT = NULL;
+#endif
+    m->IMAGE = NULL;
+    m->DEBUGGER = NULL;
+    /* Loading ends any mapping, so that a program never loads over the file.
+       A machine is zeroed before its first load, so has nothing to unmap. */
+    if (m->EEPROM != NULL)
+    {
+        eeprom_unmap(m);
+    }
+    m->EEPROM = m->EEPROM_DATA;
+    /* Nothing of the last program, its code, data or CPU state, survives. */
+    memset(m->FLASH, 0, sizeof(m->FLASH));
+    memset(m->EEPROM_DATA, 0, sizeof(m->EEPROM_DATA));
+    memset(m->R, 0, sizeof(m->R));
+    memset(m->IO, 0, sizeof(m->IO));
+    memset(m->SRAM, 0, sizeof(m->SRAM));
+    UnpackSREG(m, 0);
+    m->PC = 0;
+    m->SKIP = false;
+    m->CYCLES = 0;
+#ifdef WATCHPOINTS
+    watch_reset(m);
+#endif
+#ifdef INTERRUPTS
+    m->REQUESTED = 0;
+    m->INHIBITED_AT = UINT64_MAX;
+    UpdateInterrupts(m);
+#endif
+#ifdef TIMERS
+    timers_reset(m);
+    eeprom_reset(m);
+#endif
+#ifdef GPIO
+    gpio_reset(m);
+#endif
+#ifdef FUSION
+    m->FUSION_LIMIT = UINT64_MAX;
+#endif
+    m->RUN_END = UINT64_MAX;
 }
 
-bool load_memory_from_file(Machine *m, const char file_name[])
+/* Program memory words are little endian, as is the host almost always, in
+   which case bytes can be copied straight in. */
+static void copy_to_flash(Machine *m, uint32_t address, const uint8_t bytes[], size_t size)
 {
-    FILE *fp;
-    if (NULL == (fp = fopen(file_name, "rb")))
+    if (address >= PROG_MEM_SIZE_BYTES)
     {
-        fputs("Unable to open input file.\n", stderr);
-        return false;
+        return;
     }
+    size = size < PROG_MEM_SIZE_BYTES - address ? size : PROG_MEM_SIZE_BYTES - address;
 
-    uint8_t bytes[PROG_MEM_SIZE_BYTES];
-    size_t read_bytes = fread(bytes, 1, PROG_MEM_SIZE_BYTES, fp);
+    const Mem16 probe = 1;
+    if (*(const uint8_t *)&probe == 1)
+    {
+        memcpy((uint8_t *)m->FLASH + address, bytes, size);
+        return;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        Mem16 *word = &m->FLASH[(address + i) / 2];
+        *word = (address + i) % 2 ? Get16(bytes[i], *word & 0xff) : Get16(*word >> 8, bytes[i]);
+    }
+}
 
-    fclose(fp);
+void load_memory(Machine *m, uint8_t bytes[], size_t max)
+{
+    reset_program(m);
+    copy_to_flash(m, 0, bytes, max - max % 2);
+}
 
-    load_memory(m, bytes, read_bytes);
+/* The image is kept in IMAGE for symbol names, and a prepared image's
+   predecode cache is used where it is mapped, so should stay open while the
+   machine is in use. Sharing one image between machines avoids reparsing. */
+void load_image(Machine *m, const ProgramImage *image)
+{
+    reset_program(m);
+    for (size_t i = 0; i < image->segment_count; i++)
+    {
+        const ImageSegment *segment = &image->segments[i];
+        if (segment->region == IMAGE_FLASH)
+        {
+            copy_to_flash(m, segment->address, segment->bytes, segment->size);
+        }
+        else if (segment->address < EEPROM_SIZE)
+        {
+            const size_t size = EEPROM_SIZE - segment->address;
+            memcpy(m->EEPROM + segment->address, segment->bytes, segment->size < size ? segment->size : size);
+        }
+    }
+    if (image->predecoded.entries != NULL)
+    {
+        prepared_restore(m, &image->predecoded);
+    }
+    m->IMAGE = image;
+}
 
+/* Loads an ELF, Intel HEX or raw binary file, see loader.c. */
+bool load_memory_from_file(Machine *m, const char file_name[])
+{
+    ProgramImage *image = image_open(file_name);
+    if (image == NULL)
+    {
+        return false;
+    }
+    load_image(m, image);
+    machine_unshare(m);
+    image_close(image);
+    m->IMAGE = NULL;
     return true;
 }
 
@@ -162,6 +475,13 @@ void interactive_view(Machine *m)
 
 void interactive_break(Machine *m)
 {
+    /* With a debugger attached BREAK stops to it, as on the chip, instead of
+       prompting. */
+    if (m->DEBUGGER != NULL)
+    {
+        gdb_break(m);
+        return;
+    }
     const char VALID_OPERATIONS[4] = {'c', 'd', 'v', 'e'};
     bool continue_debug = true;
 
@@ -7,6 +7,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "mcu.h"
+#include "loader.h"
+#ifdef TRACE
+#include "trace.h"
+#endif
 
 #define UNUSED(x) (void)(x)
 #define PRECONDITION(x) UNUSED(x)
@@ -35,6 +39,76 @@ typedef uint32_t Reg32;
 
 #define SP_L IO[0x3D]
 #define SP_H IO[0x3E]
+#define SREG_IO_ADDRESS 0x3F
+#define SREG_BYTE IO[SREG_IO_ADDRESS]
+#define MCUCR_IO_ADDRESS 0x35
+#define MCUCR_SE 5
+
+/* EEPROM controller registers of the ATtiny25/45/85, as IO addresses. */
+#define EECR_IO_ADDRESS 0x1C
+#define EEDR_IO_ADDRESS 0x1D
+#define EEARL_IO_ADDRESS 0x1E
+#define EEARH_IO_ADDRESS 0x1F
+
+/* Timer/counter registers of the ATtiny25/45/85, as IO addresses. */
+#define OCR0B_IO_ADDRESS 0x28
+#define OCR0A_IO_ADDRESS 0x29
+#define TCCR0A_IO_ADDRESS 0x2A
+#define OCR1B_IO_ADDRESS 0x2B
+#define GTCCR_IO_ADDRESS 0x2C
+#define OCR1C_IO_ADDRESS 0x2D
+#define OCR1A_IO_ADDRESS 0x2E
+#define TCNT1_IO_ADDRESS 0x2F
+#define TCCR1_IO_ADDRESS 0x30
+#define TCNT0_IO_ADDRESS 0x32
+#define TCCR0B_IO_ADDRESS 0x33
+#define TIFR_IO_ADDRESS 0x38
+#define TIMSK_IO_ADDRESS 0x39
+
+/* Port B and pin change interrupt registers of the ATtiny25/45/85, as IO
+   addresses. */
+#define PCMSK_IO_ADDRESS 0x15
+#define PINB_IO_ADDRESS 0x16
+#define DDRB_IO_ADDRESS 0x17
+#define PORTB_IO_ADDRESS 0x18
+#define GIFR_IO_ADDRESS 0x3A
+#define GIMSK_IO_ADDRESS 0x3B
+
+#define IO_BIT(a) (UINT64_C(1) << (a))
+#define TIMER_IO_HOOKS                                                                                     \
+    (IO_BIT(OCR0B_IO_ADDRESS) | IO_BIT(OCR0A_IO_ADDRESS) | IO_BIT(TCCR0A_IO_ADDRESS) |                     \
+     IO_BIT(OCR1B_IO_ADDRESS) | IO_BIT(GTCCR_IO_ADDRESS) | IO_BIT(OCR1C_IO_ADDRESS) |                      \
+     IO_BIT(OCR1A_IO_ADDRESS) | IO_BIT(TCNT1_IO_ADDRESS) | IO_BIT(TCCR1_IO_ADDRESS) |                      \
+     IO_BIT(TCNT0_IO_ADDRESS) | IO_BIT(TCCR0B_IO_ADDRESS) | IO_BIT(TIFR_IO_ADDRESS) | IO_BIT(TIMSK_IO_ADDRESS))
+#define GPIO_IO_HOOKS                                                                                      \
+    (IO_BIT(PINB_IO_ADDRESS) | IO_BIT(DDRB_IO_ADDRESS) | IO_BIT(PORTB_IO_ADDRESS) |                        \
+     IO_BIT(GIFR_IO_ADDRESS) | IO_BIT(GIMSK_IO_ADDRESS))
+
+/* IO registers whose data space accesses have side effects, one bit per IO
+   address. Only used with FLAT_DATA, every other address is a plain load. */
+#if defined(TIMERS) && defined(GPIO)
+#define IO_HOOKS (IO_BIT(SREG_IO_ADDRESS) | IO_BIT(EECR_IO_ADDRESS) | TIMER_IO_HOOKS | GPIO_IO_HOOKS)
+#elif defined(TIMERS)
+#define IO_HOOKS (IO_BIT(SREG_IO_ADDRESS) | IO_BIT(EECR_IO_ADDRESS) | TIMER_IO_HOOKS)
+#else
+#define IO_HOOKS IO_BIT(SREG_IO_ADDRESS)
+#endif
+
+/* IO registers where writing a one acts, clearing a flag or toggling a pin,
+   rather than being stored. SBI and CBI only write their own bit to these. */
+#if defined(TIMERS) && defined(GPIO)
+#define STROBE_IO_HOOKS (IO_BIT(TIFR_IO_ADDRESS) | IO_BIT(PINB_IO_ADDRESS) | IO_BIT(GIFR_IO_ADDRESS))
+#elif defined(TIMERS)
+#define STROBE_IO_HOOKS IO_BIT(TIFR_IO_ADDRESS)
+#else
+#define STROBE_IO_HOOKS 0
+#endif
+
+/* With DIRTY_PAGES, writes to SRAM and EEPROM mark pages of this many bytes as
+   dirty so a snapshot can be restored by copying only what changed. */
+#define DIRTY_PAGE_SIZE 32
+#define DIRTY_WORDS(size) (((size) + DIRTY_PAGE_SIZE * 64 - 1) / (DIRTY_PAGE_SIZE * 64))
+#define WATCH_WORDS(size) (((size) + 63) / 64)
 
 #define SP_MIN (GP_REGISTERS + IO_REGISTERS)
 #if DATA_MEM_SIZE < ((1 << 8) + 1)
@@ -79,18 +153,405 @@ typedef enum
     SREG_I = 7,
 } StatusRegister;
 
+/* Handler indices of a predecode cache entry which has not been decoded yet and
+   of an opcode which can't be decoded. The remaining handler indices are
+   generated, see instructions.py. */
+#define HANDLER_PREDECODE 0
+#define HANDLER_UNDECODABLE 1
+
+#if defined(PREDECODE) && defined(DECODE_LINEAR)
+#error "PREDECODE relies on the dispatch table so can't be used with DECODE_LINEAR"
+#endif
+
+/* Computed goto is a GCC/Clang extension, fall back to the portable loop
+   without it. */
+#if defined(THREADED) && !defined(__GNUC__)
+#undef THREADED
+#endif
+
+#if defined(THREADED) && !defined(PREDECODE)
+#error "THREADED dispatches on predecoded instructions so requires PREDECODE"
+#endif
+
+/* Superinstructions are recognised by the predecoder, so do nothing without it. */
+#if defined(FUSION) && !defined(PREDECODE)
+#undef FUSION
+#endif
+
+/* The JIT emits native code for x86-64 and AArch64 Linux hosts only, fall back
+   to the interpreter elsewhere. */
+#if defined(JIT) && !(defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)))
+#undef JIT
+#endif
+
+#if defined(JIT) && !defined(PREDECODE)
+#error "JIT compiles predecoded instructions so requires PREDECODE"
+#endif
+
+#if defined(LANES) && !defined(PREDECODE)
+#error "LANES shares predecoded instructions between lanes so requires PREDECODE"
+#endif
+
+#ifndef BATCH_LANES
+#define BATCH_LANES 16
+#endif
+
+#if defined(GPIO) && !defined(TIMERS)
+#error "GPIO applies the host's pin inputs as events so requires TIMERS"
+#endif
+
+#ifndef GPIO_BATCH_SIZE
+#define GPIO_BATCH_SIZE 256
+#endif
+#define GPIO_INPUT_QUEUE_SIZE 16
+
+#ifndef JIT_HOT_THRESHOLD
+#define JIT_HOT_THRESHOLD 64
+#endif
+#define JIT_MAX_BLOCK_INSTRUCTIONS 32
+
+#ifndef PROFILE_MAX_NODES
+#define PROFILE_MAX_NODES 1024
+#endif
+
+/* An instruction with its operands already extracted from the opcode. */
+typedef struct
+{
+    uint8_t handler;
+    uint8_t words;
+    uint8_t A;
+    uint8_t K;
+    uint8_t b;
+    uint8_t d;
+    uint8_t q;
+    uint8_t r;
+    uint8_t s;
+    bool ends_block;
+    uint32_t k;
+} DecodedInstruction;
+
+/* A basic block starting at a FLASH word, compiled to native code once it has
+   been entered JIT_HOT_THRESHOLD times. */
+typedef struct
+{
+    uint8_t *code;
+    uint32_t generation;
+    uint32_t hits;
+    Address16 last;
+    Address16 end;
+} JitBlock;
+
+/* Kinds of loop recognised by FAST_FORWARD at the word they start. */
+typedef enum
+{
+    LOOP_UNKNOWN,
+    LOOP_NONE,
+    LOOP_POLL,
+    LOOP_DELAY,
+    LOOP_WAIT
+} IdleLoop;
+
+#define IDLE_LOOP_MAX_WORDS 4
+
+typedef enum
+{
+    WATCH_NONE,
+    WATCH_BREAKPOINT,
+    WATCH_READ,
+    WATCH_WRITE
+} WatchKind;
+
+/* What a run last stopped at with WATCHPOINTS, address is a program memory
+   word for a breakpoint and a data space address otherwise. A watchpoint stops
+   before the instruction after the access, so is pending until then. */
+typedef struct
+{
+    uint8_t kind;
+    bool pending;
+    Address16 address;
+} WatchHit;
+
+/* Inputs of the last flag-producing instruction, used to evaluate its flags only
+   once they're needed. A mask of 0 means there are no deferred flags. */
+typedef struct
+{
+    uint8_t handler;
+    uint8_t mask;
+    Reg16 Rd;
+    Reg16 Rr;
+    Reg16 R;
+} LazyFlags;
+
+/* A node of the profiler's call tree, one per distinct call stack. Node 0 is
+   the root, which is its own parent. */
 typedef struct
 {
+    Address16 function;
+    uint16_t parent;
+    uint64_t cycles;
+} ProfileNode;
+
+/* Execution counters kept with PROFILE, see profile.c. */
+typedef struct
+{
+    uint64_t HANDLERS[256];
+    uint64_t HITS[PROG_MEM_SIZE];
+    uint64_t TAKEN[PROG_MEM_SIZE];
+    uint64_t NOT_TAKEN[PROG_MEM_SIZE];
+    ProfileNode NODES[PROFILE_MAX_NODES];
+    uint16_t CHILDREN[PROFILE_MAX_NODES * 2];
+    uint16_t NODE_COUNT;
+    uint16_t OVERFLOW;
+    uint16_t NODE;
+    uint16_t LAST_NODE;
+    Reg16 LAST_PC;
+    uint64_t LAST_CYCLES;
+} Profile;
+
+/* Sources of scheduled events, each has at most one event pending. */
+typedef enum
+{
+    EVENT_TIMER0,
+    EVENT_TIMER1,
+    EVENT_EEPROM,
+    EVENT_GPIO_FLUSH,
+    EVENT_GPIO_INPUT,
+    EVENT_SOURCES
+} EventSource;
+
+typedef struct
+{
+    uint64_t cycle;
+    uint8_t source;
+} Event;
+
+/* Pending events as a binary min-heap ordered by cycle. NEXT is the cycle of
+   the first event, or UINT64_MAX when there are none, so checking for due
+   events is a single comparison. */
+typedef struct
+{
+    Event HEAP[EVENT_SOURCES];
+    uint8_t POSITION[EVENT_SOURCES];
+    uint8_t COUNT;
+    uint64_t NEXT;
+} EventQueue;
+
+/* A timer/counter between updates, its count is kept in TCNTn. Timers only
+   catch up when their registers are accessed or their next event is due. */
+typedef struct
+{
+    uint64_t LAST_UPDATE;
+    bool DOWN;
+} Timer;
+
+/* Interrupt vectors of the ATtiny25/45/85. Each vector is one word of program
+   memory and a lower vector has priority over a higher one. */
+typedef enum
+{
+    VECTOR_RESET,
+    VECTOR_INT0,
+    VECTOR_PCINT0,
+    VECTOR_TIMER1_COMPA,
+    VECTOR_TIMER1_OVF,
+    VECTOR_TIMER0_OVF,
+    VECTOR_EE_RDY,
+    VECTOR_ANA_COMP,
+    VECTOR_ADC,
+    VECTOR_TIMER1_COMPB,
+    VECTOR_TIMER0_COMPA,
+    VECTOR_TIMER0_COMPB,
+    VECTOR_WDT,
+    VECTOR_USI_START,
+    VECTOR_USI_OVF,
+    INTERRUPT_VECTORS
+} InterruptVector;
+
+#define INTERRUPT_CYCLES 4
+
+/* The EEPROM controller between accesses. EEMPE is cleared at MASTER_END and
+   programming, with the address, data and mode latched as it started, finishes
+   at WRITE_END. Either is UINT64_MAX when not due. */
+typedef struct
+{
+    uint64_t MASTER_END;
+    uint64_t WRITE_END;
+    Address16 ADDRESS;
+    Mem8 DATA;
+    uint8_t MODE;
+} EepromController;
+
+/* State of the peripheral models, kept with TIMERS. */
+typedef struct
+{
+    EventQueue EVENTS;
+    Timer TIMER[2];
+    EepromController EEPROM;
+} Peripherals;
+
+/* The port B pins of the ATtiny25/45/85, bits 6 and 7 of its registers are
+   unused. */
+#define GPIO_PINS 0x3f
+
+/* A change the program made to how it drives port B, as DDRB and PORTB just
+   after it. A pin whose DDRB bit is set is driven to its PORTB bit, otherwise
+   a set PORTB bit enables its pull-up. */
+typedef struct
+{
+    uint64_t cycle;
+    Mem8 ddr;
+    Mem8 port;
+} PinChange;
+
+/* The pins the host drives, and their levels, from cycle on. */
+typedef struct
+{
+    uint64_t cycle;
+    uint8_t driven;
+    uint8_t levels;
+} PinInput;
+
+typedef void (*PinCallback)(void *context, const PinChange changes[], size_t n);
+
+/* Port B between the program and the host. Changes are only recorded while
+   there is a CALLBACK, which is passed them in batches once the first of a
+   batch has waited INTERVAL cycles or the batch is full, rather than as each
+   happens. The host's inputs wait in cycle order until their event. */
+typedef struct
+{
+    PinCallback CALLBACK;
+    void *CONTEXT;
+    uint64_t INTERVAL;
+    PinChange CHANGES[GPIO_BATCH_SIZE];
+    uint16_t CHANGE_COUNT;
+    PinInput INPUTS[GPIO_INPUT_QUEUE_SIZE];
+    uint8_t INPUT_COUNT;
+    uint8_t DRIVEN;
+    uint8_t LEVELS;
+} GpioPins;
+
+/* With PACKED_SREG the status register is kept as a single byte in the IO file
+   (SREG_BYTE), otherwise each flag is a separate bool. */
+typedef struct
+{
+#ifndef PACKED_SREG
     bool SREG[8];
+#endif
     Reg16 PC;
+#ifdef FLAT_DATA
+    /* Registers, IO and SRAM are views into the one data space array. */
+    __extension__ union
+    {
+        Mem8 DATA[DATA_MEM_SIZE];
+        __extension__ struct
+        {
+            Reg8 R[GP_REGISTERS];
+            Reg8 IO[IO_REGISTERS];
+            Mem8 SRAM[SRAM_SIZE];
+        };
+    };
+#else
     Reg8 R[GP_REGISTERS];
     Reg8 IO[IO_REGISTERS];
+#endif
     Mem16 FLASH[FLASH_SIZE / 2];
-    Mem8 EEPROM[EEPROM_SIZE];
+#ifdef PREDECODE
+    /* DECODED_DATA, or a fully decoded table shared by the machines of a batch
+       or mapped read only from a prepared image, neither ever written. */
+    DecodedInstruction *DECODED;
+#endif
+#ifdef JIT
+    JitBlock BLOCKS[FLASH_SIZE / 2];
+#endif
+#ifdef FAST_FORWARD
+    uint8_t LOOPS[FLASH_SIZE / 2];
+#endif
+#ifdef LAZY_FLAGS
+    LazyFlags LAZY;
+#endif
+    /* EEPROM_DATA, or a file mapped by eeprom_map. */
+    Mem8 *EEPROM;
+    Mem8 EEPROM_DATA[EEPROM_SIZE];
+#ifndef FLAT_DATA
     Mem8 SRAM[SRAM_SIZE];
+#endif
     bool SKIP;
+    uint64_t CYCLES;
+#ifdef TIMERS
+    Peripherals PERIPHERALS;
+#endif
+#ifdef GPIO
+    GpioPins PINS;
+#endif
+#ifdef INTERRUPTS
+    /* Vectors requested by peripherals, one bit each, and the same bits while
+       SREG I is set, so the run loops only test PENDING. */
+    uint16_t REQUESTED;
+    uint16_t PENDING;
+    /* The cycle SEI or RETI ended on, at which no interrupt is taken so the
+       instruction after them always runs first. */
+    uint64_t INHIBITED_AT;
+#endif
+#ifdef FUSION
+    /* Superinstructions stop between parts once CYCLES reaches this, so a run
+       for a number of cycles stops where it would without them. */
+    uint64_t FUSION_LIMIT;
+#endif
+    /* Where a run for a number of cycles ends, which skips over idle loops
+       and sleep stop at so the run ends where it would without them. */
+    uint64_t RUN_END;
+    /* The image the program was loaded from, if it is still open. */
+    const ProgramImage *IMAGE;
+    /* The GDB session debugging the machine, if any, which BREAK stops to. */
+    struct GdbSession *DEBUGGER;
+#ifdef WATCHPOINTS
+    /* Breakpoints by program memory word and watchpoints by data space
+       address, one bit each. None are tested unless WATCHING is set, which it
+       is while any are armed. */
+    bool WATCHING;
+    WatchHit WATCH_HIT;
+    uint64_t BREAKPOINTS[WATCH_WORDS(PROG_MEM_SIZE)];
+    uint64_t READ_WATCHES[WATCH_WORDS(DATA_MEM_SIZE)];
+    uint64_t WRITE_WATCHES[WATCH_WORDS(DATA_MEM_SIZE)];
+#endif
+#ifdef DIRTY_PAGES
+    /* Pages written since SNAPSHOT was taken or restored, one bit per page. */
+    const struct MachineState *SNAPSHOT;
+    uint64_t DIRTY_SRAM[DIRTY_WORDS(SRAM_SIZE)];
+    uint64_t DIRTY_EEPROM[DIRTY_WORDS(EEPROM_SIZE)];
+#endif
+#ifdef PROFILE
+    Profile PROFILER;
+#endif
+#ifdef TRACE
+    /* Executed instructions are recorded to TRACER when it isn't NULL. */
+    TraceSink *TRACER;
+    TraceRecord TRACE_RECORD;
+#endif
+#ifdef PREDECODE
+    /* Left out of sizeof(Machine) so that machines sharing a table need no
+       room for their own, allocate MACHINE_SIZE for one which does. */
+    DecodedInstruction DECODED_DATA[];
+#endif
 } Machine;
 
+#ifdef PREDECODE
+#define MACHINE_SIZE (sizeof(Machine) + PROG_MEM_SIZE * sizeof(DecodedInstruction))
+#else
+#define MACHINE_SIZE sizeof(Machine)
+#endif
+
+#ifdef TRACE
+static inline void TraceWrite(Machine *m, Address16 a, uint16_t v, uint8_t width)
+{
+    if (m->TRACER != NULL)
+    {
+        m->TRACE_RECORD.address = a;
+        m->TRACE_RECORD.value = v;
+        m->TRACE_RECORD.width = width;
+    }
+}
+#endif
+
 static inline Mem8 GetProgMemByte(Machine *m, Address16 a)
 {
     return (m->FLASH[(a >> 1) % PROG_MEM_SIZE] >> (8 * (1 - (a & 0x1)))) & 0xff;
@@ -101,51 +562,379 @@ static inline Mem16 GetProgMem(Machine *m, Address16 a)
     return m->FLASH[a % PROG_MEM_SIZE];
 }
 
+void jit_invalidate(Machine *m, Address16 a);
+void machine_unshare(Machine *m);
+
 static inline void SetProgMem(Machine *m, Address16 a, Mem16 v)
 {
     m->FLASH[a % PROG_MEM_SIZE] = v;
+#ifdef PREDECODE
+    if (m->DECODED != m->DECODED_DATA)
+    {
+        machine_unshare(m);
+    }
+    /* The previous word may be a 32 bit instruction which uses this word. */
+    m->DECODED[a % PROG_MEM_SIZE].handler = HANDLER_PREDECODE;
+    m->DECODED[(Address16)(a - 1) % PROG_MEM_SIZE].handler = HANDLER_PREDECODE;
+#endif
+#ifdef FUSION
+    /* Superinstructions are up to three words long. */
+    m->DECODED[(Address16)(a - 2) % PROG_MEM_SIZE].handler = HANDLER_PREDECODE;
+#endif
+#ifdef JIT
+    jit_invalidate(m, a % PROG_MEM_SIZE);
+#endif
+#ifdef FAST_FORWARD
+    for (Address16 start = 0; start < IDLE_LOOP_MAX_WORDS; start++)
+    {
+        m->LOOPS[(Address16)(a - start) % PROG_MEM_SIZE] = LOOP_UNKNOWN;
+    }
+#endif
+}
+
+void materialise_flags(Machine *m);
+
+static inline void MaterialiseFlags(Machine *m)
+{
+#ifdef LAZY_FLAGS
+    if (m->LAZY.mask != 0)
+    {
+        materialise_flags(m);
+    }
+#else
+    UNUSED(m);
+#endif
+}
+
+#ifdef LAZY_FLAGS
+static inline void DeferFlags(Machine *m, uint8_t handler, uint8_t mask, Reg16 Rd, Reg16 Rr, Reg16 R)
+{
+    /* Flags deferred earlier which this instruction won't overwrite are still
+       needed so must be evaluated first. */
+    if ((m->LAZY.mask & ~mask) != 0)
+    {
+        materialise_flags(m);
+    }
+    m->LAZY.handler = handler;
+    m->LAZY.mask = mask;
+    m->LAZY.Rd = Rd;
+    m->LAZY.Rr = Rr;
+    m->LAZY.R = R;
+}
+#endif
+
+#define SetBit(val, bit) ((val) | (0x1 << (bit)))
+#define GetBit(val, bit) (((val) & (0x1 << (bit))) >> (bit))
+#define TestBit(val, bit) (((val) & (0x1 << (bit))) != 0)
+#define ClearBit(val, bit) ((val) & ~(0x1 << (bit)))
+
+/* Read a flag as currently stored, without evaluating any deferred flags. */
+#ifdef PACKED_SREG
+#define ReadStatusFlag(m, index) TestBit((m)->SREG_BYTE, index)
+#else
+#define ReadStatusFlag(m, index) ((m)->SREG[index])
+#endif
+
+/* Called whenever REQUESTED or SREG I changes. */
+static inline void UpdateInterrupts(Machine *m)
+{
+#ifdef INTERRUPTS
+    m->PENDING = ReadStatusFlag(m, SREG_I) ? m->REQUESTED : 0;
+#else
+    UNUSED(m);
+#endif
 }
 
+#ifdef INTERRUPTS
+/* Called by SEI and RETI once their cycles are counted. */
+static inline void InhibitInterrupts(Machine *m)
+{
+    m->INHIBITED_AT = m->CYCLES;
+}
+#endif
+
 static inline Mem8 PackSREG(Machine *m)
 {
+    MaterialiseFlags(m);
+#ifdef PACKED_SREG
+    return m->SREG_BYTE;
+#else
     Mem8 SREG = 0;
-    SREG |= m->SREG[SREG_I] ? 128 : 0;
-    SREG |= m->SREG[SREG_T] ? 64 : 0;
-    SREG |= m->SREG[SREG_H] ? 32 : 0;
-    SREG |= m->SREG[SREG_S] ? 16 : 0;
-    SREG |= m->SREG[SREG_V] ? 8 : 0;
-    SREG |= m->SREG[SREG_N] ? 4 : 0;
-    SREG |= m->SREG[SREG_Z] ? 2 : 0;
-    SREG |= m->SREG[SREG_C] ? 1 : 0;
+    SREG |= m->SREG[SREG_I] << 7;
+    SREG |= m->SREG[SREG_T] << 6;
+    SREG |= m->SREG[SREG_H] << 5;
+    SREG |= m->SREG[SREG_S] << 4;
+    SREG |= m->SREG[SREG_V] << 3;
+    SREG |= m->SREG[SREG_N] << 2;
+    SREG |= m->SREG[SREG_Z] << 1;
+    SREG |= m->SREG[SREG_C];
     return SREG;
+#endif
 }
 
 static inline void UnpackSREG(Machine *m, Mem8 SREG)
 {
-    m->SREG[SREG_I] = (SREG & 128) != 0;
-    m->SREG[SREG_T] = (SREG & 64) != 0;
-    m->SREG[SREG_H] = (SREG & 32) != 0;
-    m->SREG[SREG_S] = (SREG & 16) != 0;
-    m->SREG[SREG_V] = (SREG & 8) != 0;
-    m->SREG[SREG_N] = (SREG & 4) != 0;
-    m->SREG[SREG_Z] = (SREG & 2) != 0;
-    m->SREG[SREG_C] = (SREG & 1) != 0;
+#ifdef LAZY_FLAGS
+    /* Every flag is overwritten so any deferred flags can be dropped. */
+    m->LAZY.mask = 0;
+#endif
+#ifdef PACKED_SREG
+    m->SREG_BYTE = SREG;
+#else
+    m->SREG[SREG_I] = (SREG >> 7) & 0x1;
+    m->SREG[SREG_T] = (SREG >> 6) & 0x1;
+    m->SREG[SREG_H] = (SREG >> 5) & 0x1;
+    m->SREG[SREG_S] = (SREG >> 4) & 0x1;
+    m->SREG[SREG_V] = (SREG >> 3) & 0x1;
+    m->SREG[SREG_N] = (SREG >> 2) & 0x1;
+    m->SREG[SREG_Z] = (SREG >> 1) & 0x1;
+    m->SREG[SREG_C] = SREG & 0x1;
+#endif
+    UpdateInterrupts(m);
+}
+
+#ifdef TIMERS
+void events_reset(Machine *m);
+void event_schedule(Machine *m, EventSource source, uint64_t cycle);
+void event_cancel(Machine *m, EventSource source);
+void run_events(Machine *m);
+void timers_reset(Machine *m);
+void timer_event(Machine *m, EventSource source);
+Mem8 timer_read(Machine *m, uint8_t a);
+void timer_write(Machine *m, uint8_t a, Mem8 v);
+void timer_set(Machine *m, uint8_t a, Mem8 v);
+void eeprom_reset(Machine *m);
+void eeprom_event(Machine *m);
+void eeprom_write(Machine *m, Mem8 v);
+#endif
+
+#ifdef GPIO
+void gpio_reset(Machine *m);
+void gpio_event(Machine *m, EventSource source);
+void gpio_write(Machine *m, uint8_t a, Mem8 v);
+void gpio_callback(Machine *m, PinCallback callback, void *context, uint64_t interval);
+void gpio_flush(Machine *m);
+bool gpio_drive(Machine *m, uint64_t cycle, uint8_t driven, uint8_t levels);
+#endif
+
+#ifdef INTERRUPTS
+void interrupts_request(Machine *m, uint16_t vectors, uint16_t requested);
+void service_interrupt(Machine *m);
+#endif
+#if defined(TIMERS) && defined(INTERRUPTS)
+void timer_acknowledge(Machine *m, InterruptVector vector);
+#endif
+#if defined(GPIO) && defined(INTERRUPTS)
+void gpio_acknowledge(Machine *m);
+#endif
+
+/* Called between instructions to run any events which are due. */
+static inline void CheckEvents(Machine *m)
+{
+#ifdef TIMERS
+    if (m->CYCLES >= m->PERIPHERALS.EVENTS.NEXT)
+    {
+        run_events(m);
+    }
+#else
+    UNUSED(m);
+#endif
+}
+
+bool machine_sleep(Machine *m);
+#ifdef FAST_FORWARD
+void fast_forward(Machine *m);
+#endif
+
+/* Called after branches, which may have closed an idle loop starting at PC. */
+static inline void FastForward(Machine *m)
+{
+#ifdef FAST_FORWARD
+    if (m->LOOPS[m->PC % PROG_MEM_SIZE] != LOOP_NONE)
+    {
+        fast_forward(m);
+    }
+#else
+    UNUSED(m);
+#endif
+}
+
+/* Called between the parts of a superinstruction, which stops early wherever
+   the run loops would have done something between them. */
+static inline bool FusionInterrupted(Machine *m)
+{
+#ifdef WATCHPOINTS
+    /* A breakpoint may be on any part. */
+    if (m->WATCHING)
+    {
+        return true;
+    }
+#endif
+#ifdef TIMERS
+    if (m->CYCLES >= m->PERIPHERALS.EVENTS.NEXT)
+    {
+        return true;
+    }
+#endif
+#ifdef INTERRUPTS
+    if (m->PENDING != 0)
+    {
+        return true;
+    }
+#endif
+#ifdef FUSION
+    return m->CYCLES >= m->FUSION_LIMIT;
+#else
+    UNUSED(m);
+    return false;
+#endif
+}
+
+#ifdef WATCHPOINTS
+void watch_reset(Machine *m);
+void watch_breakpoint(Machine *m, Address16 pc, bool armed);
+void watch_data(Machine *m, Address16 a, WatchKind kind, bool armed);
+
+static inline bool IsWatched(const uint64_t bits[], Address16 a)
+{
+    return (bits[a / 64] >> (a % 64)) & 0x1;
+}
+
+/* Called by machine_cycle while WATCHING, before the instruction at PC. A stop
+   leaves PC where it is, which the run loops take as a halt. Running again from
+   a breakpoint carries on past it. */
+static inline bool WatchStop(Machine *m)
+{
+    WatchHit *hit = &m->WATCH_HIT;
+    if (hit->pending)
+    {
+        hit->pending = false;
+        return true;
+    }
+    const Address16 pc = m->PC % PROG_MEM_SIZE;
+    if (IsWatched(m->BREAKPOINTS, pc) && !(hit->kind == WATCH_BREAKPOINT && hit->address == pc))
+    {
+        hit->kind = WATCH_BREAKPOINT;
+        hit->address = pc;
+        return true;
+    }
+    hit->kind = WATCH_NONE;
+    return false;
+}
+
+static inline void WatchData(Machine *m, const uint64_t watches[], WatchKind kind, Address16 a)
+{
+    if (IsWatched(watches, a))
+    {
+        m->WATCH_HIT.kind = kind;
+        m->WATCH_HIT.pending = true;
+        m->WATCH_HIT.address = a;
+    }
+}
+#endif
+
+/* Called between instructions, after CheckEvents, to take any interrupt. */
+static inline void CheckInterrupts(Machine *m)
+{
+#ifdef INTERRUPTS
+    if (m->PENDING != 0)
+    {
+        service_interrupt(m);
+    }
+#else
+    UNUSED(m);
+#endif
+}
+
+static inline Mem8 GetIO(Machine *m, uint8_t a)
+{
+    const uint8_t b = a % IO_REGISTERS;
+    if (b == SREG_IO_ADDRESS)
+    {
+        return PackSREG(m);
+    }
+#ifdef TIMERS
+    if ((TIMER_IO_HOOKS >> b) & 0x1)
+    {
+        return timer_read(m, b);
+    }
+#endif
+    return m->IO[b];
+}
+
+static inline void SetIO(Machine *m, uint8_t a, Mem8 v)
+{
+    const uint8_t b = a % IO_REGISTERS;
+#ifdef TRACE
+    TraceWrite(m, GP_REGISTERS + b, v, 1);
+#endif
+    if (b == SREG_IO_ADDRESS)
+    {
+        UnpackSREG(m, v);
+    }
+#ifdef TIMERS
+    if ((TIMER_IO_HOOKS >> b) & 0x1)
+    {
+        timer_write(m, b, v);
+        return;
+    }
+    if (b == EECR_IO_ADDRESS)
+    {
+        eeprom_write(m, v);
+        return;
+    }
+#endif
+#ifdef GPIO
+    if ((GPIO_IO_HOOKS >> b) & 0x1)
+    {
+        gpio_write(m, b, v);
+        return;
+    }
+#endif
+    m->IO[b] = v;
+}
+
+/* SBI and CBI, which write back the whole register but for STROBE_IO_HOOKS. */
+static inline void SetIOBit(Machine *m, uint8_t a, uint8_t bit, bool set)
+{
+    const uint8_t b = a % IO_REGISTERS;
+    if ((STROBE_IO_HOOKS >> b) & 0x1)
+    {
+        SetIO(m, b, set ? 1 << bit : 0);
+        return;
+    }
+    SetIO(m, b, set ? SetBit(m->IO[b], bit) : ClearBit(m->IO[b], bit));
+}
+
+static inline bool IsHookedDataAddress(Address16 a)
+{
+    const Address16 b = a - GP_REGISTERS;
+    return b < IO_REGISTERS && ((IO_HOOKS >> b) & 0x1);
 }
 
 static inline Mem8 GetDataMem(Machine *m, Address16 a)
 {
     const Address16 b = a % DATA_MEM_SIZE;
+#ifdef WATCHPOINTS
+    if (m->WATCHING)
+    {
+        WatchData(m, m->READ_WATCHES, WATCH_READ, b);
+    }
+#endif
+#ifdef FLAT_DATA
+    if (IsHookedDataAddress(b))
+    {
+        return GetIO(m, b - GP_REGISTERS);
+    }
+    return m->DATA[b];
+#else
     if (b < GP_REGISTERS)
     {
         return m->R[b % GP_REGISTERS];
     }
     else if (b < GP_REGISTERS + IO_REGISTERS)
     {
-        if (b == 0x3F)
-        {
-            return PackSREG(m);
-        }
-        return m->IO[(b - GP_REGISTERS) % IO_REGISTERS];
+        return GetIO(m, b - GP_REGISTERS);
     }
     else if (b < GP_REGISTERS + IO_REGISTERS + SRAM_SIZE)
     {
@@ -153,46 +942,269 @@ static inline Mem8 GetDataMem(Machine *m, Address16 a)
     }
 
     return 0;
+#endif
 }
 
+#ifdef DIRTY_PAGES
+static inline void MarkDirty(uint64_t pages[], size_t offset)
+{
+    const size_t page = offset / DIRTY_PAGE_SIZE;
+    pages[page / 64] |= UINT64_C(1) << (page % 64);
+}
+#endif
+
 static inline void SetDataMem(Machine *m, Address16 a, Mem8 v)
 {
     const Address16 b = a % DATA_MEM_SIZE;
+#ifdef WATCHPOINTS
+    if (m->WATCHING)
+    {
+        WatchData(m, m->WRITE_WATCHES, WATCH_WRITE, b);
+    }
+#endif
+#ifdef TRACE
+    TraceWrite(m, b, v, 1);
+#endif
+#ifdef FLAT_DATA
+    if (IsHookedDataAddress(b))
+    {
+        SetIO(m, b - GP_REGISTERS, v);
+        return;
+    }
+#ifdef DIRTY_PAGES
+    const Address16 s = b - GP_REGISTERS - IO_REGISTERS;
+    if (s < SRAM_SIZE)
+    {
+        MarkDirty(m->DIRTY_SRAM, s);
+    }
+#endif
+    m->DATA[b] = v;
+#else
     if (b < GP_REGISTERS)
     {
         m->R[b % GP_REGISTERS] = v;
     }
     else if (b < GP_REGISTERS + IO_REGISTERS)
     {
-        if (b == 0x3F)
-        {
-            UnpackSREG(m, v);
-        }
-        m->IO[(b - GP_REGISTERS) % IO_REGISTERS] = v;
+        SetIO(m, b - GP_REGISTERS, v);
     }
     else if (b < GP_REGISTERS + IO_REGISTERS + SRAM_SIZE)
     {
+#ifdef DIRTY_PAGES
+        MarkDirty(m->DIRTY_SRAM, (b - GP_REGISTERS - IO_REGISTERS) % SRAM_SIZE);
+#endif
         m->SRAM[(b - GP_REGISTERS - IO_REGISTERS) % SRAM_SIZE] = v;
     }
+#endif
+}
+
+/* The data space as a debugger sees it, without watchpoints, traces or the
+   side effects of writing IO registers, which are stored as they are. Timers
+   are brought up to date around their registers, which the program can't
+   tell from them having been all along. Other peripherals only act on what
+   was stored the next time they look at their registers. */
+static inline Mem8 PeekDataMem(Machine *m, Address16 a)
+{
+    const Address16 b = a % DATA_MEM_SIZE;
+    if (b < GP_REGISTERS)
+    {
+        return m->R[b];
+    }
+    if (b < GP_REGISTERS + IO_REGISTERS)
+    {
+        return GetIO(m, b - GP_REGISTERS);
+    }
+    return m->SRAM[(b - GP_REGISTERS - IO_REGISTERS) % SRAM_SIZE];
+}
+
+static inline void PokeDataMem(Machine *m, Address16 a, Mem8 v)
+{
+    const Address16 b = a % DATA_MEM_SIZE;
+    if (b < GP_REGISTERS)
+    {
+        m->R[b] = v;
+        return;
+    }
+    if (b < GP_REGISTERS + IO_REGISTERS)
+    {
+        const uint8_t io = b - GP_REGISTERS;
+        if (io == SREG_IO_ADDRESS)
+        {
+            UnpackSREG(m, v);
+        }
+#ifdef TIMERS
+        if ((TIMER_IO_HOOKS >> io) & 0x1)
+        {
+            timer_set(m, io, v);
+            return;
+        }
+#endif
+        m->IO[io] = v;
+        return;
+    }
+#ifdef DIRTY_PAGES
+    MarkDirty(m->DIRTY_SRAM, (b - GP_REGISTERS - IO_REGISTERS) % SRAM_SIZE);
+#endif
+    m->SRAM[(b - GP_REGISTERS - IO_REGISTERS) % SRAM_SIZE] = v;
+}
+
+static inline Mem8 GetEEPROM(Machine *m, Address16 a)
+{
+    return m->EEPROM[a % EEPROM_SIZE];
+}
+
+static inline void SetEEPROM(Machine *m, Address16 a, Mem8 v)
+{
+#ifdef DIRTY_PAGES
+    MarkDirty(m->DIRTY_EEPROM, a % EEPROM_SIZE);
+#endif
+    m->EEPROM[a % EEPROM_SIZE] = v;
 }
 
 static inline void ClearStatusFlag(Machine *m, uint8_t index)
 {
+    MaterialiseFlags(m);
+#ifdef PACKED_SREG
+    m->SREG_BYTE = ClearBit(m->SREG_BYTE, index & 0x7);
+#else
     m->SREG[index & 0x7] = false;
+#endif
+    if ((index & 0x7) == SREG_I)
+    {
+        UpdateInterrupts(m);
+    }
 }
 
 static inline void SetStatusFlag(Machine *m, uint8_t index)
 {
+    MaterialiseFlags(m);
+#ifdef PACKED_SREG
+    m->SREG_BYTE = SetBit(m->SREG_BYTE, index & 0x7);
+#else
     m->SREG[index & 0x7] = true;
+#endif
+    if ((index & 0x7) == SREG_I)
+    {
+        UpdateInterrupts(m);
+    }
 }
 
 static inline bool GetStatusFlag(Machine *m, uint8_t index)
 {
-    return m->SREG[index & 0x7];
+    MaterialiseFlags(m);
+    return ReadStatusFlag(m, index & 0x7);
 }
 
 #define SetPC(m, a) m->PC = ((a)&PC_MASK)
 #define GetPC(m) (m->PC)
+
+/* RJMP to itself, avr-gcc's empty for(;;). */
+#define OPCODE_RJMP_SELF 0xCFFF
+#define OPCODE_SLEEP 0x9588
+
+/* Whether the instruction which started at last_pc halted the machine, which
+   the run loops take it to have done when it leaves PC where it was. A jump
+   to itself with SREG I set is only waiting for an interrupt, as long as one
+   is pending or an event which could raise one is still to come. SLEEP only
+   leaves PC where it is without an event to come, or at the end of a run. */
+static inline bool Halted(Machine *m, Reg16 last_pc)
+{
+    if (GetPC(m) != last_pc)
+    {
+        return false;
+    }
+#ifdef WATCHPOINTS
+    if (m->WATCHING && m->WATCH_HIT.kind != WATCH_NONE)
+    {
+        return true;
+    }
+#endif
+#ifdef TIMERS
+    if (GetProgMem(m, last_pc) == OPCODE_SLEEP)
+    {
+        return m->PERIPHERALS.EVENTS.NEXT == UINT64_MAX;
+    }
+#endif
+#ifdef INTERRUPTS
+    if (GetProgMem(m, last_pc) == OPCODE_RJMP_SELF && GetStatusFlag(m, SREG_I))
+    {
+#ifdef TIMERS
+        return m->PENDING == 0 && m->PERIPHERALS.EVENTS.NEXT == UINT64_MAX;
+#else
+        return m->PENDING == 0;
+#endif
+    }
+#endif
+    return true;
+}
+
+#ifdef TRACE
+static inline void TraceBegin(Machine *m)
+{
+    if (m->TRACER != NULL)
+    {
+        m->TRACE_RECORD.pc = GetPC(m);
+        m->TRACE_RECORD.opcode = GetProgMem(m, GetPC(m));
+        m->TRACE_RECORD.width = 0;
+        m->TRACE_RECORD.cycles = m->CYCLES & 0xff;
+    }
+}
+
+static inline void TraceEnd(Machine *m)
+{
+    if (m->TRACER != NULL)
+    {
+        m->TRACE_RECORD.sreg = PackSREG(m);
+        m->TRACE_RECORD.cycles = (m->CYCLES - m->TRACE_RECORD.cycles) & 0xff;
+        trace_push(m->TRACER, &m->TRACE_RECORD);
+    }
+}
+#endif
+
+#ifdef PROFILE
+void profile_reset(Machine *m);
+void profile_call(Machine *m);
+bool profile_write(Machine *m, const char prefix[]);
+
+/* Cycles are charged to the call stack an instruction started in once the next
+   instruction starts, so they include any skip which followed. */
+static inline void ProfileInstruction(Machine *m, uint8_t handler)
+{
+    Profile *p = &m->PROFILER;
+    p->NODES[p->LAST_NODE].cycles += m->CYCLES - p->LAST_CYCLES;
+    p->LAST_CYCLES = m->CYCLES;
+    p->LAST_NODE = p->NODE;
+    p->LAST_PC = GetPC(m) % PROG_MEM_SIZE;
+    p->HANDLERS[handler]++;
+    p->HITS[p->LAST_PC]++;
+}
+
+static inline void ProfileBranch(Machine *m, bool taken)
+{
+    Profile *p = &m->PROFILER;
+    if (taken)
+    {
+        p->TAKEN[p->LAST_PC]++;
+    }
+    else
+    {
+        p->NOT_TAKEN[p->LAST_PC]++;
+    }
+}
+
+static inline void ProfileReturn(Machine *m)
+{
+    Profile *p = &m->PROFILER;
+    if (p->OVERFLOW > 0)
+    {
+        p->OVERFLOW--;
+    }
+    else
+    {
+        p->NODE = p->NODES[p->NODE].parent;
+    }
+}
+#endif
 #define SetSP(m, a) Set16(m->SP_H, m->SP_L, ((a)&SP_MASK))
 #define GetSP(m) (Get16(m->SP_H, m->SP_L) & SP_MASK)
 
@@ -221,20 +1233,75 @@ static inline Reg8 PopStack8(Machine *m)
     return GetDataMem(m, GetSP(m));
 }
 
-#define SetBit(val, bit) ((val) | (0x1 << (bit)))
-#define GetBit(val, bit) (((val) & (0x1 << (bit))) >> (bit))
-#define TestBit(val, bit) (((val) & (0x1 << (bit))) != 0)
-#define ClearBit(val, bit) ((val) & ~(0x1 << (bit)))
-
 #define IsNegative(val, bit_count) (((val) & ((1 << ((bit_count)-1)))) != 0)
 #define ToSigned(val, bit_count) (IsNegative(val, bit_count) ? -(((~(val) + 1) & ((1 << (bit_count - 1)) - 1))) : val)
 
+/* The per-instance part of a Machine, without the program image. */
+typedef struct MachineState
+{
+    Reg16 PC;
+    Mem8 SREG;
+    bool SKIP;
+    bool HALTED;
+    uint64_t CYCLES;
+    Reg8 R[GP_REGISTERS];
+    Reg8 IO[IO_REGISTERS];
+    Mem8 SRAM[SRAM_SIZE];
+    Mem8 EEPROM[EEPROM_SIZE];
+#ifdef TIMERS
+    Peripherals PERIPHERALS;
+#endif
+#ifdef INTERRUPTS
+    uint16_t REQUESTED;
+    uint64_t INHIBITED_AT;
+#endif
+} MachineState;
+
+Mem16 fetch_instruction(Machine *m);
 void machine_cycle(Machine *m);
-void run_until_halt_loop(Machine *m);
+bool run_until_halt_loop(Machine *m);
+bool run_until_halt_threaded(Machine *m);
+bool run_for_cycles(Machine *m, uint64_t n);
+/* With JIT these share one code buffer between every machine, so only one
+   thread may call them at a time. */
+bool run_until_halt_jit(Machine *m);
+bool run_until_halt(Machine *m);
+bool run_for_cycles_fastest(Machine *m, uint64_t n);
+bool jit_run_block(Machine *m);
+bool run_lockstep(Machine *m, uint64_t max_cycles, FILE *report, bool *halted);
+void jit_reset(Machine *m);
+void machine_copy(Machine *to, const Machine *from);
+void save_machine_state(Machine *m, MachineState *s);
+void restore_machine_state(Machine *m, const MachineState *s);
+void machine_snapshot(Machine *m, MachineState *s);
+void machine_restore(Machine *m, const MachineState *s);
+bool run_batch(const Machine *image, MachineState states[], size_t n, uint64_t max_cycles, size_t threads);
+int atsim_main(int argc, char *argv[]);
 void load_memory(Machine *m, uint8_t bytes[], size_t max);
+void load_image(Machine *m, const ProgramImage *image);
 bool load_memory_from_file(Machine *m, const char file_name[]);
+bool prepare_image(const char image_name[], const char file_name[]);
+bool prepared_restore(Machine *m, const ImagePredecoded *predecoded);
+bool eeprom_map(Machine *m, const char file_name[]);
+void eeprom_unmap(Machine *m);
 void dump_registers(Machine *m);
 void dump_stack(Machine *m);
 void interactive_break(Machine *m);
+bool gdb_serve(Machine *m, uint16_t port, bool *resume);
+void gdb_break(Machine *m);
+Machine *binding_new(void);
+void binding_free(Machine *m);
+Mem8 *binding_memory(Machine *m, uint8_t region, size_t *size);
+bool binding_read(Machine *m, uint8_t region, uint32_t address, uint8_t *data, size_t size);
+bool binding_write(Machine *m, uint8_t region, uint32_t address, const uint8_t *data, size_t size);
+bool binding_run_batch(Machine *m, MachineState *const snapshots[], size_t n, uint64_t max_cycles, size_t threads,
+                       bool halted[]);
+uint32_t binding_pc(Machine *m);
+void binding_set_pc(Machine *m, uint32_t pc);
+uint8_t binding_sreg(Machine *m);
+void binding_set_sreg(Machine *m, uint8_t sreg);
+uint64_t binding_cycles(Machine *m);
+MachineState *binding_state_new(void);
+void binding_state_free(MachineState *s);
 
 #endif
@@ -0,0 +1,86 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Every MCU core linked into this binary, each built from the same sources
+   with its own MCU_PREFIX (see symbols.h) so sizes and masks stay compile time
+   constants. The first is run when --mcu isn't given. */
+#ifndef MCU_CORES
+#define MCU_CORES X(ATTiny85) X(ATTiny45) X(ATTiny25)
+#endif
+
+/* The function of each core which is run, atsim_main for the simulator and
+   tests_main for the test runner. */
+#ifndef MCU_MAIN
+#define MCU_MAIN atsim_main
+#endif
+
+#define CORE_MAIN__(mcu, main) mcu##_##main
+#define CORE_MAIN_(mcu, main) CORE_MAIN__(mcu, main)
+#define CORE_MAIN(mcu) CORE_MAIN_(mcu, MCU_MAIN)
+
+#define X(mcu) int CORE_MAIN(mcu)(int argc, char *argv[]);
+MCU_CORES
+#undef X
+
+static const struct
+{
+    const char *name;
+    int (*main)(int argc, char *argv[]);
+} CORES[] = {
+#define X(mcu) {#mcu, CORE_MAIN(mcu)},
+    MCU_CORES
+#undef X
+};
+
+#define CORE_COUNT (sizeof(CORES) / sizeof(CORES[0]))
+
+static bool same_name(const char *a, const char *b)
+{
+    while (*a != '\0' && tolower((unsigned char)*a) == tolower((unsigned char)*b))
+    {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+int main(int argc, char *argv[])
+{
+    /* Take --mcu NAME or --mcu=NAME out of the arguments given to the core. */
+    const char *mcu = CORES[0].name;
+    int core_argc = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--mcu") == 0 && i + 1 < argc)
+        {
+            mcu = argv[++i];
+        }
+        else if (strncmp(argv[i], "--mcu=", 6) == 0)
+        {
+            mcu = argv[i] + 6;
+        }
+        else
+        {
+            argv[core_argc++] = argv[i];
+        }
+    }
+    argv[core_argc] = NULL;
+
+    for (size_t i = 0; i < CORE_COUNT; i++)
+    {
+        if (same_name(CORES[i].name, mcu))
+        {
+            return CORES[i].main(core_argc, argv);
+        }
+    }
+
+    fprintf(stderr, "Unknown MCU %s, expected one of:", mcu);
+    for (size_t i = 0; i < CORE_COUNT; i++)
+    {
+        fprintf(stderr, " %s", CORES[i].name);
+    }
+    fputc('\n', stderr);
+    return 2;
+}
@@ -2,6 +2,7 @@
 #define __ATSIM_MCU
 
 #include "config.h"
+#include "symbols.h"
 
 #ifdef MCU_ATTiny85
 
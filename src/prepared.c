@@ -0,0 +1,166 @@
+#include <string.h>
+#include "machine.h"
+#include "instructions.h"
+
+/* A prepared image is a program as it is once loaded and predecoded, written by
+   atsim --prepare, so that a short run maps it and starts without parsing the
+   file or decoding any instruction. The file is read through the page cache, so
+   every process running the same image shares its pages, and the predecode
+   cache is used where it is mapped rather than copied. It is only taken by
+   builds with the same handler table, by its hash, entry size and FUSION, and
+   only if every entry holds a handler of the table and operands which index no
+   further than a decoder's could. Any other cache is dropped and the program
+   decoded as usual, so a file which only claims to be a prepared image can't
+   run anything a program couldn't. See loader.c for the layout, which the
+   loader checks the file is long enough for. */
+
+#ifdef FUSION
+#define PREPARED_FLAGS PREPARED_FUSION
+#else
+#define PREPARED_FLAGS 0
+#endif
+
+static bool write_u32(FILE *f, uint32_t v)
+{
+    const uint8_t bytes[4] = {v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff};
+    return fwrite(bytes, 1, sizeof(bytes), f) == sizeof(bytes);
+}
+
+static bool write_header(FILE *f, const ProgramImage *image, uint32_t strings_size)
+{
+    char mcu[PREPARED_MCU_SIZE] = {0};
+    strncpy(mcu, MCU, sizeof(mcu) - 1);
+#ifdef PREDECODE
+    const uint32_t decoded_count = PROG_MEM_SIZE;
+#else
+    const uint32_t decoded_count = 0;
+#endif
+    return fwrite(PREPARED_MAGIC, 1, PREPARED_MAGIC_SIZE, f) == PREPARED_MAGIC_SIZE && write_u32(f, PREPARED_VERSION) &&
+           fwrite(mcu, 1, sizeof(mcu), f) == sizeof(mcu) && write_u32(f, PROG_MEM_SIZE_BYTES) &&
+           write_u32(f, EEPROM_SIZE) && write_u32(f, sizeof(DecodedInstruction)) && write_u32(f, decoded_count) &&
+           write_u32(f, HANDLER_TABLE_HASH) && write_u32(f, PREPARED_FLAGS) && write_u32(f, image->symbol_count) &&
+           write_u32(f, strings_size);
+}
+
+static bool write_memory(FILE *f, const Machine *m)
+{
+    uint8_t flash[PROG_MEM_SIZE_BYTES];
+    for (size_t word = 0; word < PROG_MEM_SIZE; word++)
+    {
+        flash[word * 2] = m->FLASH[word] & 0xff;
+        flash[word * 2 + 1] = m->FLASH[word] >> 8;
+    }
+    return fwrite(flash, 1, sizeof(flash), f) == sizeof(flash) &&
+           fwrite(m->EEPROM, 1, EEPROM_SIZE, f) == EEPROM_SIZE
+#ifdef PREDECODE
+           && fwrite(m->DECODED, sizeof(DecodedInstruction), PROG_MEM_SIZE, f) == PROG_MEM_SIZE
+#endif
+        ;
+}
+
+static bool write_symbols(FILE *f, const ProgramImage *image)
+{
+    uint32_t name = 0;
+    for (size_t s = 0; s < image->symbol_count; s++)
+    {
+        const ImageSymbol *symbol = &image->symbols[s];
+        if (!write_u32(f, symbol->address) || !write_u32(f, symbol->size) || !write_u32(f, name))
+        {
+            return false;
+        }
+        name += strlen(symbol->name) + 1;
+    }
+    for (size_t s = 0; s < image->symbol_count; s++)
+    {
+        const char *symbol_name = image->symbols[s].name;
+        if (fwrite(symbol_name, 1, strlen(symbol_name) + 1, f) != strlen(symbol_name) + 1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Writes the program in image_name, an ELF, Intel HEX, raw binary or prepared
+   image, to file_name as a prepared image, with every word predecoded. */
+bool prepare_image(const char image_name[], const char file_name[])
+{
+    ProgramImage *image = image_open(image_name);
+    if (image == NULL)
+    {
+        return false;
+    }
+    /* Zeroed so that unused operands, and so the file, are the same every time. */
+    Machine *m = calloc(1, MACHINE_SIZE);
+    FILE *f = m != NULL ? fopen(file_name, "wb") : NULL;
+    bool ok = f != NULL;
+    if (ok)
+    {
+        load_image(m, image);
+#ifdef PREDECODE
+        for (Address16 a = 0; a < PROG_MEM_SIZE; a++)
+        {
+            if (m->DECODED[a].handler == HANDLER_PREDECODE)
+            {
+                predecode_instruction(m, a);
+            }
+        }
+#endif
+        uint32_t strings_size = 0;
+        for (size_t s = 0; s < image->symbol_count; s++)
+        {
+            strings_size += strlen(image->symbols[s].name) + 1;
+        }
+        ok = write_header(f, image, strings_size) && write_memory(f, m) && write_symbols(f, image);
+        ok = fclose(f) == 0 && ok;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "Unable to write prepared image to %s.\n", file_name);
+    }
+    free(m);
+    image_close(image);
+    return ok;
+}
+
+#ifdef PREDECODE
+/* Whether an entry could have been decoded by this build. Handlers index the
+   dispatch tables and d and r index R, the other operands are only used within
+   their memory's size. */
+static bool entry_valid(const DecodedInstruction *i)
+{
+    return i->handler >= HANDLER_UNDECODABLE && i->handler < DECODED_HANDLER_COUNT && i->words >= 1 &&
+           i->words <= 2 && i->d < GP_REGISTERS && i->r < GP_REGISTERS;
+}
+#endif
+
+/* Called by load_image with the predecode cache of a prepared image, which m
+   then uses where it is mapped, read only. Returns false, leaving m with its
+   own empty cache, unless this build could have written it. The cache follows
+   program memory and EEPROM, whose sizes keep it aligned for its k operands. */
+bool prepared_restore(Machine *m, const ImagePredecoded *predecoded)
+{
+#ifdef PREDECODE
+    if (predecoded->count != PROG_MEM_SIZE || predecoded->entry_size != sizeof(DecodedInstruction) ||
+        predecoded->handler_hash != HANDLER_TABLE_HASH || predecoded->flags != PREPARED_FLAGS ||
+        (uintptr_t)predecoded->entries % sizeof(uint32_t) != 0)
+    {
+        return false;
+    }
+    const DecodedInstruction *entries = (const DecodedInstruction *)predecoded->entries;
+    for (Address16 a = 0; a < PROG_MEM_SIZE; a++)
+    {
+        if (!entry_valid(&entries[a]))
+        {
+            return false;
+        }
+    }
+    /* Fully decoded, so nothing writes it but SetProgMem, which copies it first. */
+    m->DECODED = (DecodedInstruction *)entries;
+    return true;
+#else
+    UNUSED(m);
+    UNUSED(predecoded);
+    return false;
+#endif
+}
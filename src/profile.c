@@ -0,0 +1,182 @@
+#include <inttypes.h>
+#include <string.h>
+#include "machine.h"
+#include "instructions.h"
+
+#ifdef PROFILE
+
+/* Calls are tracked as a tree of call stacks, so attributing cycles to the
+   current stack is a single counter increment. A hash of (parent, function)
+   finds the child node entered by a call. */
+
+#define PROFILE_CHILD_SLOTS (PROFILE_MAX_NODES * 2)
+
+void profile_reset(Machine *m)
+{
+    memset(&m->PROFILER, 0, sizeof(m->PROFILER));
+    m->PROFILER.NODE_COUNT = 1;
+    m->PROFILER.LAST_CYCLES = m->CYCLES;
+}
+
+void profile_call(Machine *m)
+{
+    Profile *p = &m->PROFILER;
+    const Address16 function = GetPC(m);
+    if (p->OVERFLOW > 0)
+    {
+        p->OVERFLOW++;
+        return;
+    }
+
+    size_t slot = ((size_t)p->NODE * 31 + function) % PROFILE_CHILD_SLOTS;
+    while (p->CHILDREN[slot] != 0)
+    {
+        const ProfileNode *child = &p->NODES[p->CHILDREN[slot]];
+        if (child->parent == p->NODE && child->function == function)
+        {
+            p->NODE = p->CHILDREN[slot];
+            return;
+        }
+        slot = (slot + 1) % PROFILE_CHILD_SLOTS;
+    }
+
+    /* Once the tree is full deeper calls are charged to the deepest stack. */
+    if (p->NODE_COUNT == PROFILE_MAX_NODES)
+    {
+        p->OVERFLOW++;
+        return;
+    }
+    const uint16_t node = p->NODE_COUNT++;
+    p->NODES[node].function = function;
+    p->NODES[node].parent = p->NODE;
+    p->NODES[node].cycles = 0;
+    p->CHILDREN[slot] = node;
+    p->NODE = node;
+}
+
+static const char *pc_mnemonic(Machine *m, Address16 pc)
+{
+#ifdef DECODE_LINEAR
+    UNUSED(m);
+    UNUSED(pc);
+    return "";
+#else
+    DecodedInstruction i;
+    decode_instruction(&i, GetProgMem(m, pc), GetProgMem(m, pc + 1));
+    return i.handler < HANDLER_COUNT && HANDLER_MNEMONICS[i.handler] ? HANDLER_MNEMONICS[i.handler] : "";
+#endif
+}
+
+static void write_json(Machine *m, FILE *fp)
+{
+    const Profile *p = &m->PROFILER;
+    fprintf(fp, "{\n  \"cycles\": %" PRIu64 ",\n  \"mnemonics\": {", m->CYCLES);
+    bool first = true;
+    for (uint8_t h = 0; h < HANDLER_COUNT; h++)
+    {
+        if (p->HANDLERS[h] != 0)
+        {
+            fprintf(fp, "%s\n    \"%s\": %" PRIu64, first ? "" : ",", HANDLER_MNEMONICS[h], p->HANDLERS[h]);
+            first = false;
+        }
+    }
+    fputs("\n  },\n  \"pcs\": [", fp);
+    first = true;
+    for (Address16 pc = 0; pc < PROG_MEM_SIZE; pc++)
+    {
+        if (p->HITS[pc] != 0)
+        {
+            fprintf(fp,
+                    "%s\n    {\"pc\": %u, \"mnemonic\": \"%s\", \"hits\": %" PRIu64 ", \"taken\": %" PRIu64
+                    ", \"not_taken\": %" PRIu64 "}",
+                    first ? "" : ",", pc, pc_mnemonic(m, pc), p->HITS[pc], p->TAKEN[pc], p->NOT_TAKEN[pc]);
+            first = false;
+        }
+    }
+    fputs("\n  ]\n}\n", fp);
+}
+
+static void write_csv(Machine *m, FILE *fp)
+{
+    const Profile *p = &m->PROFILER;
+    fputs("pc,mnemonic,hits,taken,not_taken\n", fp);
+    for (Address16 pc = 0; pc < PROG_MEM_SIZE; pc++)
+    {
+        if (p->HITS[pc] != 0)
+        {
+            fprintf(fp, "0x%04x,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", pc, pc_mnemonic(m, pc), p->HITS[pc],
+                    p->TAKEN[pc], p->NOT_TAKEN[pc]);
+        }
+    }
+}
+
+/* Collapsed stacks, one "frame;frame;frame cycles" line per call stack, as
+   read by flamegraph.pl and compatible tools. Frames are named by the symbol
+   table when the program was loaded from a still open ELF image. */
+static void write_collapsed(Machine *m, FILE *fp)
+{
+    const Profile *p = &m->PROFILER;
+    static uint16_t stack[PROFILE_MAX_NODES];
+    for (uint16_t node = 0; node < p->NODE_COUNT; node++)
+    {
+        if (p->NODES[node].cycles == 0)
+        {
+            continue;
+        }
+        size_t depth = 0;
+        for (uint16_t n = node; n != 0; n = p->NODES[n].parent)
+        {
+            stack[depth++] = n;
+        }
+        fputs("reset", fp);
+        while (depth > 0)
+        {
+            const Address16 function = p->NODES[stack[--depth]].function;
+            const char *name = m->IMAGE != NULL ? image_symbol(m->IMAGE, function * 2) : NULL;
+            if (name != NULL)
+            {
+                fprintf(fp, ";%s", name);
+            }
+            else
+            {
+                fprintf(fp, ";0x%04x", function);
+            }
+        }
+        fprintf(fp, " %" PRIu64 "\n", p->NODES[node].cycles);
+    }
+}
+
+/* Writes <prefix>.json, <prefix>.csv and <prefix>.folded, returns false if any
+   of them could not be written. */
+bool profile_write(Machine *m, const char prefix[])
+{
+    /* Charge the cycles of the last instruction. */
+    Profile *p = &m->PROFILER;
+    p->NODES[p->LAST_NODE].cycles += m->CYCLES - p->LAST_CYCLES;
+    p->LAST_CYCLES = m->CYCLES;
+
+    static const struct
+    {
+        const char *extension;
+        void (*write)(Machine *m, FILE *fp);
+    } OUTPUTS[] = {{"json", write_json}, {"csv", write_csv}, {"folded", write_collapsed}};
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(OUTPUTS) / sizeof(OUTPUTS[0]); i++)
+    {
+        char file_name[FILENAME_MAX];
+        snprintf(file_name, sizeof(file_name), "%s.%s", prefix, OUTPUTS[i].extension);
+        FILE *fp = fopen(file_name, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Unable to open profile output file %s.\n", file_name);
+            ok = false;
+            continue;
+        }
+        OUTPUTS[i].write(m, fp);
+        fclose(fp);
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __ATSIM_SYMBOLS
+#define __ATSIM_SYMBOLS
+
+/* When every MCU is built into one binary each core is compiled with its own
+   MCU_PREFIX, which is prepended to every external symbol so the cores can be
+   linked together. Anything new with external linkage needs adding here. */
+
+#ifdef MCU_PREFIX
+
+#define MCU_CONCAT_(a, b) a##b
+#define MCU_CONCAT(a, b) MCU_CONCAT_(a, b)
+#define MCU_SYMBOL(name) MCU_CONCAT(MCU_PREFIX, name)
+
+#define DECODED_HANDLER_COUNT MCU_SYMBOL(DECODED_HANDLER_COUNT)
+#define EXECUTE_HANDLERS MCU_SYMBOL(EXECUTE_HANDLERS)
+#define HANDLER_COUNT MCU_SYMBOL(HANDLER_COUNT)
+#define HANDLER_MNEMONICS MCU_SYMBOL(HANDLER_MNEMONICS)
+#define HANDLER_TABLE_HASH MCU_SYMBOL(HANDLER_TABLE_HASH)
+#define atsim_main MCU_SYMBOL(atsim_main)
+#define binding_cycles MCU_SYMBOL(binding_cycles)
+#define binding_free MCU_SYMBOL(binding_free)
+#define binding_memory MCU_SYMBOL(binding_memory)
+#define binding_new MCU_SYMBOL(binding_new)
+#define binding_pc MCU_SYMBOL(binding_pc)
+#define binding_read MCU_SYMBOL(binding_read)
+#define binding_run_batch MCU_SYMBOL(binding_run_batch)
+#define binding_set_pc MCU_SYMBOL(binding_set_pc)
+#define binding_set_sreg MCU_SYMBOL(binding_set_sreg)
+#define binding_sreg MCU_SYMBOL(binding_sreg)
+#define binding_state_free MCU_SYMBOL(binding_state_free)
+#define binding_state_new MCU_SYMBOL(binding_state_new)
+#define binding_write MCU_SYMBOL(binding_write)
+#define decode_and_execute_instruction MCU_SYMBOL(decode_and_execute_instruction)
+#define decode_instruction MCU_SYMBOL(decode_instruction)
+#define dump_registers MCU_SYMBOL(dump_registers)
+#define dump_stack MCU_SYMBOL(dump_stack)
+#define eeprom_event MCU_SYMBOL(eeprom_event)
+#define eeprom_map MCU_SYMBOL(eeprom_map)
+#define eeprom_reset MCU_SYMBOL(eeprom_reset)
+#define eeprom_unmap MCU_SYMBOL(eeprom_unmap)
+#define eeprom_write MCU_SYMBOL(eeprom_write)
+#define event_cancel MCU_SYMBOL(event_cancel)
+#define event_schedule MCU_SYMBOL(event_schedule)
+#define events_reset MCU_SYMBOL(events_reset)
+#define execute_predecoded_instruction MCU_SYMBOL(execute_predecoded_instruction)
+#define fast_forward MCU_SYMBOL(fast_forward)
+#define fetch_instruction MCU_SYMBOL(fetch_instruction)
+#define gdb_break MCU_SYMBOL(gdb_break)
+#define gdb_serve MCU_SYMBOL(gdb_serve)
+#define gpio_acknowledge MCU_SYMBOL(gpio_acknowledge)
+#define gpio_callback MCU_SYMBOL(gpio_callback)
+#define gpio_drive MCU_SYMBOL(gpio_drive)
+#define gpio_event MCU_SYMBOL(gpio_event)
+#define gpio_flush MCU_SYMBOL(gpio_flush)
+#define gpio_reset MCU_SYMBOL(gpio_reset)
+#define gpio_write MCU_SYMBOL(gpio_write)
+#define image_close MCU_SYMBOL(image_close)
+#define image_open MCU_SYMBOL(image_open)
+#define image_symbol MCU_SYMBOL(image_symbol)
+#define interactive_break MCU_SYMBOL(interactive_break)
+#define interactive_view MCU_SYMBOL(interactive_view)
+#define interrupts_request MCU_SYMBOL(interrupts_request)
+#define jit_invalidate MCU_SYMBOL(jit_invalidate)
+#define jit_reset MCU_SYMBOL(jit_reset)
+#define jit_run_block MCU_SYMBOL(jit_run_block)
+#define load_image MCU_SYMBOL(load_image)
+#define load_memory MCU_SYMBOL(load_memory)
+#define load_memory_from_file MCU_SYMBOL(load_memory_from_file)
+#define machine_copy MCU_SYMBOL(machine_copy)
+#define machine_cycle MCU_SYMBOL(machine_cycle)
+#define machine_restore MCU_SYMBOL(machine_restore)
+#define machine_unshare MCU_SYMBOL(machine_unshare)
+#define machine_sleep MCU_SYMBOL(machine_sleep)
+#define machine_snapshot MCU_SYMBOL(machine_snapshot)
+#define materialise_flags MCU_SYMBOL(materialise_flags)
+#define opcode_decodable MCU_SYMBOL(opcode_decodable)
+#define predecode_instruction MCU_SYMBOL(predecode_instruction)
+#define prepare_image MCU_SYMBOL(prepare_image)
+#define prepared_restore MCU_SYMBOL(prepared_restore)
+#define profile_call MCU_SYMBOL(profile_call)
+#define profile_reset MCU_SYMBOL(profile_reset)
+#define profile_write MCU_SYMBOL(profile_write)
+#define restore_machine_state MCU_SYMBOL(restore_machine_state)
+#define run_batch MCU_SYMBOL(run_batch)
+#define run_events MCU_SYMBOL(run_events)
+#define run_for_cycles MCU_SYMBOL(run_for_cycles)
+#define run_for_cycles_fastest MCU_SYMBOL(run_for_cycles_fastest)
+#define run_lockstep MCU_SYMBOL(run_lockstep)
+#define run_threaded_until_halt MCU_SYMBOL(run_threaded_until_halt)
+#define run_until_halt MCU_SYMBOL(run_until_halt)
+#define run_until_halt_jit MCU_SYMBOL(run_until_halt_jit)
+#define run_until_halt_loop MCU_SYMBOL(run_until_halt_loop)
+#define run_until_halt_threaded MCU_SYMBOL(run_until_halt_threaded)
+#define save_machine_state MCU_SYMBOL(save_machine_state)
+#define service_interrupt MCU_SYMBOL(service_interrupt)
+#define tests_main MCU_SYMBOL(tests_main)
+#define timer_acknowledge MCU_SYMBOL(timer_acknowledge)
+#define timer_event MCU_SYMBOL(timer_event)
+#define timer_read MCU_SYMBOL(timer_read)
+#define timer_set MCU_SYMBOL(timer_set)
+#define timer_write MCU_SYMBOL(timer_write)
+#define timers_reset MCU_SYMBOL(timers_reset)
+#define trace_close MCU_SYMBOL(trace_close)
+#define trace_open MCU_SYMBOL(trace_open)
+#define trace_submit_chunk MCU_SYMBOL(trace_submit_chunk)
+#define watch_breakpoint MCU_SYMBOL(watch_breakpoint)
+#define watch_data MCU_SYMBOL(watch_data)
+#define watch_reset MCU_SYMBOL(watch_reset)
+
+#endif
+
+#endif
@@ -0,0 +1,741 @@
+#define _DEFAULT_SOURCE
+#include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "machine.h"
+
+/* Runs instruction tests from their .test files and assembled programs, many
+   at once across threads, so the simulator only needs building once. Each
+   test's precondition and postcondition sections hold one condition a line:
+
+     R16 = 0x12        general purpose register
+     DATA[0x60] = 1    data space byte, including registers and IO
+     EEPROM[2] = 0xff  EEPROM byte
+     SREG = 0x80       status register, or SREG.I = 1 for a single flag
+     SP = 0x25f
+     PC = 3            word address
+     CYCLES = 11
+
+   With GPIO, preconditions can drive pins and postconditions check the pin
+   changes passed to the host, which is flushed at the end of the run:
+
+     DRIVE[100] = 0x0808  from cycle 100, driven << 8 | levels for gpio_drive
+     CHANGES = 2          the number of changes
+     CHANGE[0] = 0x0301   a change as DDRB << 8 | PORTB
+     CHANGE_CYCLE[0] = 3  the cycle of a change
+
+   Preconditions are set before running to a halt and postconditions are
+   expected afterwards. A requires section lists config options, one a line,
+   without which the test is skipped. A batch section holds preconditions
+   which instance i of a batch of TEST_BATCH_SIZE adds i to, after the rest.
+   The batch is run through run_batch and every instance expected to end as it
+   does run alone. "#" starts a comment. */
+
+#define TEST_LINE_SIZE 256
+#define TEST_MESSAGE_SIZE 256
+#define TEST_PATH_SIZE 4096
+#define TEST_MAX_CYCLES 10000000
+/* Enough instances for two full sets of lanes and a partial one. */
+#define TEST_BATCH_SIZE (BATCH_LANES * 2 + 3)
+#define TEST_BATCH_THREADS 2
+/* Pin changes are passed to the host in batches of up to this many cycles. */
+#define TEST_PIN_INTERVAL 100
+#define TEST_MAX_PIN_CHANGES 64
+
+static const char SREG_FLAG_NAMES[] = "CZNVSHTI";
+
+/* The options a test can require which are built in. */
+static const char *const TEST_OPTIONS[] = {
+#ifdef TIMERS
+    "TIMERS",
+#endif
+#ifdef INTERRUPTS
+    "INTERRUPTS",
+#endif
+#ifdef GPIO
+    "GPIO",
+#endif
+#ifdef FAST_FORWARD
+    "FAST_FORWARD",
+#endif
+#ifdef WATCHPOINTS
+    "WATCHPOINTS",
+#endif
+    NULL,
+};
+
+typedef enum
+{
+    TARGET_R,
+    TARGET_DATA,
+    TARGET_EEPROM,
+    TARGET_SREG,
+    TARGET_SREG_FLAG,
+    TARGET_SP,
+    TARGET_PC,
+    TARGET_CYCLES,
+#ifdef GPIO
+    TARGET_DRIVE,
+    TARGET_CHANGES,
+    TARGET_CHANGE,
+    TARGET_CHANGE_CYCLE,
+#endif
+} ConditionTarget;
+
+typedef struct
+{
+    ConditionTarget target;
+    uint32_t index;
+    uint64_t value;
+} Condition;
+
+#ifdef GPIO
+/* The pin changes passed to the host, the context of its callback. */
+typedef struct
+{
+    PinChange changes[TEST_MAX_PIN_CHANGES];
+    size_t n;
+} PinLog;
+#endif
+
+typedef enum
+{
+    SECTION_NONE,
+    SECTION_REQUIRES,
+    SECTION_PRECONDITION,
+    SECTION_POSTCONDITION,
+    SECTION_BATCH,
+} TestSection;
+
+typedef struct
+{
+    const char *path;
+    bool passed;
+    bool skipped;
+    char message[TEST_MESSAGE_SIZE];
+#ifdef GPIO
+    PinLog pins;
+#endif
+} TestCase;
+
+typedef struct
+{
+    TestCase *tests;
+    size_t n;
+    const char *bin_dir;
+    uint64_t max_cycles;
+    size_t next;
+    pthread_mutex_t lock;
+} TestRun;
+
+static bool parse_number(const char **text, uint64_t *value)
+{
+    char *end;
+    while (isspace((unsigned char)**text))
+    {
+        (*text)++;
+    }
+    if (!isdigit((unsigned char)**text))
+    {
+        return false;
+    }
+    *value = strtoull(*text, &end, 0);
+    *text = end;
+    return true;
+}
+
+static bool parse_target(const char **text, Condition *c)
+{
+    const char *p = *text;
+    uint64_t index = 0;
+#ifdef GPIO
+    if (strncmp(p, "DRIVE[", 6) == 0 || strncmp(p, "CHANGE[", 7) == 0 || strncmp(p, "CHANGE_CYCLE[", 13) == 0)
+    {
+        c->target = p[0] == 'D' ? TARGET_DRIVE : p[6] == '[' ? TARGET_CHANGE : TARGET_CHANGE_CYCLE;
+        p = strchr(p, '[') + 1;
+        const uint64_t limit = c->target == TARGET_DRIVE ? UINT32_MAX : TEST_MAX_PIN_CHANGES - 1;
+        if (!parse_number(&p, &index) || *p != ']' || index > limit)
+        {
+            return false;
+        }
+        c->index = index;
+        *text = p + 1;
+        return true;
+    }
+    if (strncmp(p, "CHANGES", 7) == 0)
+    {
+        c->target = TARGET_CHANGES;
+        c->index = 0;
+        *text = p + 7;
+        return true;
+    }
+#endif
+    if (strncmp(p, "DATA[", 5) == 0)
+    {
+        p += 5;
+        if (!parse_number(&p, &index) || *p != ']' || index >= DATA_MEM_SIZE)
+        {
+            return false;
+        }
+        c->target = TARGET_DATA;
+        p++;
+    }
+    else if (strncmp(p, "EEPROM[", 7) == 0)
+    {
+        p += 7;
+        if (!parse_number(&p, &index) || *p != ']' || index >= EEPROM_SIZE)
+        {
+            return false;
+        }
+        c->target = TARGET_EEPROM;
+        p++;
+    }
+    else if (strncmp(p, "SREG.", 5) == 0)
+    {
+        const char *flag = p[5] != '\0' ? strchr(SREG_FLAG_NAMES, p[5]) : NULL;
+        if (flag == NULL)
+        {
+            return false;
+        }
+        c->target = TARGET_SREG_FLAG;
+        index = flag - SREG_FLAG_NAMES;
+        p += 6;
+    }
+    else if (strncmp(p, "SREG", 4) == 0)
+    {
+        c->target = TARGET_SREG;
+        p += 4;
+    }
+    else if (strncmp(p, "SP", 2) == 0)
+    {
+        c->target = TARGET_SP;
+        p += 2;
+    }
+    else if (strncmp(p, "PC", 2) == 0)
+    {
+        c->target = TARGET_PC;
+        p += 2;
+    }
+    else if (strncmp(p, "CYCLES", 6) == 0)
+    {
+        c->target = TARGET_CYCLES;
+        p += 6;
+    }
+    else if (*p == 'R' && isdigit((unsigned char)p[1]))
+    {
+        p++;
+        if (!parse_number(&p, &index) || index >= GP_REGISTERS)
+        {
+            return false;
+        }
+        c->target = TARGET_R;
+    }
+    else
+    {
+        return false;
+    }
+    c->index = index;
+    *text = p;
+    return true;
+}
+
+/* Parses "TARGET = VALUE", returns false if the line isn't a condition. */
+static bool parse_condition(const char *line, Condition *c)
+{
+    if (!parse_target(&line, c))
+    {
+        return false;
+    }
+    while (isspace((unsigned char)*line))
+    {
+        line++;
+    }
+    if (*line++ != '=' || !parse_number(&line, &c->value))
+    {
+        return false;
+    }
+    while (isspace((unsigned char)*line))
+    {
+        line++;
+    }
+    return *line == '\0';
+}
+
+static uint64_t condition_value(Machine *m, const Condition *c)
+{
+    switch (c->target)
+    {
+    case TARGET_R:
+        return m->R[c->index];
+    case TARGET_DATA:
+        return GetDataMem(m, c->index);
+    case TARGET_EEPROM:
+        return GetEEPROM(m, c->index);
+    case TARGET_SREG:
+        return PackSREG(m);
+    case TARGET_SREG_FLAG:
+        return GetStatusFlag(m, c->index);
+    case TARGET_SP:
+        return GetSP(m);
+    case TARGET_PC:
+        return GetPC(m);
+    case TARGET_CYCLES:
+        return m->CYCLES;
+#ifdef GPIO
+    case TARGET_DRIVE:
+        break;
+    case TARGET_CHANGES:
+        return ((const PinLog *)m->PINS.CONTEXT)->n;
+    case TARGET_CHANGE:
+    {
+        const PinChange *change = &((const PinLog *)m->PINS.CONTEXT)->changes[c->index];
+        return change->ddr << 8 | change->port;
+    }
+    case TARGET_CHANGE_CYCLE:
+        return ((const PinLog *)m->PINS.CONTEXT)->changes[c->index].cycle;
+#endif
+    }
+    return 0;
+}
+
+static void set_condition(Machine *m, const Condition *c)
+{
+    switch (c->target)
+    {
+    case TARGET_R:
+        m->R[c->index] = c->value;
+        break;
+    case TARGET_DATA:
+        SetDataMem(m, c->index, c->value);
+        break;
+    case TARGET_EEPROM:
+        SetEEPROM(m, c->index, c->value);
+        break;
+    case TARGET_SREG:
+        UnpackSREG(m, c->value);
+        break;
+    case TARGET_SREG_FLAG:
+        if (c->value)
+        {
+            SetStatusFlag(m, c->index);
+        }
+        else
+        {
+            ClearStatusFlag(m, c->index);
+        }
+        break;
+    case TARGET_SP:
+        SetSP(m, c->value);
+        break;
+    case TARGET_PC:
+        SetPC(m, c->value);
+        break;
+    case TARGET_CYCLES:
+        m->CYCLES = c->value;
+        break;
+#ifdef GPIO
+    case TARGET_DRIVE:
+        gpio_drive(m, c->index, c->value >> 8, c->value & 0xff);
+        break;
+    case TARGET_CHANGES:
+    case TARGET_CHANGE:
+    case TARGET_CHANGE_CYCLE:
+        break;
+#endif
+    }
+}
+
+static char *trim(char *line)
+{
+    char *end = line + strlen(line);
+    while (end > line && isspace((unsigned char)end[-1]))
+    {
+        *--end = '\0';
+    }
+    while (isspace((unsigned char)*line))
+    {
+        line++;
+    }
+    return line;
+}
+
+/* The program for "dir/name.test" is read from "bin_dir/name.bin". */
+static bool test_binary_path(const char *test_path, const char *bin_dir, char path[TEST_PATH_SIZE])
+{
+    const char *slash = strrchr(test_path, '/');
+    const char *name = slash != NULL ? slash + 1 : test_path;
+    const char *dot = strrchr(name, '.');
+    const int name_length = dot != NULL ? (int)(dot - name) : (int)strlen(name);
+    const int length = bin_dir != NULL ? snprintf(path, TEST_PATH_SIZE, "%s/%.*s.bin", bin_dir, name_length, name)
+                                       : snprintf(path, TEST_PATH_SIZE, "%.*s%.*s.bin", (int)(name - test_path),
+                                                  test_path, name_length, name);
+    return length > 0 && length < TEST_PATH_SIZE;
+}
+
+static bool option_built(const char *option)
+{
+    for (size_t i = 0; TEST_OPTIONS[i] != NULL; i++)
+    {
+        if (strcmp(option, TEST_OPTIONS[i]) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The section a "---" line starts, with the dashes already skipped. */
+static TestSection parse_section(char *line)
+{
+    line = trim(line);
+    return strcmp(line, "requires") == 0        ? SECTION_REQUIRES
+           : strcmp(line, "precondition") == 0  ? SECTION_PRECONDITION
+           : strcmp(line, "postcondition") == 0 ? SECTION_POSTCONDITION
+           : strcmp(line, "batch") == 0         ? SECTION_BATCH
+                                                : SECTION_NONE;
+}
+
+static bool has_section(FILE *fp, TestSection wanted)
+{
+    char buffer[TEST_LINE_SIZE];
+    rewind(fp);
+    while (fgets(buffer, sizeof(buffer), fp) != NULL)
+    {
+        char *line = trim(buffer);
+        if (strncmp(line, "---", 3) == 0 && parse_section(line + 3) == wanted)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Applies every precondition, or batch precondition with offset added,
+   checks every postcondition or checks every requirement in the file. A
+   missing requirement skips the test. */
+static bool apply_conditions(Machine *m, FILE *fp, TestSection wanted, uint64_t offset, TestCase *t)
+{
+    char buffer[TEST_LINE_SIZE];
+    TestSection section = SECTION_NONE;
+    size_t line_number = 0;
+    rewind(fp);
+    while (fgets(buffer, sizeof(buffer), fp) != NULL)
+    {
+        line_number++;
+        char *comment = strchr(buffer, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+        char *line = trim(buffer);
+        if (strncmp(line, "---", 3) == 0)
+        {
+            section = parse_section(line + 3);
+            continue;
+        }
+        if (section != wanted || *line == '\0')
+        {
+            continue;
+        }
+        if (wanted == SECTION_REQUIRES)
+        {
+            if (!option_built(line))
+            {
+                snprintf(t->message, sizeof(t->message), "requires %s", line);
+                t->skipped = true;
+                return false;
+            }
+            continue;
+        }
+        Condition c;
+        if (!parse_condition(line, &c))
+        {
+            snprintf(t->message, sizeof(t->message), "line %zu: invalid condition: %s", line_number, line);
+            return false;
+        }
+        if (wanted == SECTION_PRECONDITION || wanted == SECTION_BATCH)
+        {
+            c.value += offset;
+            set_condition(m, &c);
+            continue;
+        }
+        const uint64_t actual = condition_value(m, &c);
+        if (actual != c.value)
+        {
+            snprintf(t->message, sizeof(t->message), "line %zu: expected %s, got 0x%" PRIx64, line_number, line,
+                     actual);
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef GPIO
+static void record_pins(void *context, const PinChange changes[], size_t n)
+{
+    PinLog *log = context;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (log->n < TEST_MAX_PIN_CHANGES)
+        {
+            log->changes[log->n] = changes[i];
+        }
+        log->n++;
+    }
+}
+#endif
+
+/* Loads the program and applies the preconditions. */
+static bool load_test(Machine *m, FILE *fp, const char *bin_path, TestCase *t)
+{
+    memset(m, 0, sizeof(Machine));
+    if (!load_memory_from_file(m, bin_path))
+    {
+        snprintf(t->message, sizeof(t->message), "unable to load program");
+        return false;
+    }
+    m->PC = 0;
+    m->SKIP = false;
+    m->CYCLES = 0;
+#ifdef GPIO
+    t->pins.n = 0;
+    gpio_callback(m, record_pins, &t->pins, TEST_PIN_INTERVAL);
+#endif
+    return apply_conditions(m, fp, SECTION_PRECONDITION, 0, t);
+}
+
+/* The first part of a batch instance's state which differs from running it
+   alone, or NULL if none do. */
+static const char *batch_difference(const MachineState *batch, const MachineState *alone)
+{
+    if (batch->PC != alone->PC || batch->SKIP != alone->SKIP || batch->HALTED != alone->HALTED)
+    {
+        return "PC";
+    }
+    if (batch->CYCLES != alone->CYCLES)
+    {
+        return "CYCLES";
+    }
+    if (batch->SREG != alone->SREG)
+    {
+        return "SREG";
+    }
+    if (memcmp(batch->R, alone->R, sizeof(batch->R)) != 0 || memcmp(batch->IO, alone->IO, sizeof(batch->IO)) != 0)
+    {
+        return "registers";
+    }
+    if (memcmp(batch->SRAM, alone->SRAM, sizeof(batch->SRAM)) != 0)
+    {
+        return "SRAM";
+    }
+    if (memcmp(batch->EEPROM, alone->EEPROM, sizeof(batch->EEPROM)) != 0)
+    {
+        return "EEPROM";
+    }
+    return NULL;
+}
+
+/* Runs every instance alone, then all of them through run_batch. */
+static bool run_batch_test(Machine *m, FILE *fp, const char *bin_path, TestCase *t, uint64_t max_cycles)
+{
+    MachineState *states = malloc(TEST_BATCH_SIZE * 2 * sizeof(MachineState));
+    MachineState *alone = states + TEST_BATCH_SIZE;
+    bool passed = states != NULL;
+    for (size_t i = 0; passed && i < TEST_BATCH_SIZE; i++)
+    {
+        passed = load_test(m, fp, bin_path, t) && apply_conditions(m, fp, SECTION_BATCH, i, t);
+        save_machine_state(m, &states[i]);
+        alone[i].HALTED = run_for_cycles(m, max_cycles);
+        save_machine_state(m, &alone[i]);
+    }
+    passed = passed && load_test(m, fp, bin_path, t);
+    if (passed && !run_batch(m, states, TEST_BATCH_SIZE, max_cycles, TEST_BATCH_THREADS))
+    {
+        snprintf(t->message, sizeof(t->message), "unable to run batch");
+        passed = false;
+    }
+#ifdef GPIO
+    /* The image's callback is its own, not its instances'. */
+    gpio_flush(m);
+    if (passed && t->pins.n != 0)
+    {
+        snprintf(t->message, sizeof(t->message), "batch pin changes passed to the image's callback");
+        passed = false;
+    }
+#endif
+    for (size_t i = 0; passed && i < TEST_BATCH_SIZE; i++)
+    {
+        const char *difference = batch_difference(&states[i], &alone[i]);
+        if (difference != NULL)
+        {
+            snprintf(t->message, sizeof(t->message), "batch instance %zu: %s not as when run alone", i,
+                     difference);
+            passed = false;
+        }
+    }
+    free(states);
+    return passed;
+}
+
+static bool run_test(Machine *m, TestCase *t, const char *bin_dir, uint64_t max_cycles)
+{
+    char bin_path[TEST_PATH_SIZE];
+    if (!test_binary_path(t->path, bin_dir, bin_path))
+    {
+        snprintf(t->message, sizeof(t->message), "path too long");
+        return false;
+    }
+    FILE *fp = fopen(t->path, "r");
+    if (fp == NULL)
+    {
+        snprintf(t->message, sizeof(t->message), "unable to open test");
+        return false;
+    }
+    if (!apply_conditions(m, fp, SECTION_REQUIRES, 0, t))
+    {
+        fclose(fp);
+        return t->skipped;
+    }
+
+    bool passed = load_test(m, fp, bin_path, t);
+    if (passed && !run_for_cycles(m, max_cycles))
+    {
+        snprintf(t->message, sizeof(t->message), "no halt within %" PRIu64 " cycles", max_cycles);
+        passed = false;
+    }
+#ifdef GPIO
+    gpio_flush(m);
+#endif
+    if (passed)
+    {
+        passed = apply_conditions(m, fp, SECTION_POSTCONDITION, 0, t);
+    }
+    if (passed && has_section(fp, SECTION_BATCH))
+    {
+        passed = run_batch_test(m, fp, bin_path, t, max_cycles);
+    }
+    fclose(fp);
+    return passed;
+}
+
+static void *test_worker(void *arg)
+{
+    TestRun *run = arg;
+    /* Machines are too large for thread stacks, and zeroed for reset_program. */
+    Machine *m = calloc(1, MACHINE_SIZE);
+    if (m == NULL)
+    {
+        return NULL;
+    }
+    while (true)
+    {
+        pthread_mutex_lock(&run->lock);
+        const size_t i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->n)
+        {
+            break;
+        }
+        run->tests[i].passed = run_test(m, &run->tests[i], run->bin_dir, run->max_cycles);
+    }
+    free(m);
+    return NULL;
+}
+
+static size_t run_tests(TestRun *run, size_t threads)
+{
+    if (threads == 0)
+    {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+    }
+    threads = threads < run->n ? threads : run->n;
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    size_t started = 0;
+    pthread_mutex_init(&run->lock, NULL);
+    while (workers != NULL && started < threads && pthread_create(&workers[started], NULL, test_worker, run) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        /* Run on this thread instead. */
+        test_worker(run);
+    }
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&run->lock);
+    free(workers);
+
+    size_t failures = 0;
+    for (size_t i = 0; i < run->n; i++)
+    {
+        const TestCase *t = &run->tests[i];
+        if (t->skipped)
+        {
+            printf("%03zu/%03zu %s SKIPPED\n  %s\n", i + 1, run->n, t->path, t->message);
+        }
+        else if (t->passed)
+        {
+            printf("%03zu/%03zu %s SUCCESS\n", i + 1, run->n, t->path);
+        }
+        else
+        {
+            printf("%03zu/%03zu %s FAILURE\n  %s\n", i + 1, run->n, t->path,
+                   t->message[0] != '\0' ? t->message : "not run");
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/* Called by main in main.c when built as the test runner, with the MCU already
+   chosen. Takes the .test files to run, which are all run even if some fail. */
+int tests_main(int argc, char *argv[])
+{
+    TestRun run = {.tests = NULL, .n = 0, .bin_dir = NULL, .max_cycles = TEST_MAX_CYCLES, .next = 0};
+    size_t threads = 0;
+    run.tests = calloc(argc > 0 ? argc : 1, sizeof(TestCase));
+    if (run.tests == NULL)
+    {
+        return 2;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--threads") == 0 && has_value)
+        {
+            threads = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "--bin-dir") == 0 && has_value)
+        {
+            run.bin_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-cycles") == 0 && has_value)
+        {
+            run.max_cycles = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "Usage: %s [--mcu MCU] [--threads N] [--bin-dir DIR] [--max-cycles N] TEST...\n",
+                    argv[0]);
+            free(run.tests);
+            return 2;
+        }
+        else
+        {
+            run.tests[run.n++].path = argv[i];
+        }
+    }
+
+    const size_t failures = run.n > 0 ? run_tests(&run, threads) : 0;
+    printf("%zu/%zu tests passed\n", run.n - failures, run.n);
+    free(run.tests);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,340 @@
+#include "machine.h"
+
+#ifdef TIMERS
+
+/* Timer/counter 0 and 1 of the ATtiny25/45/85. Rather than ticking with every
+   instruction, a timer records the cycle it was last brought up to date and
+   catches up when one of its registers is accessed or its next event is due.
+
+   A timer's position is kept as a phase within its period, which for dual
+   slope (phase correct) counting covers both the up and down slopes. Events
+   are the phases at which a flag in TIFR is set, so catching up over any
+   number of counts is a few comparisons. The prescaler runs freely from
+   cycle 0, as GTCCR prescaler resets and external clocks aren't modelled.
+   Output compare pins and OCR double buffering aren't modelled either. */
+
+#define TOV0 1
+#define TOV1 2
+#define OCF0B 3
+#define OCF0A 4
+#define OCF1B 5
+#define OCF1A 6
+#define CTC1 7
+#define PWM1A 6
+#define PWM1B 6
+
+#define TIMER_MAX 0xff
+#define TIMER_MAX_EVENTS 5
+
+typedef struct
+{
+    uint16_t phase;
+    uint8_t flag;
+} TimerEvent;
+
+/* How a timer counts with the current contents of its registers. */
+typedef struct
+{
+    uint32_t prescale;
+    uint8_t top;
+    bool dual_slope;
+    uint16_t period;
+    uint8_t count_address;
+    uint8_t overflow_flag;
+    TimerEvent events[TIMER_MAX_EVENTS];
+    uint8_t event_count;
+} TimerMode;
+
+static const uint16_t TIMER0_PRESCALE[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+#ifdef INTERRUPTS
+/* The vector of each flag in TIFR, whose enable bit in TIMSK is in the same
+   position. */
+static const uint8_t TIMER_VECTORS[8] = {[TOV0] = VECTOR_TIMER0_OVF,     [TOV1] = VECTOR_TIMER1_OVF,
+                                         [OCF0B] = VECTOR_TIMER0_COMPB, [OCF0A] = VECTOR_TIMER0_COMPA,
+                                         [OCF1B] = VECTOR_TIMER1_COMPB, [OCF1A] = VECTOR_TIMER1_COMPA};
+#define TIMER_FLAGS 0x7e
+#endif
+
+static void add_event(TimerMode *t, uint16_t phase, uint8_t flag)
+{
+    t->events[t->event_count++] = (TimerEvent){phase, flag};
+}
+
+/* Compare matches happen on both slopes when dual slope counting. */
+static void add_compare(TimerMode *t, uint8_t value, uint8_t flag)
+{
+    if (value > t->top)
+    {
+        return;
+    }
+    add_event(t, value, flag);
+    if (t->dual_slope && value != 0 && value != t->top)
+    {
+        add_event(t, 2 * t->top - value, flag);
+    }
+}
+
+static TimerMode timer_mode(Machine *m, EventSource source)
+{
+    TimerMode t = {0};
+    if (source == EVENT_TIMER0)
+    {
+        const uint8_t wgm = (m->IO[TCCR0A_IO_ADDRESS] & 0x3) | ((m->IO[TCCR0B_IO_ADDRESS] >> 1) & 0x4);
+        t.prescale = TIMER0_PRESCALE[m->IO[TCCR0B_IO_ADDRESS] & 0x7];
+        t.top = wgm == 2 || wgm == 5 || wgm == 7 ? m->IO[OCR0A_IO_ADDRESS] : TIMER_MAX;
+        t.dual_slope = wgm == 1 || wgm == 5;
+        t.count_address = TCNT0_IO_ADDRESS;
+        t.overflow_flag = TOV0;
+        add_compare(&t, m->IO[OCR0A_IO_ADDRESS], OCF0A);
+        add_compare(&t, m->IO[OCR0B_IO_ADDRESS], OCF0B);
+        /* Overflow is at TOP in fast PWM and at BOTTOM otherwise, but in CTC
+           only when counting past MAX. */
+        if (wgm == 3 || wgm == 7)
+        {
+            add_event(&t, t.top, TOV0);
+        }
+        else if (t.dual_slope || t.top == TIMER_MAX)
+        {
+            add_event(&t, 0, TOV0);
+        }
+    }
+    else
+    {
+        const uint8_t cs = m->IO[TCCR1_IO_ADDRESS] & 0xf;
+        const bool clear_on_c = TestBit(m->IO[TCCR1_IO_ADDRESS], CTC1) || TestBit(m->IO[TCCR1_IO_ADDRESS], PWM1A) ||
+                                TestBit(m->IO[GTCCR_IO_ADDRESS], PWM1B);
+        t.prescale = cs == 0 ? 0 : UINT32_C(1) << (cs - 1);
+        t.top = clear_on_c ? m->IO[OCR1C_IO_ADDRESS] : TIMER_MAX;
+        t.count_address = TCNT1_IO_ADDRESS;
+        t.overflow_flag = TOV1;
+        add_compare(&t, m->IO[OCR1A_IO_ADDRESS], OCF1A);
+        add_compare(&t, m->IO[OCR1B_IO_ADDRESS], OCF1B);
+        add_event(&t, 0, TOV1);
+    }
+    t.period = t.dual_slope ? 2 * t.top : t.top + 1;
+    if (t.period == 0)
+    {
+        t.period = 1;
+    }
+    return t;
+}
+
+static uint16_t timer_phase(const TimerMode *t, uint8_t count, bool down)
+{
+    return t->dual_slope && down && count > 0 && count < t->top ? 2 * t->top - count : count;
+}
+
+/* Counts from phase until an event at target, between 1 and a whole period. */
+static uint16_t counts_to(uint16_t phase, uint16_t target, uint16_t period)
+{
+    return (target + period - phase - 1) % period + 1;
+}
+
+static void timer_update(Machine *m, EventSource source)
+{
+    Timer *timer = &m->PERIPHERALS.TIMER[source];
+    const TimerMode t = timer_mode(m, source);
+    uint64_t n = 0;
+    if (t.prescale != 0 && m->CYCLES > timer->LAST_UPDATE)
+    {
+        n = m->CYCLES / t.prescale - timer->LAST_UPDATE / t.prescale;
+    }
+    timer->LAST_UPDATE = m->CYCLES;
+    if (n == 0)
+    {
+        return;
+    }
+
+    /* A count written above TOP runs on to MAX and wraps before rejoining the
+       period, overflowing on the way. */
+    uint8_t count = m->IO[t.count_address];
+    if (count > t.top)
+    {
+        const unsigned to_wrap = TIMER_MAX + 1 - count;
+        if (n < to_wrap)
+        {
+            m->IO[t.count_address] = count + n;
+            return;
+        }
+        n -= to_wrap;
+        count = 0;
+        timer->DOWN = false;
+        m->IO[TIFR_IO_ADDRESS] = SetBit(m->IO[TIFR_IO_ADDRESS], t.overflow_flag);
+        for (uint8_t i = 0; i < t.event_count; i++)
+        {
+            if (t.events[i].phase == 0)
+            {
+                m->IO[TIFR_IO_ADDRESS] = SetBit(m->IO[TIFR_IO_ADDRESS], t.events[i].flag);
+            }
+        }
+    }
+
+    const uint16_t phase = timer_phase(&t, count, timer->DOWN);
+    for (uint8_t i = 0; i < t.event_count; i++)
+    {
+        if (counts_to(phase, t.events[i].phase, t.period) <= n)
+        {
+            m->IO[TIFR_IO_ADDRESS] = SetBit(m->IO[TIFR_IO_ADDRESS], t.events[i].flag);
+        }
+    }
+    const uint16_t next = (phase + n % t.period) % t.period;
+    timer->DOWN = t.dual_slope && next >= t.top;
+    m->IO[t.count_address] = next > t.top ? 2 * t.top - next : next;
+}
+
+/* Schedules the next event which would set a flag that isn't already set, so
+   a timer whose flags are all set costs nothing until they're cleared. */
+static void timer_schedule(Machine *m, EventSource source)
+{
+    const Timer *timer = &m->PERIPHERALS.TIMER[source];
+    const TimerMode t = timer_mode(m, source);
+    const uint8_t count = m->IO[t.count_address];
+    uint32_t counts = UINT32_MAX;
+    if (t.prescale != 0)
+    {
+        /* From above TOP, the period is rejoined at phase 0 after the wrap. */
+        uint16_t phase = timer_phase(&t, count, timer->DOWN);
+        uint32_t to_period = 0;
+        if (count > t.top)
+        {
+            phase = 0;
+            to_period = TIMER_MAX + 1 - count;
+            if (!TestBit(m->IO[TIFR_IO_ADDRESS], t.overflow_flag))
+            {
+                counts = to_period;
+            }
+        }
+        for (uint8_t i = 0; i < t.event_count; i++)
+        {
+            uint32_t to_event = counts_to(phase, t.events[i].phase, t.period);
+            if (to_period != 0)
+            {
+                to_event = to_period + to_event % t.period;
+            }
+            if (!TestBit(m->IO[TIFR_IO_ADDRESS], t.events[i].flag) && to_event < counts)
+            {
+                counts = to_event;
+            }
+        }
+    }
+
+    if (counts == UINT32_MAX)
+    {
+        event_cancel(m, source);
+        return;
+    }
+    event_schedule(m, source, (timer->LAST_UPDATE / t.prescale + counts) * t.prescale);
+}
+
+/* Requests the vector of every enabled flag which is set. */
+static void timers_request(Machine *m)
+{
+#ifdef INTERRUPTS
+    const uint8_t requested = m->IO[TIFR_IO_ADDRESS] & m->IO[TIMSK_IO_ADDRESS];
+    uint16_t vectors = 0;
+    uint16_t pending = 0;
+    for (uint8_t flag = 0; flag < 8; flag++)
+    {
+        if (TestBit(TIMER_FLAGS, flag))
+        {
+            vectors |= UINT16_C(1) << TIMER_VECTORS[flag];
+            pending |= (uint16_t)GetBit(requested, flag) << TIMER_VECTORS[flag];
+        }
+    }
+    interrupts_request(m, vectors, pending);
+#else
+    UNUSED(m);
+#endif
+}
+
+static void timers_update(Machine *m)
+{
+    timer_update(m, EVENT_TIMER0);
+    timer_update(m, EVENT_TIMER1);
+}
+
+static void timers_schedule(Machine *m)
+{
+    timer_schedule(m, EVENT_TIMER0);
+    timer_schedule(m, EVENT_TIMER1);
+    timers_request(m);
+}
+
+void timers_reset(Machine *m)
+{
+    events_reset(m);
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        m->PERIPHERALS.TIMER[i].LAST_UPDATE = m->CYCLES;
+        m->PERIPHERALS.TIMER[i].DOWN = false;
+    }
+    timers_schedule(m);
+}
+
+void timer_event(Machine *m, EventSource source)
+{
+    timer_update(m, source);
+    timer_schedule(m, source);
+    timers_request(m);
+}
+
+Mem8 timer_read(Machine *m, uint8_t a)
+{
+    timers_update(m);
+    timers_request(m);
+    return m->IO[a];
+}
+
+/* Both timers are brought up to date under their old settings before a write
+   takes effect, as TIFR, TIMSK and GTCCR are shared between them. */
+static void timer_store(Machine *m, uint8_t a, Mem8 v)
+{
+    m->IO[a] = v;
+    if (a == TCNT0_IO_ADDRESS || a == TCNT1_IO_ADDRESS)
+    {
+        m->PERIPHERALS.TIMER[a == TCNT0_IO_ADDRESS ? EVENT_TIMER0 : EVENT_TIMER1].DOWN = false;
+    }
+}
+
+void timer_write(Machine *m, uint8_t a, Mem8 v)
+{
+    timers_update(m);
+    if (a == TIFR_IO_ADDRESS)
+    {
+        /* Flags are cleared by writing a one to them. */
+        m->IO[a] &= ~v;
+    }
+    else
+    {
+        timer_store(m, a, v);
+    }
+    timers_schedule(m);
+}
+
+/* A write by the debugger, which stores v as it is, so TIFR flags can be set
+   as well as cleared. */
+void timer_set(Machine *m, uint8_t a, Mem8 v)
+{
+    timers_update(m);
+    timer_store(m, a, v);
+    timers_schedule(m);
+    timers_request(m);
+}
+
+#ifdef INTERRUPTS
+/* Entering a timer's vector clears the flag which requested it. */
+void timer_acknowledge(Machine *m, InterruptVector vector)
+{
+    for (uint8_t flag = 0; flag < 8; flag++)
+    {
+        if (TestBit(TIMER_FLAGS, flag) && TIMER_VECTORS[flag] == vector)
+        {
+            timer_write(m, TIFR_IO_ADDRESS, 1 << flag);
+            return;
+        }
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include "machine.h"
+
+#ifdef TRACE
+
+/* Trace files start with TRACE_MAGIC followed by a format byte, then either
+   fixed size little endian records or, when compressed, variable length
+   records of zigzag varint deltas. See decode_trace.py for the reader. */
+
+#define TRACE_MAGIC "ATTRACE"
+#define TRACE_FORMAT_RAW 'R'
+#define TRACE_FORMAT_DELTA 'D'
+
+/* Largest possible encoded record, in either format. */
+#define TRACE_RECORD_MAX 16
+
+typedef struct
+{
+    uint16_t pc;
+    uint16_t address;
+} TraceDeltas;
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+    *p++ = v & 0xff;
+    *p++ = v >> 8;
+    return p;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static uint8_t *encode_raw(uint8_t *p, const TraceRecord *r)
+{
+    p = put_u16(p, r->pc);
+    p = put_u16(p, r->opcode);
+    p = put_u16(p, r->address);
+    p = put_u16(p, r->value);
+    *p++ = r->sreg;
+    *p++ = r->width;
+    *p++ = r->cycles;
+    *p++ = 0;
+    return p;
+}
+
+/* PC is stored relative to the instruction following the previous one, and
+   the write address relative to the previous write. */
+static uint8_t *encode_delta(uint8_t *p, const TraceRecord *r, TraceDeltas *last)
+{
+    p = put_varint(p, zigzag((int32_t)r->pc - (int32_t)last->pc));
+    p = put_varint(p, r->opcode);
+    *p++ = r->sreg;
+    *p++ = (r->width & 0x3) | (r->cycles << 2);
+    if (r->width != 0)
+    {
+        p = put_varint(p, zigzag((int32_t)r->address - (int32_t)last->address));
+        p = put_varint(p, r->value);
+        last->address = r->address;
+    }
+    last->pc = r->pc + 1;
+    return p;
+}
+
+static void *trace_writer(void *arg)
+{
+    TraceSink *t = arg;
+    uint8_t *const buffer = malloc(TRACE_CHUNK_RECORDS * TRACE_RECORD_MAX);
+    TraceDeltas last = {0, 0};
+
+    pthread_mutex_lock(&t->lock);
+    while (true)
+    {
+        while (t->written == t->filled && !t->closing)
+        {
+            pthread_cond_wait(&t->changed, &t->lock);
+        }
+        if (t->written == t->filled)
+        {
+            break;
+        }
+        const size_t chunk = t->written % TRACE_CHUNKS;
+        pthread_mutex_unlock(&t->lock);
+
+        uint8_t *p = buffer;
+        for (size_t i = 0; buffer != NULL && i < t->sizes[chunk]; i++)
+        {
+            const TraceRecord *r = &t->chunks[chunk][i];
+            p = t->compress ? encode_delta(p, r, &last) : encode_raw(p, r);
+        }
+        const bool failed = buffer == NULL || fwrite(buffer, 1, p - buffer, t->fp) != (size_t)(p - buffer);
+
+        pthread_mutex_lock(&t->lock);
+        t->failed = t->failed || failed;
+        t->written++;
+        pthread_cond_broadcast(&t->changed);
+    }
+    pthread_mutex_unlock(&t->lock);
+    free(buffer);
+    return NULL;
+}
+
+void trace_submit_chunk(TraceSink *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->sizes[t->filled % TRACE_CHUNKS] = t->fill;
+    t->filled++;
+    t->fill = 0;
+    pthread_cond_broadcast(&t->changed);
+    /* Only block the simulation once every chunk is waiting to be written. */
+    while (t->filled - t->written == TRACE_CHUNKS)
+    {
+        pthread_cond_wait(&t->changed, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+TraceSink *trace_open(const char file_name[], bool compress)
+{
+    TraceSink *t = calloc(1, sizeof(TraceSink));
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < TRACE_CHUNKS; i++)
+    {
+        if (NULL == (t->chunks[i] = malloc(TRACE_CHUNK_RECORDS * sizeof(TraceRecord))))
+        {
+            while (i > 0)
+            {
+                free(t->chunks[--i]);
+            }
+            free(t);
+            return NULL;
+        }
+    }
+    if (NULL == (t->fp = fopen(file_name, "wb")))
+    {
+        fputs("Unable to open trace file.\n", stderr);
+        for (size_t i = 0; i < TRACE_CHUNKS; i++)
+        {
+            free(t->chunks[i]);
+        }
+        free(t);
+        return NULL;
+    }
+    t->compress = compress;
+    fputs(TRACE_MAGIC, t->fp);
+    fputc(compress ? TRACE_FORMAT_DELTA : TRACE_FORMAT_RAW, t->fp);
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->changed, NULL);
+    if (pthread_create(&t->writer, NULL, trace_writer, t) != 0)
+    {
+        t->closing = true;
+        trace_close(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Write out any remaining records and close the file, returns false if any of
+   the trace could not be written. */
+bool trace_close(TraceSink *t)
+{
+    if (t->fill > 0)
+    {
+        trace_submit_chunk(t);
+    }
+    pthread_mutex_lock(&t->lock);
+    const bool started = !t->closing;
+    t->closing = true;
+    pthread_cond_broadcast(&t->changed);
+    pthread_mutex_unlock(&t->lock);
+    if (started)
+    {
+        pthread_join(t->writer, NULL);
+    }
+
+    const bool closed = fclose(t->fp) == 0;
+    const bool ok = closed && !t->failed;
+    pthread_cond_destroy(&t->changed);
+    pthread_mutex_destroy(&t->lock);
+    for (size_t i = 0; i < TRACE_CHUNKS; i++)
+    {
+        free(t->chunks[i]);
+    }
+    free(t);
+    return ok;
+}
+
+#endif
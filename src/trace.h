@@ -0,0 +1,57 @@
+#ifndef __ATSIM_TRACE
+#define __ATSIM_TRACE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* One executed instruction. Address is the data space address of the last
+   register or memory write the instruction made, for width bytes. */
+typedef struct
+{
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t address;
+    uint16_t value;
+    uint8_t sreg;
+    uint8_t width;
+    uint8_t cycles;
+    uint8_t reserved;
+} TraceRecord;
+
+#define TRACE_CHUNK_RECORDS 4096
+#define TRACE_CHUNKS 8
+
+/* Records are filled into chunks by the simulating thread without locking and
+   written out a chunk at a time by a background writer thread. */
+typedef struct
+{
+    FILE *fp;
+    bool compress;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    TraceRecord *chunks[TRACE_CHUNKS];
+    size_t sizes[TRACE_CHUNKS];
+    size_t filled;
+    size_t written;
+    size_t fill;
+    bool closing;
+    bool failed;
+} TraceSink;
+
+TraceSink *trace_open(const char file_name[], bool compress);
+bool trace_close(TraceSink *t);
+void trace_submit_chunk(TraceSink *t);
+
+static inline void trace_push(TraceSink *t, const TraceRecord *r)
+{
+    t->chunks[t->filled % TRACE_CHUNKS][t->fill++] = *r;
+    if (t->fill == TRACE_CHUNK_RECORDS)
+    {
+        trace_submit_chunk(t);
+    }
+}
+
+#endif
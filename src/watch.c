@@ -0,0 +1,68 @@
+#include <string.h>
+#include "machine.h"
+
+/* Breakpoints and watchpoints, kept as bitmaps in the machine. The run loops
+   only look at them while WATCHING is set, so a build with WATCHPOINTS but
+   nothing armed pays a single test per instruction and data access. */
+
+#ifdef WATCHPOINTS
+
+static bool any_armed(const uint64_t bits[], size_t words)
+{
+    for (size_t i = 0; i < words; i++)
+    {
+        if (bits[i] != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void update_watching(Machine *m)
+{
+    m->WATCHING = any_armed(m->BREAKPOINTS, WATCH_WORDS(PROG_MEM_SIZE)) ||
+                  any_armed(m->READ_WATCHES, WATCH_WORDS(DATA_MEM_SIZE)) ||
+                  any_armed(m->WRITE_WATCHES, WATCH_WORDS(DATA_MEM_SIZE));
+    if (!m->WATCHING)
+    {
+        /* Nothing would clear the last hit once the run loops stop looking. */
+        m->WATCH_HIT = (WatchHit){.kind = WATCH_NONE, .pending = false, .address = 0};
+    }
+}
+
+static void set_watch(uint64_t bits[], Address16 a, bool armed)
+{
+    if (armed)
+    {
+        bits[a / 64] |= UINT64_C(1) << (a % 64);
+    }
+    else
+    {
+        bits[a / 64] &= ~(UINT64_C(1) << (a % 64));
+    }
+}
+
+void watch_reset(Machine *m)
+{
+    memset(m->BREAKPOINTS, 0, sizeof(m->BREAKPOINTS));
+    memset(m->READ_WATCHES, 0, sizeof(m->READ_WATCHES));
+    memset(m->WRITE_WATCHES, 0, sizeof(m->WRITE_WATCHES));
+    m->WATCH_HIT = (WatchHit){.kind = WATCH_NONE, .pending = false, .address = 0};
+    m->WATCHING = false;
+}
+
+void watch_breakpoint(Machine *m, Address16 pc, bool armed)
+{
+    set_watch(m->BREAKPOINTS, pc % PROG_MEM_SIZE, armed);
+    update_watching(m);
+}
+
+/* kind is WATCH_READ or WATCH_WRITE, a is a data space address. */
+void watch_data(Machine *m, Address16 a, WatchKind kind, bool armed)
+{
+    set_watch(kind == WATCH_READ ? m->READ_WATCHES : m->WRITE_WATCHES, a % DATA_MEM_SIZE, armed);
+    update_watching(m);
+}
+
+#endif
@@ -0,0 +1,196 @@
+"""Run the atsim command line on small programs.
+
+Each case's program is assembled as an instruction test's is, then run by the
+simulator itself (built by `make bin/atsim`), which must exit with the case's
+status and report the same status in its JSON dump. A program is also run from
+a prepared image, which must dump the same as the program itself.
+"""
+
+from argparse import ArgumentParser
+from dataclasses import dataclass
+from json import loads
+from os import path
+from struct import pack_into, unpack_from
+from subprocess import PIPE, run
+from tempfile import TemporaryDirectory
+from typing import List
+
+from instruction_tests import TEST_LINKER, TEST_ROOT, Test, build_test
+
+DEFAULT_ATSIM = path.join(TEST_ROOT, "..", "bin", "atsim")
+
+# Exit statuses, see RunStatus in src/atsim.c
+RUN_STATUSES = {"halted": 0, "timeout": 1, "usage": 2, "undecodable": 3}
+
+
+@dataclass
+class Case:
+    """Represents a program run with some arguments."""
+
+    name: str
+    test: List[str]
+    arguments: List[str]
+    status: str
+
+
+CASES = (
+    Case("halted", ["ldi r16, 0x12"], [], "halted"),
+    Case("timeout", ["loop:", "nop", "rjmp loop"], ["--max-cycles", "100"], "timeout"),
+    Case("undecodable", [".word 0xffff"], [], "undecodable"),
+    # CALL decodes, but isn't present on the ATtiny25/45/85
+    Case("missing", [".word 0x940e, 0x0003"], [], "undecodable"),
+)
+
+# Runs through most of the superinstructions, so a cache fused or not differs
+PREPARED = Case("prepared", [
+    "ldi r16, lo8(RAMEND)",
+    "out _SFR_IO_ADDR(SPL), r16",
+    "ldi r16, hi8(RAMEND)",
+    "out _SFR_IO_ADDR(SPH), r16",
+    "ldi r24, 0",
+    "ldi r25, 0",
+    "loop:",
+    "push r24",
+    "push r25",
+    "rcall step",
+    "pop r25",
+    "pop r24",
+    "adiw r24, 1",
+    "cpi r24, 40",
+    "cpc r25, r1",
+    "brne loop",
+    "rjmp done",
+    "step:",
+    "movw r26, r24",
+    "adiw r26, 3",
+    "add r16, r26",
+    "adc r17, r27",
+    "subi r18, 0xfd",
+    "sbci r19, 0xff",
+    "ret",
+    "done:",
+], [], "halted")
+
+# Header fields of a prepared image, see read_prepared in src/loader.c
+PREPARED_HEADER_SIZE = 56
+PREPARED_FLASH_SIZE = 24
+PREPARED_EEPROM_SIZE = 28
+PREPARED_HANDLER_HASH = 40
+PREPARED_FLAGS = 44
+PREPARED_FUSION = 0x1
+
+
+def change_u32(image: bytearray, offset: int, change: int):
+    """Flip the bits of change in a little endian word of an image."""
+    pack_into("<I", image, offset, unpack_from("<I", image, offset)[0] ^ change)
+
+
+def corrupt_handler(image: bytearray):
+    """Give the first predecode cache entry a handler no build has."""
+    image[PREPARED_HEADER_SIZE + unpack_from("<I", image, PREPARED_FLASH_SIZE)[0] +
+          unpack_from("<I", image, PREPARED_EEPROM_SIZE)[0]] = 0xff
+
+
+# Images changed as they would be by another build, or by corruption, whose
+# predecode cache is left for lazy decoding rather than taken
+PREPARED_VARIANTS = (
+    ("prepared", lambda image: None),
+    ("another handler table", lambda image: change_u32(image, PREPARED_HANDLER_HASH, 0x1)),
+    ("another FUSION", lambda image: change_u32(image, PREPARED_FLAGS, PREPARED_FUSION)),
+    ("corrupt handler", corrupt_handler),
+)
+
+
+def run_case(case: Case, atsim: str, build_dir: str, mcu: str) -> bool:
+    """Run a case's program, returning true if it ended as expected."""
+    image = path.join(build_dir, "{}.bin".format(case.name))
+    result = run([atsim, "--mcu", mcu, image, "--dump", "json"] + case.arguments,
+                 stdout=PIPE, stderr=PIPE, universal_newlines=True)
+    expected = RUN_STATUSES[case.status]
+    if result.returncode != expected:
+        print("  '{}' FAILURE: exited with {}, expected {}".format(case.name, result.returncode,
+                                                                  expected))
+        return False
+    status = loads(result.stdout)["status"]
+    if status != case.status:
+        print("  '{}' FAILURE: status {}, expected {}".format(case.name, status, case.status))
+        return False
+    print("  '{}' SUCCESS".format(case.name))
+    return True
+
+
+def run_prepared(case: Case, atsim: str, build_dir: str, mcu: str) -> bool:
+    """Prepare a case's program, then run it from the image as it is and as if
+    written by other builds, returning true if every run dumped as the program."""
+    image = path.join(build_dir, "{}.bin".format(case.name))
+    prepared = path.join(build_dir, "{}.atp".format(case.name))
+    arguments = ["--dump", "json"] + case.arguments
+    expected = run([atsim, "--mcu", mcu, image] + arguments, stdout=PIPE, stderr=PIPE,
+                   universal_newlines=True)
+    if expected.returncode != RUN_STATUSES[case.status]:
+        print("  '{}' FAILURE: exited with {}, expected {}".format(
+            case.name, expected.returncode, RUN_STATUSES[case.status]))
+        return False
+    if run([atsim, "--mcu", mcu, image, "--prepare", prepared]).returncode != 0:
+        print("  '{}' FAILURE: unable to prepare".format(case.name))
+        return False
+
+    with open(prepared, "rb") as prepared_file:
+        prepared_image = prepared_file.read()
+    passed = True
+    for name, change in PREPARED_VARIANTS:
+        variant = path.join(build_dir, "{} {}.atp".format(case.name, name))
+        variant_image = bytearray(prepared_image)
+        change(variant_image)
+        with open(variant, "wb") as variant_file:
+            variant_file.write(variant_image)
+        result = run([atsim, "--mcu", mcu, variant] + arguments, stdout=PIPE, stderr=PIPE,
+                     universal_newlines=True)
+        if (result.returncode, result.stdout) != (expected.returncode, expected.stdout):
+            print("  '{}' FAILURE: {} image not as the program".format(case.name, name))
+            passed = False
+        else:
+            print("  '{}' SUCCESS: {} image".format(case.name, name))
+    return passed
+
+
+def main() -> int:
+    """Entry point."""
+    argument_parser = ArgumentParser()
+
+    argument_parser.add_argument("--mcu", default="attiny85")
+    argument_parser.add_argument("--atsim", default=DEFAULT_ATSIM)
+
+    parsed_arguments = argument_parser.parse_args()
+
+    if not path.isfile(parsed_arguments.atsim):
+        print("Simulator {} not found, build it with `make bin/atsim`".format(
+            parsed_arguments.atsim))
+        return 1
+
+    with TemporaryDirectory(prefix="avr_cli_tests") as build_dir:
+        print("Building {} programs...".format(len(CASES) + 1))
+        with open(path.join(build_dir, "linker.ld"), "w") as test_asm_linker_file:
+            test_asm_linker_file.write(TEST_LINKER)
+
+        if any([build_test((Test(case.name, case.name, case.test), build_dir, parsed_arguments.mcu))
+                for case in CASES + (PREPARED, )]):
+            print("Tests failed!")
+            return 1
+
+        print("Running programs...")
+        results = [run_case(case, parsed_arguments.atsim, build_dir, parsed_arguments.mcu)
+                   for case in CASES]
+        results.append(run_prepared(PREPARED, parsed_arguments.atsim, build_dir,
+                                    parsed_arguments.mcu))
+
+    if all(results):
+        print("Tests successful!")
+        return 0
+
+    print("Tests failed!")
+    return 1
+
+
+if __name__ == "__main__":
+    exit(main())
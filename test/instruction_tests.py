@@ -1,36 +1,20 @@
-"""Run individual instruction tests."""
+"""Run individual instruction tests.
 
-from argparse import ArgumentParser, Namespace
+Each test's program is assembled on its own, then every test is run by the one
+test runner binary (built by `make bin/atsim_tests`), which reads the pre and
+postconditions from the .test files itself, see src/tests.c.
+"""
+
+from argparse import ArgumentParser
 from dataclasses import dataclass
-from os import chdir, devnull, getcwd, listdir, mkdir, path, remove
-from shutil import copytree, copy2
-from subprocess import CalledProcessError, check_call
+from os import devnull, listdir, path
+from subprocess import CalledProcessError, call, check_call
 from tempfile import TemporaryDirectory
 from typing import Iterable, List
 from multiprocessing import Pool
 
 TEST_ROOT = path.abspath(path.dirname(__file__))
-
-MAIN_OUTLINE = """\
-#include <stdio.h>
-#include "machine.h"
-
-#define assert(X) if(!(X)) {{_assertions++; printf("  ASSERTION %zu FAILED: " #X "\\n", _assertions); return 1;}}
-
-int main(void)
-{{
-    size_t _assertions = 0;
-    Machine m;
-    load_memory_from_file(&m, "{test_path}/test/{test_name}.bin");
-    m.PC = 0;
-    m.SKIP = false;
-    {pre}
-    run_until_halt_loop(&m);
-    {post}
-    return 0;
-}}
-
-"""
+DEFAULT_RUNNER = path.join(TEST_ROOT, "..", "bin", "atsim_tests")
 
 TEST_OUTLINE = """\
 #include <avr/io.h>
@@ -43,20 +27,6 @@ halt_loop:
 
 """
 
-TEST_CONFIG = """\
-#ifndef __ATSIM_CONFIG
-#define __ATSIM_CONFIG
-
-#define MCU_ATTiny85
-
-// #define DEBUG_PRINT_PC
-// #define DEBUG_PRINT_MNEMONICS
-// #define DEBUG_PRINT_OPERANDS
-
-#endif
-
-"""
-
 TEST_LINKER = """\
 SECTIONS
 {
@@ -66,216 +36,72 @@ SECTIONS
 
 """
 
-TEST_MAKEFILE = """\
-CC=avr-gcc
-MCU:={mcu}
-
-TARGET := {test_name}
-
-.PHONY: all
-
-all: $(TARGET).bin
-
-$(TARGET).o: $(TARGET).S
-	$(CC) -mmcu=$(MCU) -o $(TARGET).o -c $(TARGET).S
-
-$(TARGET).out: $(TARGET).o
-	avr-ld -Tlinker.ld $(TARGET).o -o $(TARGET).out
-
-$(TARGET).bin: $(TARGET).out
-	avr-objcopy -O binary $(TARGET).out $(TARGET).bin
-
-"""
-
 
 @dataclass
 class Test:
     """Represents a testcase."""
 
     name: str
-    precondition: List[str]
+    file_path: str
     test: List[str]
-    postcondition: List[str]
 
     @staticmethod
     def from_file(file_path: str) -> "Test":
-        """Read test from file."""
+        """Read test from file, the conditions are left to the test runner."""
         name, *_ = path.splitext(path.basename(file_path))
 
-        precondition: List[str] = []
-        postcondition: List[str] = []
         test: List[str] = []
 
-        in_precondition = False
-        in_postcondition = False
         in_test = False
 
         with open(file_path, "r") as lines:
             for line in lines:
                 line = line.strip()
                 if line.startswith("---"):
-                    in_precondition = False
-                    in_postcondition = False
-                    in_test = False
-
                     split_line = line.split()
-                    if len(split_line) < 2:
-                        section = ""
-                    else:
-                        _, section, *_ = split_line
-                    section = section.strip()
-
-                    if section == "precondition":
-                        in_precondition = True
-                    elif section == "postcondition":
-                        in_postcondition = True
-                    elif section == "test":
-                        in_test = True
-                elif in_precondition:
-                    precondition.append(line)
-                elif in_postcondition:
-                    postcondition.append(line)
+                    in_test = len(split_line) >= 2 and split_line[1] == "test"
                 elif in_test:
                     test.append(line)
 
-        return Test(name, precondition, test, postcondition)
+        return Test(name, file_path, test)
 
 
 def get_tests() -> Iterable[Test]:
     """Get all tests."""
     test_search_dir = path.join(TEST_ROOT, "instruction_tests")
 
-    for item_name in listdir(test_search_dir):
+    for item_name in sorted(listdir(test_search_dir)):
         full_path = path.join(test_search_dir, item_name)
 
         if path.isfile(full_path) and path.splitext(full_path)[-1] == ".test":
             yield Test.from_file(full_path)
 
 
-def run_test(test: Test, parsed_arguments: Namespace, pooled_prefix="") -> int:
-    """Run a test."""
-    test_dir = test.name
+def build_test(args) -> int:
+    """Assemble a test's program to <name>.bin in the build directory."""
+    test, build_dir, mcu = args
+    source = path.join(build_dir, "{}.S".format(test.name))
+    base = path.join(build_dir, test.name)
 
-    mkdir(test_dir)
-
-    copytree("../src", path.join(test_dir, "src"))
-    copytree("../obj", path.join(test_dir, "obj"))
-    copy2("../Makefile", path.join(test_dir, "Makefile"))
-    copy2("../instructions.py", path.join(test_dir, "instructions.py"))
-
-    with open(path.join(test_dir, "src", "atsim.c"), "w") as test_c_file:
-        test_c_file.write(
-            MAIN_OUTLINE.format(test_name=test.name,
-                                test_path=test_dir,
-                                pre="\n    ".join(test.precondition),
-                                post="\n    ".join(test.postcondition)))
-
-    mkdir(path.join(test_dir, "test"))
-
-    with open(path.join(test_dir, "test", "{}.S".format(test.name)), "w") as test_asm_file:
+    with open(source, "w") as test_asm_file:
         test_asm_file.write(TEST_OUTLINE.format(test="\n    ".join(test.test)))
 
-    with open(path.join(test_dir, "test", "linker.ld"), "w") as test_asm_linker_file:
-        test_asm_linker_file.write(TEST_LINKER)
-
-    with open(path.join(test_dir, "test", "Makefile"), "w") as test_asm_makefile_file:
-        test_asm_makefile_file.write(
-            TEST_MAKEFILE.format(test_name=test.name, mcu=parsed_arguments.mcu))
-
-    if parsed_arguments.pool < 2:
-        print("  Building AVR test...")
-
     with open(devnull, "w") as null_out:
         try:
-            check_call(["make", "-C", path.join(test_dir, "test")], stdout=null_out)
-        except CalledProcessError as error:
-            if parsed_arguments.pool < 2:
-                print("  BUILD FAILURE")
-            else:
-                print("  {}BUILD '{}' FAILURE".format(pooled_prefix, test.name))
-            return error.returncode
-
-        if parsed_arguments.pool < 2:
-            print("  Building simulator harness...")
-        try:
-            check_call([
-                "make", "-C", test_dir, "PYTHON={}".format(parsed_arguments.python)
-                if parsed_arguments.python else "python3"
-            ],
+            check_call(["avr-gcc", "-mmcu={}".format(mcu), "-o", base + ".o", "-c", source],
                        stdout=null_out)
-        except CalledProcessError as error:
-            if parsed_arguments.pool < 2:
-                print("  BUILD FAILURE")
-            else:
-                print("  {}BUILD '{}' FAILURE".format(pooled_prefix, test.name))
-            return error.returncode
-
-    if parsed_arguments.pool < 2:
-        print("  Executing test...")
-    try:
-        check_call([path.join(test_dir, "bin", "atsim")])
-    except CalledProcessError as error:
-        if parsed_arguments.pool < 2:
-            print("  TEST FAILURE")
-        else:
-            print("  {}TEST '{}' FAILURE".format(pooled_prefix, test.name))
-        return error.returncode
-    if parsed_arguments.pool < 2:
-        print("  TEST SUCCESS")
-    else:
-        print("  {}TEST '{}' SUCCESS".format(pooled_prefix, test.name))
-
-    return 0
-
-
-def run_test_wrapper(args) -> int:
-    """Wrap run_test for pooled execution."""
-    return run_test(*args)
-
-
-def run_tests(test_dir: str, parsed_arguments: Namespace) -> int:
-    """Run all tests until a failure, or the end."""
-    all_tests = list(get_tests())
-    test_count = len(all_tests)
-    chdir(path.join(test_dir, "tests"))
-    if parsed_arguments.pool > 1:
-        print("Running tests with pool of {}...".format(parsed_arguments.pool))
-        with Pool(parsed_arguments.pool) as p:
-            pool_result = p.map(
-                run_test_wrapper,
-                [(test, parsed_arguments, "{:03d}/{:03d} ".format(test_index, test_count))
-                 for test_index, test in enumerate(all_tests, 1)])
-            if any(pool_result):
-                return 1
-    else:
-        for test_index, test in enumerate(all_tests, 1):
-            print("{:03d}/{:03d} {}".format(test_index, test_count, test.name))
-            result = run_test(test, parsed_arguments)
-
-            if result != 0:
-                return result
-
-    return 0
-
-
-def prebuild(test_dir: str, parsed_arguments: Namespace) -> int:
-    """Prebuild the instructions which won't change for each test."""
-    original_location = getcwd()
-    chdir(test_dir)
-    print("Prebuilding shared data...")
-    with open(devnull, "w") as null_out:
-        try:
-            check_call([
-                "make", "PYTHON={}".format(parsed_arguments.python)
-                if parsed_arguments.python else "python3"
-            ],
+            check_call(["avr-ld", "-T", path.join(build_dir, "linker.ld"), base + ".o",
+                        "-o", base + ".out"],
+                       stdout=null_out)
+            check_call(["avr-objcopy", "-O", "binary", base + ".out", base + ".bin"],
                        stdout=null_out)
         except CalledProcessError as error:
-            print("  BUILD FAILURE")
+            print("  BUILD '{}' FAILURE".format(test.name))
             return error.returncode
-        finally:
-            chdir(original_location)
-    print("  BUILD SUCCESS")
+        except OSError as error:
+            print("  BUILD '{}' FAILURE: {}".format(test.name, error))
+            return 1
+
     return 0
 
 
@@ -283,27 +109,37 @@ def main() -> int:
     """Entry point."""
     argument_parser = ArgumentParser()
 
-    argument_parser.add_argument("--pool", type=int, default=1)
+    argument_parser.add_argument("--pool", type=int, default=0,
+                                 help="threads to run tests on, 0 for every core")
     argument_parser.add_argument("--mcu", default="attiny85")
-    argument_parser.add_argument("--python", default="python3")
+    argument_parser.add_argument("--runner", default=DEFAULT_RUNNER)
 
     parsed_arguments = argument_parser.parse_args()
 
-    print("Running tests...")
-
-    result_code = 0
-
-    with TemporaryDirectory(prefix="avr_tests") as test_dir:
-        copytree(path.join(TEST_ROOT, "../src"), path.join(test_dir, "src"))
-        copy2(path.join(TEST_ROOT, "../Makefile"), path.join(test_dir, "Makefile"))
-        copy2(path.join(TEST_ROOT, "../instructions.py"), path.join(test_dir, "instructions.py"))
-        prebuild(test_dir, parsed_arguments)
-        remove(path.join(test_dir, "src", "atsim.c"))
-        mkdir(path.join(test_dir, "tests"))
-        original_location = getcwd()
-        chdir(test_dir)
-        result_code = run_tests(test_dir, parsed_arguments)
-        chdir(original_location)
+    if not path.isfile(parsed_arguments.runner):
+        print("Test runner {} not found, build it with `make bin/atsim_tests`".format(
+            parsed_arguments.runner))
+        return 1
+
+    all_tests = list(get_tests())
+
+    with TemporaryDirectory(prefix="avr_tests") as build_dir:
+        print("Building {} tests...".format(len(all_tests)))
+        with open(path.join(build_dir, "linker.ld"), "w") as test_asm_linker_file:
+            test_asm_linker_file.write(TEST_LINKER)
+
+        with Pool(parsed_arguments.pool if parsed_arguments.pool > 0 else None) as p:
+            build_result = p.map(build_test, [(test, build_dir, parsed_arguments.mcu)
+                                              for test in all_tests])
+        if any(build_result):
+            print("Tests failed!")
+            return 1
+
+        print("Running tests...")
+        result_code = call([
+            parsed_arguments.runner, "--mcu", parsed_arguments.mcu,
+            "--threads", str(parsed_arguments.pool), "--bin-dir", build_dir
+        ] + [test.file_path for test in all_tests])
 
     if result_code == 0:
         print("Tests successful!")